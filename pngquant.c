@@ -13,12 +13,38 @@ usage:  pngquant [options] [ncolors] -- pngfile [pngfile ...]\n\
 options:\n\
   --force           overwrite existing output files (synonym: -f)\n\
   --skip-if-larger  only save converted files if they're smaller than original\n\
+  --copy-if-larger  like above, but save a copy of the original instead\n\
   --output file     destination file path to use instead of --ext (synonym: -o)\n\
   --ext new.png     set custom suffix/extension for output filenames\n\
   --quality min-max don't save below min, use fewer colors below max (0-100)\n\
   --speed N         speed/quality trade-off. 1=slow, 4=default, 11=fast & rough\n\
+  --speed auto[=M]  choose speed per file to process about M megapixels/s\n\
   --nofs            disable Floyd-Steinberg dithering\n\
   --posterize N     output lower-precision color (e.g. for ARGB4444 output)\n\
+  --max-memory SIZE don't start more files at once than fit in SIZE (e.g. 4G)\n\
+  --deadline MS     use faster settings for images that take longer than MS\n\
+  --max-pixels N    refuse to decode images larger than N pixels (e.g. 100M)\n\
+  --skip-palette N  skip files that already have a palette of N or fewer colors\n\
+  --skip-smaller SIZE skip files smaller than SIZE bytes\n\
+  --target-size SIZE use as many colors as fit in SIZE bytes (e.g. 50K)\n\
+  --variants SPEC   write several variants, e.g. \"colors=256,64;floyd=1,0\"\n\
+  --shared-palette  use one palette for all files (e.g. sprites, frames)\n\
+  --dedupe[=how]    convert identical files once; copy, hardlink or reflink\n\
+  --emit-histogram file  save colors of all files instead of converting them\n\
+  --emit-palette file    save a palette for all files, for use with --map\n\
+  --merge-histograms     inputs are histogram files to combine\n\
+  --watch dir       convert new files in the directory as they appear (Linux)\n\
+  --recursive dir   convert files in the directory and its subdirectories\n\
+  --output-dir dir  with --recursive, save files there with the same relative paths\n\
+  --include/--exclude glob  names of files to convert in --watch and --recursive\n\
+  --files-from file read names of files to convert from the file, one per line\n\
+  --shard K/N       convert only the K-th of N parts of the files (K = 1..N)\n\
+  --shard-by-size   split into shards by numbers of pixels instead of names\n\
+  --summary file    save counts and sizes of converted files\n\
+  --merge-summaries inputs are summary files of shards to combine\n\
+  --serve socket    convert images sent in memfds over the Unix socket (Linux)\n\
+  --raw[=page]      write palette and indices uncompressed, e.g. for textures\n\
+  --dry-run         only print expected sizes and quality; don't write files\n\
   --strip           remove optional metadata (default on Mac)\n\
   --verbose         print status messages (synonym: -v)\n\
 \n\
@@ -32,19 +58,44 @@ The default behavior if the output file exists is to skip the conversion;\n\
 use --force to overwrite. See man page for full list of options.\n";
 
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* memfd_create() and file seals for --serve */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <math.h>
+#include <time.h>
 
 #if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
 #include <fcntl.h>    /* O_BINARY */
 #include <io.h>   /* setmode() */
 #include <locale.h> /* UTF-8 locale */
+#include <windows.h> /* Sleep() */
 #else
 #include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h> /* pngquant_context */
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h> /* memfd_create() */
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h> /* SO_SNDTIMEO */
+#include <sys/un.h>
+#include <linux/fs.h> /* FICLONE */
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#endif
 #endif
 
 #ifdef _OPENMP
@@ -57,15 +108,26 @@ use --force to overwrite. See man page for full list of options.\n";
 #include "rwpng.h"  /* typedefs, common macros, public prototypes */
 #include "libimagequant.h" /* if it fails here, run: git submodule update or add -Ilib to compiler flags */
 #include "pngquant_opts.h"
+#include "pngquant.h"
+#include "pngquant_raw.h"
+#include "pngquant_serve.h"
+#include "pngquant_trace.h"
 
 char *PNGQUANT_VERSION = LIQ_VERSION_STRING " (January 2022)";
 
 static pngquant_error prepare_output_image(liq_result *result, liq_image *input_image, rwpng_color_transform tag, png8_image *output_image);
 static void set_palette(liq_result *result, png8_image *output_image);
-static pngquant_error read_image(liq_attr *options, const char *filename, int using_stdin, png24_image *input_image_p, liq_image **liq_image_p, bool keep_input_pixels, bool strip, bool verbose);
+static pngquant_error read_image(liq_attr *options, const char *filename, FILE *input_stream, png24_image *input_image_p, liq_image **liq_image_p, bool keep_input_pixels, bool strip, bool verbose);
+static FILE *input_stream(const struct pngquant_options *options);
 static pngquant_error write_image(png8_image *output_image, png24_image *output_image24, const char *outname, struct pngquant_options *options, liq_attr *liq);
 static char *add_filename_extension(const char *filename, const char *newext);
+static const char *undithered_extension(const struct pngquant_options *options);
+static char *undithered_filename(const char *outname, const struct pngquant_options *options);
 static bool file_exists(const char *outname);
+static char *temp_filename(const char *basename);
+static bool replace_file(const char *from, const char *to, const bool force);
+static const char *filename_part(const char *path);
+static pngquant_error duplicate_output_file(const char *original_outname, const char *outname, struct pngquant_options *options, liq_attr *liq);
 
 static void verbose_printf(liq_attr *liq, struct pngquant_options *context, const char *fmt, ...)
 {
@@ -199,151 +261,3755 @@ static bool parse_quality(const char *quality, liq_attr *options, bool *min_qual
     return LIQ_OK == liq_set_quality(options, limit, target);
 }
 
-pngquant_error pngquant_main_internal(struct pngquant_options *options, liq_attr *liq);
-static pngquant_error pngquant_file_internal(const char *filename, const char *outname, struct pngquant_options *options, liq_attr *liq);
+static double current_time(void)
+{
+#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
+    return GetTickCount64() / 1000.0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
 
-#ifndef PNGQUANT_NO_MAIN
-int main(int argc, char *argv[])
+struct memory_budget {
+    size_t limit, in_use;
+    unsigned int next_ticket, now_serving;
+};
+
+static void sleep_briefly(void)
 {
-    struct pngquant_options options = {
-        .floyd = 1.f, // floyd-steinberg dithering
-        .strip = false,
-    };
+#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
+    Sleep(1);
+#else
+    usleep(1000);
+#endif
+}
 
-    pngquant_error retval = pngquant_parse_options(argc, argv, &options);
-    if (retval != SUCCESS) {
-        return retval;
+/*
+ * Peak memory needed to quantize an image of this size: RGBA pixels,
+ * indexed pixels, libimagequant's noise/edge/dither maps and its float copy of the image
+ * (which it doesn't make for large images, processing them a few rows at a time instead).
+ */
+static size_t estimate_memory_use(uint32_t width, uint32_t height)
+{
+    const size_t pixels = (size_t)width * height;
+    const size_t float_pixels = pixels * 16 <= (1<<26) ? pixels * 16 : 0;
+    return pixels * (4 + 1 + 3) + float_pixels + (1<<20); // +zlib and libpng state
+}
+
+struct input_file {
+    const char *filename;
+    unsigned int index; // position on the command line
+    bool has_header; // if the header can't be read, decoding will report the error
+    png_header header;
+
+    // for --dedupe
+    bool has_hash, is_duplicate, has_duplicates;
+    uint64_t hash, file_size;
+    unsigned int duplicate_of; // command line position of the identical file that's converted instead
+    // set by the identical file when it's done
+    char *outname;
+    bool undithered_name;
+    pngquant_error retval;
+    bool done;
+};
+
+static void prescan_file(struct input_file *input)
+{
+    FILE *fp = fopen(input->filename, "rb");
+    if (!fp) return;
+
+    input->has_header = SUCCESS == rwpng_read_header(fp, &input->header);
+    fclose(fp);
+}
+
+static size_t input_pixels(const struct input_file *input)
+{
+    return input->has_header ? (size_t)input->header.width * input->header.height : 0;
+}
+
+static int compare_largest_first(const void *a, const void *b)
+{
+    const struct input_file *input_a = a, *input_b = b;
+    // duplicates wait for the files they duplicate, so these must all be started before them
+    if (input_a->is_duplicate != input_b->is_duplicate) {
+        return input_a->is_duplicate ? 1 : -1;
     }
+    const size_t pixels_a = input_pixels(input_a), pixels_b = input_pixels(input_b);
+    if (pixels_a != pixels_b) {
+        return pixels_a < pixels_b ? 1 : -1;
+    }
+    return input_a->index < input_b->index ? -1 : 1;
+}
 
-    if (options.print_version) {
-        puts(PNGQUANT_VERSION);
-        return SUCCESS;
+#define DEDUPE_BUFFER_SIZE (1<<16)
+
+static bool hash_file(struct input_file *input)
+{
+    FILE *fp = fopen(input->filename, "rb");
+    if (!fp) return false;
+
+    unsigned char *buffer = malloc(DEDUPE_BUFFER_SIZE);
+    uint64_t hash = 0x9E3779B97F4A7C15ULL, size = 0;
+    size_t len;
+    while (buffer && (len = fread(buffer, 1, DEDUPE_BUFFER_SIZE, fp)) > 0) {
+        for(size_t i=0; i < len; i += 8) {
+            uint64_t word = 0;
+            memcpy(&word, buffer + i, len - i < 8 ? len - i : 8);
+            hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+            hash ^= hash >> 29;
+        }
+        size += len;
     }
+    const bool ok = buffer && !ferror(fp);
+    free(buffer);
+    fclose(fp);
 
-    if (options.missing_arguments) {
-        print_full_version(stderr);
-        print_usage(stderr);
-        return MISSING_ARGUMENT;
+    input->has_hash = ok;
+    input->hash = hash;
+    input->file_size = size;
+    return ok;
+}
+
+static bool files_are_identical(const char *filename_a, const char *filename_b)
+{
+    FILE *fp_a = fopen(filename_a, "rb"), *fp_b = fopen(filename_b, "rb");
+    unsigned char *buffer_a = malloc(DEDUPE_BUFFER_SIZE), *buffer_b = malloc(DEDUPE_BUFFER_SIZE);
+    bool identical = fp_a && fp_b && buffer_a && buffer_b;
+    while (identical) {
+        const size_t len_a = fread(buffer_a, 1, DEDUPE_BUFFER_SIZE, fp_a);
+        const size_t len_b = fread(buffer_b, 1, DEDUPE_BUFFER_SIZE, fp_b);
+        identical = len_a == len_b && 0 == memcmp(buffer_a, buffer_b, len_a) && !ferror(fp_a) && !ferror(fp_b);
+        if (!len_a) break;
     }
+    free(buffer_a);
+    free(buffer_b);
+    if (fp_a) fclose(fp_a);
+    if (fp_b) fclose(fp_b);
+    return identical;
+}
 
-    if (options.print_help) {
-        print_full_version(stdout);
-        print_usage(stdout);
-        return SUCCESS;
+static int compare_hash(const void *a, const void *b)
+{
+    const struct input_file *input_a = *(struct input_file *const *)a, *input_b = *(struct input_file *const *)b;
+    if (input_a->hash != input_b->hash) return input_a->hash < input_b->hash ? -1 : 1;
+    if (input_a->file_size != input_b->file_size) return input_a->file_size < input_b->file_size ? -1 : 1;
+    return input_a->index < input_b->index ? -1 : 1;
+}
+
+/*
+ * Marks files that have the same bytes as a file earlier on the command line.
+ * Matching hashes are compared byte by byte, so a hash collision can't make a wrong output.
+ */
+static unsigned int find_duplicate_inputs(struct input_file *inputs, unsigned int num_files)
+{
+    #pragma omp parallel for schedule(dynamic)
+    for(int i=0; i < num_files; i++) {
+        hash_file(&inputs[i]);
     }
 
-#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
-    setlocale(LC_ALL, ".65001"); // issue #376; set UTF-8 for Unicode filenames
-#endif
+    struct input_file **sorted = malloc(num_files * sizeof(sorted[0]));
+    if (!sorted) return 0;
+    for(unsigned int i=0; i < num_files; i++) {
+        sorted[i] = &inputs[i];
+    }
+    qsort(sorted, num_files, sizeof(sorted[0]), compare_hash);
 
-    liq_attr *liq = liq_attr_create();
+    unsigned int duplicates = 0;
+    for(unsigned int i=1; i < num_files; i++) {
+        struct input_file *input = sorted[i];
+        if (!input->has_hash) continue;
+        // earlier files in the group of the same hash are the candidates, usually just one
+        for(unsigned int j = i; j-- > 0;) {
+            struct input_file *candidate = sorted[j];
+            if (!candidate->has_hash || candidate->hash != input->hash || candidate->file_size != input->file_size) break;
+            if (!candidate->is_duplicate && files_are_identical(candidate->filename, input->filename)) {
+                input->is_duplicate = true;
+                input->duplicate_of = candidate->index;
+                candidate->has_duplicates = true;
+                duplicates++;
+                break;
+            }
+        }
+    }
+    free(sorted);
+    return duplicates;
+}
 
-    if (!liq) {
-        fputs("SSE-capable CPU is required for this build.\n", stderr);
-        return WRONG_ARCHITECTURE;
+static pngquant_error wait_for_original(const struct input_file *original)
+{
+    for(;;) {
+        bool done;
+        #pragma omp atomic read
+        done = original->done;
+        #pragma omp flush
+        if (done) {
+            return original->retval;
+        }
+        sleep_briefly();
+    }
+}
+
+/*
+ * Rejects or skips files using only what's known from the header, before anything large is allocated for them.
+ * Without liq the reason isn't reported.
+ */
+static pngquant_error check_input_policy(const struct input_file *input, struct pngquant_options *options, liq_attr *liq)
+{
+    const png_header *header = &input->header;
+    if (options->max_pixels && input_pixels(input) > options->max_pixels) {
+        if (liq) fprintf(stderr, "  error: %s is %ux%u, which is more pixels than --max-pixels allows\n", input->filename, header->width, header->height);
+        return TOO_MANY_PIXELS;
+    }
+    if (options->skip_smaller && header->file_size < options->skip_smaller) {
+        if (liq) verbose_printf(liq, options, "%s: skipped, because the file is only %lu bytes", input->filename, (unsigned long)header->file_size);
+        return SKIPPED_INPUT;
+    }
+    if (options->skip_palette_colors && 3 == header->color_type && header->num_palette <= options->skip_palette_colors) {
+        if (liq) verbose_printf(liq, options, "%s: skipped, because it already has %u-color palette", input->filename, header->num_palette);
+        return SKIPPED_INPUT;
+    }
+    return SUCCESS;
+}
+
+static pngquant_error copy_original_file(const char *filename, const char *outname, struct pngquant_options *options, liq_attr *liq)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
+        return READ_ERROR;
+    }
+
+    png24_image original = {.width=0};
+    pngquant_error retval = READ_ERROR;
+    long size;
+    if (0 == fseek(fp, 0, SEEK_END) && (size = ftell(fp)) > 0 && 0 == fseek(fp, 0, SEEK_SET)) {
+        original.file_size = size;
+        original.file_data = malloc(original.file_size);
+        if (!original.file_data) {
+            retval = OUT_OF_MEMORY_ERROR;
+        } else if (fread(original.file_data, original.file_size, 1, fp) == 1) {
+            retval = SUCCESS;
+        }
+    }
+    fclose(fp);
+
+    if (SUCCESS == retval) {
+        retval = write_image(NULL, &original, outname, options, liq);
+    }
+    rwpng_free_image24(&original);
+    return retval;
+}
+
+/*
+ * Waits until the job fits in the memory budget. Jobs are admitted in order of arrival,
+ * so that a large image can't be starved by a stream of small ones.
+ * A job larger than the whole budget is only started when nothing else is running.
+ * Returns time spent waiting.
+ */
+static double memory_budget_acquire(struct memory_budget *budget, size_t bytes)
+{
+    const double start = current_time();
+    unsigned int ticket;
+    #pragma omp critical (memory_budget)
+    {
+        ticket = budget->next_ticket++;
+    }
+
+    bool admitted = false;
+    for(;;) {
+        #pragma omp critical (memory_budget)
+        {
+            if (ticket == budget->now_serving && (0 == budget->in_use || budget->in_use + bytes <= budget->limit)) {
+                budget->in_use += bytes;
+                budget->now_serving++;
+                admitted = true;
+            }
+        }
+        if (admitted) break;
+        sleep_briefly();
+    }
+    return current_time() - start;
+}
+
+static void memory_budget_release(struct memory_budget *budget, size_t bytes)
+{
+    #pragma omp critical (memory_budget)
+    {
+        budget->in_use -= bytes;
+    }
+}
+
+enum deadline_fallback {
+    DEADLINE_FASTER_SPEED = 1,
+    DEADLINE_NO_DITHERING = 2,
+};
+
+struct pngquant_file_stats {
+    unsigned int deadline_fallback; // enum deadline_fallback flags
+    int auto_speed; // 1-11 if chosen automatically
+    bool undithered_name; // speed 11 turned dithering off, so the output got the "-or8" name
+    size_t input_size, output_size, pixels;
+    int quality_percent;
+    double mse;
+    // predicted by --dry-run
+    size_t estimated_size;
+};
+
+/*
+ * --dry-run prints to stdout even without --verbose, because the report is its output.
+ * Returns true if the file counts towards the total.
+ */
+static bool print_dry_run_estimate(const char *filename, const struct pngquant_file_stats *stats, pngquant_error retval)
+{
+    if (stats->estimated_size) {
+        printf("%s: %llu -> %llu bytes (%.1f%%), Q=%d, MSE=%.3f%s\n", filename,
+               (unsigned long long)stats->input_size, (unsigned long long)stats->estimated_size,
+               100.0 * stats->estimated_size / stats->input_size, stats->quality_percent, stats->mse,
+               TOO_LARGE_FILE == retval ? ", would be skipped" : "");
+        return SUCCESS == retval;
+    }
+    if (TOO_LOW_QUALITY == retval) {
+        printf("%s: quality too low, would be skipped\n", filename);
+    }
+    return false;
+}
+
+static void print_dry_run_total(unsigned int count, unsigned long long input_bytes, unsigned long long output_bytes, double quality_sum)
+{
+    if (count) {
+        printf("Total: %u file%s, %llu -> %llu bytes (%.1f%%), average Q=%.0f\n",
+               count, (count == 1)? "" : "s", input_bytes, output_bytes,
+               100.0 * output_bytes / input_bytes, quality_sum / count);
+    }
+}
+
+/*
+ * Rough cost of quantizing, remapping and compressing at speeds 1-11:
+ * fixed overhead per image (in seconds) and megapixels per second after that.
+ * Actual timings of files in the batch are used to scale these.
+ */
+static const struct {float overhead, mpix_per_sec;} speed_cost[12] = {
+    {0,0}, {0.3f,1}, {0.15f,2}, {0.08f,3}, {0.05f,4}, {0.03f,5}, {0.025f,6}, {0.02f,7}, {0.015f,8}, {0.01f,9}, {0.005f,15}, {0.003f,25},
+};
+
+struct auto_speed_model {
+    double time_scale; // measured/predicted time, averaged over files converted so far
+};
+
+static double predicted_time(int speed, size_t pixels)
+{
+    return speed_cost[speed].overhead + pixels / 1e6 / speed_cost[speed].mpix_per_sec;
+}
+
+// Slowest speed that is expected to process the image at the target throughput
+static int choose_auto_speed(struct auto_speed_model *model, float target_mpix_per_sec, size_t pixels)
+{
+    double time_scale;
+    #pragma omp critical (auto_speed)
+    {
+        time_scale = model->time_scale;
+    }
+
+    int speed = 1;
+    while(speed < 11 && pixels / 1e6 < target_mpix_per_sec * predicted_time(speed, pixels) * time_scale) {
+        speed++;
+    }
+    return speed;
+}
+
+static void update_auto_speed_model(struct auto_speed_model *model, int speed, size_t pixels, double seconds)
+{
+    const double ratio = seconds / predicted_time(speed, pixels);
+    #pragma omp critical (auto_speed)
+    {
+        model->time_scale = model->time_scale * 0.7 + ratio * 0.3;
+    }
+}
+
+// Aborts libimagequant's work when the time pointed to by user_info has passed
+static int deadline_progress_callback(float progress_percent, void *user_info)
+{
+    (void)progress_percent;
+    const double *deadline = user_info;
+    return current_time() < *deadline;
+}
+
+/*
+ * PNG doesn't care about the order of the palette, except that tRNS has to cover every entry up to
+ * the last translucent one. Rows aren't filtered, so deflate mostly sees the same data in any order,
+ * but numbering colors of neighboring pixels consecutively still saves a little.
+ */
+struct palette_order {
+    unsigned char new_index[256];
+    unsigned int num_translucent;
+    bool changed;
+    unsigned int old_num_trans; // before it's applied, for --verbose
+};
+
+/*
+ * Palettes from --map and --shared-palette are meant to be the same in every file, --transbug needs the transparent
+ * entry last, and --emit-palette writes the palette itself, so in these cases the order is left as it is,
+ * and a gray palette isn't replaced with grayscale either.
+ */
+static bool may_reorder_palette(const struct pngquant_options *options)
+{
+    return !options->fixed_palette_image && !options->last_index_transparent && !options->emit_palette;
+}
+
+/* bytes of the tRNS chunk, including its length, type and CRC, or 0 if it isn't needed */
+static unsigned int trns_chunk_size(unsigned int num_trans)
+{
+    return num_trans ? 12 + num_trans : 0;
+}
+
+static void order_translucent_first(const png8_image *image, struct palette_order *order)
+{
+    unsigned int next = 0;
+    for(unsigned int i=0; i < image->num_palette; i++) {
+        if (image->palette[i].a < 255) order->new_index[i] = next++;
+    }
+    order->num_translucent = next;
+    for(unsigned int i=0; i < image->num_palette; i++) {
+        if (image->palette[i].a == 255) order->new_index[i] = next++;
+    }
+    order->changed = false;
+    for(unsigned int i=0; i < image->num_palette; i++) {
+        order->changed |= order->new_index[i] != i;
+    }
+}
+
+static uint32_t color_key(rwpng_rgba px)
+{
+    return (uint32_t)px.r << 24 | (uint32_t)px.g << 16 | (uint32_t)px.b << 8 | px.a;
+}
+
+/*
+ * Within the translucent and the opaque entries, starts from the most used color, and then keeps picking
+ * the color that is most often next to (left of or above) the previous one. Returns false if out of memory.
+ * Ties are broken by the color, not by its index, so an image that has been ordered already keeps its order.
+ */
+static bool order_by_adjacency(const png8_image *image, struct palette_order *order)
+{
+    const unsigned int num_palette = image->num_palette;
+    uint32_t *adjacent = calloc(num_palette * num_palette, sizeof(adjacent[0]));
+    if (!adjacent) return false;
+
+    uint64_t counts[256] = {0};
+    for(uint32_t row = 0; row < image->height; row++) {
+        const unsigned char *indices = image->row_pointers[row];
+        const unsigned char *above = row ? image->row_pointers[row-1] : NULL;
+        counts[indices[0]]++;
+        if (above && indices[0] != above[0]) {
+            adjacent[indices[0] * num_palette + above[0]]++;
+        }
+        for(uint32_t col = 1; col < image->width; col++) {
+            const unsigned int index = indices[col];
+            counts[index]++;
+            if (index != indices[col-1]) {
+                adjacent[index * num_palette + indices[col-1]]++;
+            }
+            if (above && index != above[col]) {
+                adjacent[index * num_palette + above[col]]++;
+            }
+        }
+    }
+
+    bool placed[256] = {false};
+    unsigned int next = 0;
+    for(int group = 0; group < 2; group++) {
+        const bool translucent = 0 == group;
+        int previous = -1;
+        for(;;) {
+            int best = -1;
+            uint64_t best_adjacent = 0;
+            for(unsigned int i=0; i < num_palette; i++) {
+                if (placed[i] || translucent != (image->palette[i].a < 255)) continue;
+                const uint64_t adj = previous < 0 ? 0 : (uint64_t)adjacent[previous * num_palette + i] + adjacent[i * num_palette + previous];
+                if (best < 0 || adj > best_adjacent || (adj == best_adjacent && (counts[i] > counts[best] ||
+                    (counts[i] == counts[best] && color_key(image->palette[i]) < color_key(image->palette[best]))))) {
+                    best = i;
+                    best_adjacent = adj;
+                }
+            }
+            if (best < 0) break;
+            placed[best] = true;
+            order->new_index[best] = next++;
+            previous = best;
+        }
+        if (translucent) {
+            order->num_translucent = next;
+        }
+    }
+    free(adjacent);
+
+    order->changed = false;
+    for(unsigned int i=0; i < num_palette; i++) {
+        order->changed |= order->new_index[i] != i;
+    }
+    return true;
+}
+
+/* The same lookup for every byte, in one pass over contiguous memory, which compilers can unroll and vectorize */
+static void remap_indices(unsigned char *restrict indices, size_t size, const unsigned char *restrict new_index)
+{
+    for(size_t i=0; i < size; i++) {
+        indices[i] = new_index[indices[i]];
+    }
+}
+
+static void apply_palette_order(png8_image *image, const struct palette_order *order)
+{
+    rwpng_rgba palette[256];
+    for(unsigned int i=0; i < image->num_palette; i++) {
+        palette[order->new_index[i]] = image->palette[i];
+    }
+    memcpy(image->palette, palette, image->num_palette * sizeof(palette[0]));
+}
+
+/*
+ * Output stage before compression. Ordering an image again doesn't change it, so --target-size measures
+ * candidates with the order they're written with.
+ */
+static void reorder_palette(png8_image *image, bool keep_palette, struct palette_order *order)
+{
+    image->keep_palette = keep_palette;
+    order->changed = false;
+    if (keep_palette) return;
+
+    // counting neighbors is another pass over the image, which fast compression doesn't wait for
+    if (image->fast_compression || image->num_palette < 3 || !order_by_adjacency(image, order)) {
+        order_translucent_first(image, order); // doesn't need memory
+    }
+    if (!order->changed) return;
+
+    order->old_num_trans = 0;
+    for(unsigned int i=0; i < image->num_palette; i++) {
+        if (image->palette[i].a < 255) order->old_num_trans = i+1;
+    }
+
+    apply_palette_order(image, order);
+    remap_indices(image->indexed_data, (size_t)image->width * image->height, order->new_index);
+}
+
+#define EXACT_COLORS_HASH_BITS 10 // hash table needs to be a few times larger than 256 colors
+
+/*
+ * Lossless conversion for images that have few enough unique colors to fit in the palette.
+ * Gives up as soon as it finds more than max_colors, leaving output_image for the caller to free.
+ */
+static bool index_exact_colors(const png24_image *input_image, unsigned int max_colors, png8_image *output_image)
+{
+    uint32_t keys[1<<EXACT_COLORS_HASH_BITS];
+    int16_t indices[1<<EXACT_COLORS_HASH_BITS];
+    memset(indices, -1, sizeof(indices));
+    unsigned int num_colors = 0;
+
+    output_image->width = input_image->width;
+    output_image->height = input_image->height;
+    output_image->indexed_data = malloc((size_t)output_image->height * (size_t)output_image->width);
+    output_image->row_pointers = malloc((size_t)output_image->height * sizeof(output_image->row_pointers[0]));
+    if (!output_image->indexed_data || !output_image->row_pointers) {
+        return false;
+    }
+
+    uint32_t last_key = 0;
+    int last_index = -1;
+    for(uint32_t row = 0; row < input_image->height; row++) {
+        const rwpng_rgba *pixels = (const rwpng_rgba *)input_image->row_pointers[row];
+        unsigned char *indexed = output_image->row_pointers[row] = output_image->indexed_data + (size_t)row * output_image->width;
+
+        for(uint32_t col = 0; col < input_image->width; col++) {
+            rwpng_rgba px = pixels[col];
+            if (px.a == 0) {
+                px = (rwpng_rgba){0,0,0,0}; // all fully transparent colors are the same
+            }
+            uint32_t key;
+            memcpy(&key, &px, sizeof(key));
+
+            if (key != last_key || last_index < 0) {
+                unsigned int slot = (key * 2654435761U) >> (32 - EXACT_COLORS_HASH_BITS);
+                while(indices[slot] >= 0 && keys[slot] != key) {
+                    slot = (slot + 1) & ((1<<EXACT_COLORS_HASH_BITS) - 1);
+                }
+                if (indices[slot] < 0) {
+                    if (num_colors >= max_colors) {
+                        return false;
+                    }
+                    keys[slot] = key;
+                    indices[slot] = num_colors;
+                    output_image->palette[num_colors++] = px;
+                }
+                last_key = key;
+                last_index = indices[slot];
+            }
+            indexed[col] = last_index;
+        }
+    }
+
+    output_image->num_palette = num_colors; // in order of appearance, until reorder_palette()
+
+    output_image->gamma = input_image->gamma;
+    output_image->output_color = input_image->output_color;
+    return true;
+}
+
+/*
+ * This is very rough approximation, but generally avoid losing more quality than is gained in file size.
+ * Quality is raised to 1.5, because even greater savings are needed to justify big quality loss.
+ * but >50% savings are considered always worthwhile in order to allow low quality conversions to work at all
+ */
+static size_t maximum_file_size(size_t input_file_size, int quality_percent)
+{
+    const double quality = quality_percent/100.0;
+    const double expected_reduced_size = pow(quality, 1.5);
+    return (input_file_size-1) * (expected_reduced_size < 0.5 ? 0.5 : expected_reduced_size);
+}
+
+#define DRY_RUN_STRIP_HEIGHT 16
+#define DRY_RUN_SAMPLE_EVERY 8 // every 8th strip is remapped and compressed
+
+/*
+ * Remaps and compresses only some strips of rows, at the same compression level that would be used for real,
+ * and scales the size up to the whole image. Strips keep enough neighboring rows for deflate to work as usual.
+ */
+static pngquant_error estimate_remapped_file_size(liq_result *remap, liq_attr *liq, const png24_image *input, bool fast_compression, size_t *estimated_size)
+{
+    const uint32_t strip_stride = DRY_RUN_STRIP_HEIGHT * DRY_RUN_SAMPLE_EVERY;
+    // small images are compressed in full
+    const bool sample = input->height >= 4 * strip_stride;
+
+    unsigned char **rows = malloc(input->height * sizeof(rows[0]));
+    if (!rows) return OUT_OF_MEMORY_ERROR;
+    uint32_t num_rows = 0;
+    for(uint32_t y = 0; y < input->height; y++) {
+        // position of the strip within each group varies, so that it doesn't line up with regular patterns in the image
+        const uint32_t group = y / strip_stride, strip = (y % strip_stride) / DRY_RUN_STRIP_HEIGHT;
+        if (!sample || strip == group * 5 % DRY_RUN_SAMPLE_EVERY) {
+            rows[num_rows++] = input->row_pointers[y];
+        }
+    }
+
+    png8_image sampled = {.width = 0};
+    liq_image *image = liq_image_create_rgba_rows(liq, (void**)rows, input->width, num_rows, input->gamma);
+    pngquant_error retval = image ? prepare_output_image(remap, image, input->output_color, &sampled) : OUT_OF_MEMORY_ERROR;
+    if (SUCCESS == retval && LIQ_OK != liq_write_remapped_image_rows(remap, image, sampled.row_pointers)) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+    if (image) liq_image_destroy(image);
+    free(rows);
+
+    if (SUCCESS == retval) {
+        set_palette(remap, &sampled);
+        sampled.fast_compression = fast_compression;
+        sampled.chunks = input->chunks; // belongs to the input
+        retval = rwpng_write_image8(NULL, &sampled);
+        sampled.chunks = NULL;
+    }
+
+    if (SUCCESS == retval) {
+        // signature, IHDR, PLTE, tRNS, gAMA, sRGB and IEND aren't scaled with the number of rows
+        size_t fixed_size = 8 + 25 + 12 + 4*sampled.num_palette + 12 + 16 + 13 + 12 + sampled.metadata_size;
+        if (fixed_size > sampled.file_size) fixed_size = sampled.file_size;
+        *estimated_size = fixed_size + (double)(sampled.file_size - fixed_size) * input->height / num_rows;
+    }
+    rwpng_free_image8(&sampled);
+    return retval;
+}
+
+#define MAX_VARIANTS 32
+
+struct variant {
+    unsigned int colors;
+    float floyd;
+};
+
+struct variant_list {
+    unsigned int count;
+    struct variant variants[MAX_VARIANTS];
+};
+
+/*
+ * Parses "colors=256,128,64;floyd=1,0" into every combination of the listed values.
+ * Settings that aren't listed use the value from the other options.
+ */
+static bool parse_variants(const char *spec, unsigned int default_colors, float default_floyd, struct variant_list *list)
+{
+    unsigned int colors[MAX_VARIANTS] = {default_colors}, num_colors = 1;
+    float floyd[MAX_VARIANTS] = {default_floyd};
+    unsigned int num_floyd = 1;
+    bool has_colors = false, has_floyd = false;
+
+    while (*spec) {
+        const char *end = strchr(spec, ';');
+        if (!end) end = spec + strlen(spec);
+        const char *equals = memchr(spec, '=', end - spec);
+        if (!equals) return false;
+
+        const bool is_colors = equals - spec == 6 && 0 == strncmp(spec, "colors", 6);
+        const bool is_floyd = equals - spec == 5 && 0 == strncmp(spec, "floyd", 5);
+        if ((!is_colors && !is_floyd) || (is_colors && has_colors) || (is_floyd && has_floyd)) {
+            return false;
+        }
+
+        unsigned int count = 0;
+        for(const char *value = equals+1; value < end;) {
+            char *value_end;
+            const double number = strtod(value, &value_end);
+            if (value_end == value || value_end > end || (value_end < end && *value_end != ',') || count >= MAX_VARIANTS) {
+                return false;
+            }
+            if (is_colors) {
+                if (number < 2 || number > 256 || number != (unsigned int)number) return false;
+                colors[count++] = number;
+            } else {
+                if (!(number >= 0 && number <= 1)) return false;
+                floyd[count++] = number;
+            }
+            value = value_end + 1;
+        }
+        if (!count) return false;
+
+        if (is_colors) {
+            has_colors = true;
+            num_colors = count;
+        } else {
+            has_floyd = true;
+            num_floyd = count;
+        }
+        spec = *end ? end + 1 : end;
+    }
+
+    if (num_colors * num_floyd > MAX_VARIANTS) {
+        return false;
+    }
+    list->count = 0;
+    for(unsigned int c=0; c < num_colors; c++) {
+        for(unsigned int f=0; f < num_floyd; f++) {
+            list->variants[list->count++] = (struct variant){.colors = colors[c], .floyd = floyd[f]};
+        }
+    }
+    return true;
+}
+
+/* Replaces {colors} and {dither} in the --ext template. Output is never longer than the template. */
+static void variant_extension(const char *template, const struct variant *variant, char *extension)
+{
+    while (*template) {
+        if (0 == strncmp(template, "{colors}", 8)) {
+            extension += sprintf(extension, "%u", variant->colors);
+            template += 8;
+        } else if (0 == strncmp(template, "{dither}", 8)) {
+            if (variant->floyd <= 0) {
+                extension += sprintf(extension, "or");
+            } else if (variant->floyd >= 1) {
+                extension += sprintf(extension, "fs");
+            } else {
+                extension += sprintf(extension, "fs%d", (int)(variant->floyd * 100.f + 0.5f));
+            }
+            template += 8;
+        } else {
+            *extension++ = *template++;
+        }
+    }
+    *extension = '\0';
+}
+
+static bool variant_extensions_are_unique(const char *template, const struct variant_list *list)
+{
+    const size_t size = strlen(template) + 1;
+    char a[size], b[size];
+    for(unsigned int i=0; i < list->count; i++) {
+        variant_extension(template, &list->variants[i], a);
+        for(unsigned int j=i+1; j < list->count; j++) {
+            variant_extension(template, &list->variants[j], b);
+            if (0 == strcmp(a, b)) return false;
+        }
+    }
+    return true;
+}
+
+struct variant_output {
+    char *outname;
+    liq_result *result;
+    png8_image image;
+    int quality_percent;
+    pngquant_error retval;
+};
+
+/*
+ * The image is decoded and its histogram is built only once. Palettes for all variants are made from that histogram,
+ * and then the variants are remapped and written in parallel.
+ */
+static pngquant_error pngquant_file_variants(const char *filename, const struct variant_list *list, struct pngquant_options *options, liq_attr *liq, struct pngquant_file_stats *stats)
+{
+    struct variant_output *outputs = calloc(list->count, sizeof(outputs[0]));
+    if (!outputs) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    verbose_printf(liq, options, "%s:", filename);
+
+    unsigned int variants_to_make = 0;
+    char extension[strlen(options->extension) + 1];
+    for(unsigned int i=0; i < list->count; i++) {
+        variant_extension(options->extension, &list->variants[i], extension);
+        outputs[i].outname = add_filename_extension(filename, extension);
+        if (!outputs[i].outname) {
+            outputs[i].retval = OUT_OF_MEMORY_ERROR;
+        } else if (!options->force && file_exists(outputs[i].outname)) {
+            fprintf(stderr, "  error: '%s' exists; not overwriting\n", outputs[i].outname);
+            outputs[i].retval = NOT_OVERWRITING_ERROR;
+        } else {
+            variants_to_make++;
+        }
+    }
+
+    liq_image *input_image = NULL;
+    png24_image input_image_rwpng = {.maximum_pixels = options->max_pixels};
+    pngquant_error retval = SUCCESS;
+    if (variants_to_make) {
+        // every variant is remapped from the same pixels, so they're not given away to input_image
+        retval = read_image(liq, filename, input_stream(options), &input_image_rwpng, &input_image, true, options->strip, options->verbose);
+    }
+
+    if (SUCCESS == retval && variants_to_make) {
+        verbose_printf(liq, options, "  read %luKB file", (input_image_rwpng.file_size+1023UL)/1024UL);
+        stats->input_size = input_image_rwpng.file_size;
+        stats->pixels = (size_t)input_image_rwpng.width * input_image_rwpng.height;
+
+        liq_histogram *hist = liq_histogram_create(liq);
+        if (!hist || LIQ_OK != liq_histogram_add_image(hist, liq, input_image)) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+        liq_image_destroy(input_image);
+        input_image = NULL;
+
+        // palettes are made one at a time, because they all use the same histogram
+        for(unsigned int i=0; i < list->count && SUCCESS == retval; i++) {
+            if (SUCCESS != outputs[i].retval) continue;
+
+            liq_attr *variant_liq = liq_attr_copy(liq);
+            liq_set_max_colors(variant_liq, list->variants[i].colors);
+            liq_error quantize_error = liq_histogram_quantize(hist, variant_liq, &outputs[i].result);
+            liq_attr_destroy(variant_liq);
+
+            if (LIQ_QUALITY_TOO_LOW == quantize_error) {
+                outputs[i].retval = TOO_LOW_QUALITY;
+            } else if (LIQ_OK != quantize_error) {
+                outputs[i].retval = INVALID_ARGUMENT; // dunno
+            }
+        }
+        if (hist) liq_histogram_destroy(hist);
+    }
+
+    if (SUCCESS == retval && variants_to_make) {
+        // variants are remapped and written at the same time, so they can't use the log
+        liq_attr *quiet_liq = liq_attr_copy(liq);
+        liq_set_log_callback(quiet_liq, NULL, NULL);
+        liq_set_log_flush_callback(quiet_liq, NULL, NULL);
+        struct pngquant_options quiet_options = *options;
+        quiet_options.log_callback = NULL;
+
+        // This is nested in the loop over files, so variants only get threads of their own when nested parallelism
+        // is enabled, i.e. for fewer than 2 files per thread. With more files each file's variants are made one after
+        // another, while the other threads convert other files.
+        #pragma omp parallel for if (list->count > 1) schedule(dynamic, 1)
+        for(int i=0; i < (int)list->count; i++) {
+            struct variant_output *output = &outputs[i];
+            if (!output->result) continue;
+
+            liq_set_output_gamma(output->result, 0.45455);
+            liq_set_dithering_level(output->result, list->variants[i].floyd);
+
+            liq_image *image = liq_image_create_rgba_rows(quiet_liq, (void**)input_image_rwpng.row_pointers, input_image_rwpng.width, input_image_rwpng.height, input_image_rwpng.gamma);
+            output->retval = image ? prepare_output_image(output->result, image, input_image_rwpng.output_color, &output->image) : OUT_OF_MEMORY_ERROR;
+            if (SUCCESS == output->retval && LIQ_OK != liq_write_remapped_image_rows(output->result, image, output->image.row_pointers)) {
+                output->retval = OUT_OF_MEMORY_ERROR;
+            }
+            if (image) liq_image_destroy(image);
+
+            if (SUCCESS == output->retval) {
+                set_palette(output->result, &output->image);
+                output->quality_percent = liq_get_quantization_quality(output->result);
+                output->image.fast_compression = options->fast_compression;
+                output->image.chunks = input_image_rwpng.chunks; // shared by all variants, freed with the input
+                if (options->skip_if_larger) {
+                    output->image.maximum_file_size = maximum_file_size(input_image_rwpng.file_size, output->quality_percent);
+                }
+                output->retval = write_image(&output->image, NULL, output->outname, &quiet_options, quiet_liq);
+                output->image.chunks = NULL;
+            }
+        }
+
+        liq_attr_destroy(quiet_liq);
+    }
+
+    for(unsigned int i=0; i < list->count; i++) {
+        struct variant_output *output = &outputs[i];
+        if (SUCCESS == retval && output->outname) {
+            const char *name = filename_part(output->outname);
+            if (SUCCESS == output->retval) {
+                verbose_printf(liq, options, "  wrote %d-color image as %s (Q=%d)", output->image.num_palette, name, output->quality_percent);
+                stats->output_size += output->image.file_size;
+            } else if (TOO_LOW_QUALITY == output->retval) {
+                verbose_printf(liq, options, "  %s not saved, because its quality is too low", name);
+            } else if (TOO_LARGE_FILE == output->retval) {
+                verbose_printf(liq, options, "  %s not saved, because it exceeded expected size of %luKB", name, (unsigned long)output->image.maximum_file_size/1024UL);
+            }
+        }
+        // one failed variant makes the whole file count as failed or skipped
+        if (SUCCESS == retval && SUCCESS != output->retval) {
+            retval = output->retval;
+        }
+        if (output->result) liq_result_destroy(output->result);
+        rwpng_free_image8(&output->image);
+        free(output->outname);
+    }
+    free(outputs);
+
+    if (input_image) liq_image_destroy(input_image);
+    rwpng_free_image24(&input_image_rwpng);
+    return retval;
+}
+
+#define TARGET_SIZE_MAX_CANDIDATES 8
+#define TARGET_SIZE_DITHER_STEPS 8
+
+struct size_candidate {
+    unsigned int step, colors;
+    float floyd;
+    liq_result *result;
+    png8_image image;
+    pngquant_error retval;
+};
+
+/*
+ * Search for the best palette that compresses to at most target_size bytes.
+ * All candidates are quantized from one histogram of the image.
+ */
+struct size_search {
+    liq_histogram *hist;
+    const png24_image *input;
+    liq_attr *quiet_liq;
+    size_t target_size;
+    bool fast_compression, keep_palette;
+    unsigned int candidates_per_round, tried;
+    bool quality_too_low;
+    size_t smallest_size;
+    struct size_candidate best;
+};
+
+static unsigned int target_size_candidates_per_round(void)
+{
+    // several candidates per round only pay off if they can run in parallel,
+    // which they can't when another parallel region would get only one thread
+#ifdef _OPENMP
+    if (omp_get_active_level() >= omp_get_max_active_levels()) {
+        return 1;
+    }
+#endif
+    const int threads = omp_get_max_threads();
+    return threads < 1 ? 1 : (threads > TARGET_SIZE_MAX_CANDIDATES ? TARGET_SIZE_MAX_CANDIDATES : threads);
+}
+
+/* Remaps and compresses the candidate in memory to learn its file size */
+static void measure_candidate(struct size_candidate *candidate, const struct size_search *search)
+{
+    const png24_image *input = search->input;
+
+    liq_set_output_gamma(candidate->result, 0.45455);
+    liq_set_dithering_level(candidate->result, candidate->floyd);
+
+    liq_image *image = liq_image_create_rgba_rows(search->quiet_liq, (void**)input->row_pointers, input->width, input->height, input->gamma);
+    candidate->retval = image ? prepare_output_image(candidate->result, image, input->output_color, &candidate->image) : OUT_OF_MEMORY_ERROR;
+    if (SUCCESS == candidate->retval && LIQ_OK != liq_write_remapped_image_rows(candidate->result, image, candidate->image.row_pointers)) {
+        candidate->retval = OUT_OF_MEMORY_ERROR;
+    }
+    if (image) liq_image_destroy(image);
+
+    if (SUCCESS == candidate->retval) {
+        set_palette(candidate->result, &candidate->image);
+        candidate->image.fast_compression = search->fast_compression;
+        // in the order it'll be written in, which isn't changed again
+        struct palette_order order;
+        reorder_palette(&candidate->image, search->keep_palette, &order);
+        candidate->image.chunks = input->chunks; // metadata counts towards the size
+        candidate->retval = rwpng_write_image8(NULL, &candidate->image);
+        candidate->image.chunks = NULL;
+    }
+    liq_result_destroy(candidate->result);
+    candidate->result = NULL;
+}
+
+static bool is_better_candidate(const struct size_candidate *candidate, const struct size_candidate *best)
+{
+    if (!best->image.row_pointers) return true;
+    return candidate->colors > best->colors || (candidate->colors == best->colors && candidate->floyd > best->floyd);
+}
+
+/*
+ * Finds the highest step in (lo, hi) that fits in the target size. Steps are numbers of colors,
+ * or if dither_steps is set, dithering levels from 0 to floyd for the given number of colors.
+ * Each round tries several steps in parallel, which with one candidate per round is a binary search.
+ */
+static pngquant_error search_target_size(struct size_search *search, unsigned int lo, unsigned int hi, unsigned int colors, float floyd, unsigned int dither_steps, bool try_highest_first)
+{
+    pngquant_error retval = SUCCESS;
+    while (hi - lo > 1 && SUCCESS == retval) {
+        unsigned int num_candidates = search->candidates_per_round;
+        if (num_candidates > hi - lo - 1) num_candidates = hi - lo - 1;
+
+        struct size_candidate candidates[TARGET_SIZE_MAX_CANDIDATES] = {{0}};
+        for(unsigned int i=0; i < num_candidates; i++) {
+            // the highest step is the most likely answer, so it's tried right away
+            const unsigned int step = try_highest_first ? lo + (hi - 1 - lo) * (i+1) / num_candidates
+                                                        : lo + (hi - lo) * (i+1) / (num_candidates+1);
+            candidates[i].step = step;
+            candidates[i].colors = dither_steps ? colors : step;
+            candidates[i].floyd = dither_steps ? floyd * step / dither_steps : floyd;
+
+            // quantization modifies the shared histogram, so only remapping runs in parallel
+            liq_attr *candidate_liq = liq_attr_copy(search->quiet_liq);
+            liq_set_max_colors(candidate_liq, candidates[i].colors);
+            liq_error quantize_error = liq_histogram_quantize(search->hist, candidate_liq, &candidates[i].result);
+            liq_attr_destroy(candidate_liq);
+
+            if (LIQ_QUALITY_TOO_LOW == quantize_error) {
+                candidates[i].retval = TOO_LOW_QUALITY;
+            } else if (LIQ_OK != quantize_error) {
+                candidates[i].retval = INVALID_ARGUMENT; // dunno
+            }
+        }
+        try_highest_first = false;
+
+        #pragma omp parallel for if (num_candidates > 1) schedule(dynamic, 1)
+        for(int i=0; i < (int)num_candidates; i++) {
+            if (candidates[i].result) {
+                measure_candidate(&candidates[i], search);
+            }
+        }
+
+        for(unsigned int i=0; i < num_candidates; i++) {
+            struct size_candidate *candidate = &candidates[i];
+            const unsigned int step = candidate->step;
+            search->tried++;
+
+            if (TOO_LOW_QUALITY == candidate->retval) {
+                // fewer colors won't have higher quality either
+                search->quality_too_low = true;
+                if (step > lo) lo = step;
+            } else if (SUCCESS != candidate->retval) {
+                retval = candidate->retval;
+            } else {
+                if (!search->smallest_size || candidate->image.file_size < search->smallest_size) {
+                    search->smallest_size = candidate->image.file_size;
+                }
+                if (candidate->image.file_size <= search->target_size) {
+                    if (step > lo) lo = step;
+                    if (is_better_candidate(candidate, &search->best)) {
+                        rwpng_free_image8(&search->best.image);
+                        search->best = *candidate;
+                        continue; // not freed
+                    }
+                } else if (step < hi) {
+                    hi = step;
+                }
+            }
+            rwpng_free_image8(&candidate->image);
+        }
+    }
+    return retval;
+}
+
+/*
+ * The image is decoded and its histogram is built only once, and then palette size and dithering level
+ * are searched for the best image that compresses to at most --target-size bytes.
+ */
+static pngquant_error pngquant_file_target_size(const char *filename, const char *outname, struct pngquant_options *options, liq_attr *liq, struct pngquant_file_stats *stats)
+{
+    verbose_printf(liq, options, "%s:", filename);
+
+    liq_image *input_image = NULL;
+    png24_image input_image_rwpng = {.maximum_pixels = options->max_pixels};
+    input_image_rwpng.keep_file_data = options->copy_if_larger;
+    // every candidate is remapped from the same pixels, so they're not given away to input_image
+    pngquant_error retval = read_image(liq, filename, input_stream(options), &input_image_rwpng, &input_image, true, options->strip, options->verbose);
+    if (SUCCESS != retval) {
+        if (input_image) liq_image_destroy(input_image);
+        rwpng_free_image24(&input_image_rwpng);
+        return retval;
+    }
+    verbose_printf(liq, options, "  read %luKB file", (input_image_rwpng.file_size+1023UL)/1024UL);
+    stats->input_size = input_image_rwpng.file_size;
+    stats->pixels = (size_t)input_image_rwpng.width * input_image_rwpng.height;
+
+    // candidates are tried in parallel, so they can't use the log
+    liq_attr *quiet_liq = liq_attr_copy(liq);
+    liq_set_log_callback(quiet_liq, NULL, NULL);
+    liq_set_log_flush_callback(quiet_liq, NULL, NULL);
+
+    struct size_search search = {
+        .hist = liq_histogram_create(quiet_liq),
+        .input = &input_image_rwpng,
+        .quiet_liq = quiet_liq,
+        // with --skip-if-larger the output also has to be smaller than the original
+        .target_size = options->skip_if_larger && input_image_rwpng.file_size <= options->target_size ? input_image_rwpng.file_size - 1 : options->target_size,
+        .fast_compression = options->fast_compression,
+        .keep_palette = !may_reorder_palette(options),
+        .candidates_per_round = target_size_candidates_per_round(),
+    };
+    if (!search.hist || LIQ_OK != liq_histogram_add_image(search.hist, quiet_liq, input_image)) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+    liq_image_destroy(input_image);
+
+    const unsigned int max_colors = liq_get_max_colors(liq);
+    if (SUCCESS == retval) {
+        retval = search_target_size(&search, 1, max_colors + 1, 0, options->floyd, 0, true);
+    }
+    // dithering noise compresses poorly, so without it more colors may fit
+    const unsigned int dithered_colors = search.best.image.row_pointers ? search.best.colors : 1;
+    if (SUCCESS == retval && options->floyd > 0 && dithered_colors < max_colors) {
+        retval = search_target_size(&search, dithered_colors, max_colors + 1, 0, 0, 0, true);
+
+        // and then as much dithering is added back as still fits
+        if (SUCCESS == retval && search.best.image.row_pointers && search.best.colors > dithered_colors) {
+            retval = search_target_size(&search, 0, TARGET_SIZE_DITHER_STEPS, search.best.colors, options->floyd, TARGET_SIZE_DITHER_STEPS, false);
+        }
+    }
+    if (search.hist) liq_histogram_destroy(search.hist);
+    liq_attr_destroy(quiet_liq);
+
+    png8_image *output_image = &search.best.image;
+    if (SUCCESS == retval && !output_image->row_pointers) {
+        retval = search.quality_too_low ? TOO_LOW_QUALITY : TOO_LARGE_FILE;
+        if (search.smallest_size) {
+            verbose_printf(liq, options, "  no palette fits in %lu bytes; the smallest was %lu bytes", (unsigned long)search.target_size, (unsigned long)search.smallest_size);
+        }
+    }
+
+    if (SUCCESS == retval) {
+        verbose_printf(liq, options, "  chose %u colors with %s dithering, %lu bytes, out of %u tried palettes",
+                       search.best.colors, search.best.floyd <= 0 ? "no" : (search.best.floyd >= options->floyd ? "full" : "partial"),
+                       (unsigned long)output_image->file_size, search.tried);
+
+        output_image->chunks = input_image_rwpng.chunks; input_image_rwpng.chunks = NULL;
+        // it's written exactly as measured, but a file over the budget must never be left behind
+        output_image->maximum_file_size = search.target_size;
+        retval = write_image(output_image, NULL, outname, options, liq);
+        stats->output_size = output_image->file_size;
+    }
+
+    // the original is only good enough if it's within the budget
+    if (TOO_LARGE_FILE == retval && options->copy_if_larger && input_image_rwpng.file_size <= options->target_size) {
+        pngquant_error write_retval = write_image(NULL, &input_image_rwpng, outname, options, liq);
+        if (write_retval) {
+            retval = write_retval;
+        }
+    }
+
+    rwpng_free_image8(output_image);
+    rwpng_free_image24(&input_image_rwpng);
+    return retval;
+}
+
+// Colors past this are merged with similar ones, which keeps a table under 24MB
+#define COLOR_COUNTS_MAX_COLORS (1<<20)
+
+// Exact color counts of images or histogram files. Slots with count 0 are empty.
+struct color_counts {
+    uint32_t *colors;
+    uint64_t *counts;
+    size_t size, used;
+    unsigned int size_bits; // size is 1<<size_bits, or 0 before anything is added
+    double gamma;
+    unsigned int posterize_bits; // least significant bits of every channel that are dropped when there are too many colors
+};
+
+static void color_counts_free(struct color_counts *table)
+{
+    free(table->colors);
+    free(table->counts);
+    *table = (struct color_counts){0};
+}
+
+static unsigned char posterize_channel(unsigned char value, unsigned int bits)
+{
+    // dropped bits are filled with the highest ones, so that 255 stays 255, like in liq_histogram
+    return (value & ~((1u << bits) - 1)) | (value >> (8 - bits));
+}
+
+static uint32_t posterize_color(uint32_t color, unsigned int bits)
+{
+    if (!bits) return color;
+    rwpng_rgba px;
+    memcpy(&px, &color, sizeof(px));
+    px = (rwpng_rgba){posterize_channel(px.r, bits), posterize_channel(px.g, bits), posterize_channel(px.b, bits), posterize_channel(px.a, bits)};
+    memcpy(&color, &px, sizeof(color));
+    return color;
+}
+
+static bool color_counts_add(struct color_counts *table, uint32_t color, uint64_t count);
+
+/* Drops one more bit of every channel. Similar colors become one, and their counts are added. */
+static bool color_counts_posterize(struct color_counts *table)
+{
+    struct color_counts posterized = {
+        .gamma = table->gamma,
+        .posterize_bits = table->posterize_bits + 1,
+    };
+    for(size_t i=0; i < table->size; i++) {
+        if (table->counts[i] && !color_counts_add(&posterized, table->colors[i], table->counts[i])) {
+            color_counts_free(&posterized);
+            return false;
+        }
+    }
+    color_counts_free(table);
+    *table = posterized;
+    return true;
+}
+
+static bool color_counts_add(struct color_counts *table, uint32_t color, uint64_t count)
+{
+    color = posterize_color(color, table->posterize_bits);
+    if (table->used >= COLOR_COUNTS_MAX_COLORS) {
+        if (!color_counts_posterize(table)) return false;
+        color = posterize_color(color, table->posterize_bits);
+    }
+    if (table->used * 2 >= table->size) {
+        const unsigned int size_bits = table->size ? table->size_bits + 1 : 16;
+        struct color_counts grown = {
+            .size = (size_t)1 << size_bits,
+            .size_bits = size_bits,
+            .gamma = table->gamma,
+            .posterize_bits = table->posterize_bits,
+        };
+        grown.colors = malloc(grown.size * sizeof(grown.colors[0]));
+        grown.counts = calloc(grown.size, sizeof(grown.counts[0]));
+        if (!grown.colors || !grown.counts) {
+            free(grown.colors);
+            free(grown.counts);
+            return false;
+        }
+        for(size_t i=0; i < table->size; i++) {
+            if (table->counts[i]) color_counts_add(&grown, table->colors[i], table->counts[i]);
+        }
+        free(table->colors);
+        free(table->counts);
+        *table = grown;
+    }
+
+    // high bits of the product are the well-mixed ones
+    size_t slot = (color * 2654435761U) >> (32 - table->size_bits);
+    while (table->counts[slot] && table->colors[slot] != color) {
+        slot = (slot + 1) & (table->size - 1);
+    }
+    if (!table->counts[slot]) {
+        table->colors[slot] = color;
+        table->used++;
+    }
+    table->counts[slot] += count;
+    return true;
+}
+
+static bool color_counts_add_image(struct color_counts *table, const png24_image *image)
+{
+    uint32_t last_color = 0, run = 0;
+    for(uint32_t row = 0; row < image->height; row++) {
+        const rwpng_rgba *pixels = (const rwpng_rgba *)image->row_pointers[row];
+        for(uint32_t col = 0; col < image->width; col++) {
+            rwpng_rgba px = pixels[col];
+            if (px.a == 0) {
+                px = (rwpng_rgba){0,0,0,0};
+            }
+            uint32_t color;
+            memcpy(&color, &px, sizeof(color));
+            // flat areas repeat the same color, so it's counted once per run
+            if (color == last_color && run) {
+                run++;
+                continue;
+            }
+            if (run && !color_counts_add(table, last_color, run)) return false;
+            last_color = color;
+            run = 1;
+        }
+    }
+    return !run || color_counts_add(table, last_color, run);
+}
+
+static pngquant_error color_counts_merge(struct color_counts *into, const struct color_counts *from)
+{
+    if (!from->used) {
+        return SUCCESS;
+    }
+    if (!into->used) {
+        into->gamma = from->gamma;
+    } else if (into->gamma != from->gamma) {
+        return INVALID_ARGUMENT;
+    }
+    while (into->posterize_bits < from->posterize_bits) {
+        if (!color_counts_posterize(into)) return OUT_OF_MEMORY_ERROR;
+    }
+    for(size_t i=0; i < from->size; i++) {
+        if (from->counts[i] && !color_counts_add(into, from->colors[i], from->counts[i])) {
+            return OUT_OF_MEMORY_ERROR;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * All files are read in parallel, but only to count their colors, and their pixels are freed right away.
+ * Every thread counts into its own table, and the tables are merged at the end.
+ * Files that --max-pixels, --skip-smaller or --skip-palette would leave out aren't counted. The reasons are
+ * only reported with report_skipped, since otherwise the files are reported when they're converted.
+ */
+static pngquant_error count_input_colors(struct pngquant_options *options, liq_attr *liq, const struct input_file *inputs, struct memory_budget *memory_budget, bool report_skipped, struct color_counts *merged, unsigned int *counted_files)
+{
+    const int num_tables = omp_get_max_threads();
+    struct color_counts *tables = calloc(num_tables, sizeof(tables[0]));
+    if (!tables) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    pngquant_error retval = SUCCESS;
+    unsigned int counted = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:counted)
+    for(int i=0; i < options->num_files; i++) {
+        if (inputs[i].has_header && SUCCESS != check_input_policy(&inputs[i], options, report_skipped ? liq : NULL)) {
+            continue;
+        }
+
+        struct color_counts *table = &tables[omp_get_thread_num()];
+        const size_t memory_reserved = options->max_memory && inputs[i].has_header ? (size_t)inputs[i].header.width * inputs[i].header.height * 4 : 0;
+        if (memory_reserved) {
+            memory_budget_acquire(memory_budget, memory_reserved);
+        }
+
+        liq_image *image = NULL;
+        png24_image input_image_rwpng = {.maximum_pixels = options->max_pixels};
+        // files that can't be read are left out, and reported when they're converted
+        if (SUCCESS == read_image(liq, inputs[i].filename, NULL, &input_image_rwpng, &image, true, true, false)) {
+            if (!table->used) {
+                table->gamma = input_image_rwpng.gamma;
+            }
+            pngquant_error file_retval = SUCCESS;
+            if (table->gamma != input_image_rwpng.gamma) {
+                fprintf(stderr, "  error: %s has different gamma than other files, so their colors can't be counted together\n", inputs[i].filename);
+                file_retval = INVALID_ARGUMENT;
+            } else if (!color_counts_add_image(table, &input_image_rwpng)) {
+                file_retval = OUT_OF_MEMORY_ERROR;
+            } else {
+                counted++;
+            }
+            if (file_retval) {
+                #pragma omp critical
+                {
+                    retval = file_retval;
+                }
+            }
+        }
+        liq_image_destroy(image);
+        rwpng_free_image24(&input_image_rwpng);
+
+        if (memory_reserved) {
+            memory_budget_release(memory_budget, memory_reserved);
+        }
+    }
+
+    for(int t=0; t < num_tables; t++) {
+        if (SUCCESS == retval) {
+            retval = color_counts_merge(merged, &tables[t]);
+            if (INVALID_ARGUMENT == retval) {
+                fputs("  error: files have different gamma, so their colors can't be counted together\n", stderr);
+            }
+        }
+        color_counts_free(&tables[t]);
+    }
+    free(tables);
+
+    if (SUCCESS == retval && !merged->used) {
+        fputs("  error: none of the files could be read\n", stderr);
+        retval = READ_ERROR;
+    }
+    *counted_files = counted;
+    return retval;
+}
+
+static pngquant_error quantize_color_counts(const struct color_counts *table, liq_attr *liq, liq_result **result)
+{
+    // liq_histogram counts are 32-bit, so large totals lose their least significant bits
+    uint64_t max_count = 0;
+    for(size_t i=0; i < table->size; i++) {
+        if (table->counts[i] > max_count) max_count = table->counts[i];
+    }
+    unsigned int shift = 0;
+    while ((max_count >> shift) > UINT32_MAX) shift++;
+
+    liq_histogram *hist = liq_histogram_create(liq);
+    liq_histogram_entry *entries = malloc(table->used * sizeof(entries[0]));
+    pngquant_error retval = SUCCESS;
+    if (!hist || !entries) {
+        retval = OUT_OF_MEMORY_ERROR;
+    } else {
+        int num_entries = 0;
+        for(size_t i=0; i < table->size; i++) {
+            if (table->counts[i]) {
+                rwpng_rgba px;
+                memcpy(&px, &table->colors[i], sizeof(px));
+                const uint64_t count = table->counts[i] >> shift;
+                entries[num_entries++] = (liq_histogram_entry){
+                    .color = {.r = px.r, .g = px.g, .b = px.b, .a = px.a},
+                    .count = count ? count : 1,
+                };
+            }
+        }
+        if (LIQ_OK != liq_histogram_add_colors(hist, liq, entries, num_entries, table->gamma)) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+    }
+    free(entries);
+
+    if (SUCCESS == retval) {
+        liq_error quantize_error = liq_histogram_quantize(hist, liq, result);
+        if (LIQ_QUALITY_TOO_LOW == quantize_error) {
+            fputs("  error: palette doesn't meet the minimum quality\n", stderr);
+            retval = TOO_LOW_QUALITY;
+        } else if (LIQ_OK != quantize_error) {
+            retval = INVALID_ARGUMENT; // dunno
+        }
+    }
+    if (hist) liq_histogram_destroy(hist);
+    return retval;
+}
+
+/*
+ * For --shared-palette all files are counted into one histogram,
+ * and its palette is used by all files like a --map palette.
+ */
+static pngquant_error make_shared_palette(struct pngquant_options *options, liq_attr *liq, const struct input_file *inputs, struct memory_budget *memory_budget)
+{
+    struct color_counts counts = {0};
+    unsigned int counted_files = 0;
+    pngquant_error retval = count_input_colors(options, liq, inputs, memory_budget, false, &counts, &counted_files);
+    if (SUCCESS == retval && counts.posterize_bits) {
+        verbose_printf(liq, options, "  too many colors; posterized the histogram by %u bits", counts.posterize_bits);
+    }
+
+    liq_result *result = NULL;
+    if (SUCCESS == retval) {
+        retval = quantize_color_counts(&counts, liq, &result);
+    }
+    color_counts_free(&counts);
+
+    if (SUCCESS == retval) {
+        // same as a --map image: colors that are fixed, so that every file gets exactly this palette
+        const liq_palette *palette = liq_get_palette(result);
+        options->fixed_palette_image = liq_image_create_rgba(liq, &palette->entries[0], 1, 1, 0);
+        if (!options->fixed_palette_image) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+        for(unsigned int i=0; i < palette->count && SUCCESS == retval; i++) {
+            liq_image_add_fixed_color(options->fixed_palette_image, palette->entries[i]);
+        }
+        verbose_printf(liq, options, "Made a %d-color palette shared by %u files (Q=%d)", palette->count, counted_files, liq_get_quantization_quality(result));
+    }
+    if (result) liq_result_destroy(result);
+
+    return retval;
+}
+
+/*
+ * Histogram file: "PNGQHIST", gamma * 100000, number of colors (all 32-bit big-endian),
+ * then for every color: R, G, B, A bytes and 64-bit big-endian count.
+ */
+static const char histogram_file_magic[8] = {'P','N','G','Q','H','I','S','T'};
+
+static void write_be(unsigned char *out, uint64_t value, unsigned int bytes)
+{
+    for(unsigned int i=0; i < bytes; i++) {
+        out[i] = value >> (8 * (bytes - 1 - i));
+    }
+}
+
+static uint64_t read_be(const unsigned char *in, unsigned int bytes)
+{
+    uint64_t value = 0;
+    for(unsigned int i=0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static pngquant_error read_histogram_file(const char *filename, struct color_counts *table)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
+        return READ_ERROR;
+    }
+
+    pngquant_error retval = SUCCESS;
+    unsigned char header[16];
+    if (fread(header, sizeof(header), 1, fp) != 1 || 0 != memcmp(header, histogram_file_magic, sizeof(histogram_file_magic))) {
+        fprintf(stderr, "  error: %s is not a histogram file\n", filename);
+        retval = READ_ERROR;
+    }
+
+    struct color_counts file_counts = {0};
+    if (SUCCESS == retval) {
+        file_counts.gamma = read_be(header + 8, 4) / 100000.0;
+        const uint32_t num_colors = read_be(header + 12, 4);
+        unsigned char entry[12];
+        for(uint32_t i=0; i < num_colors && SUCCESS == retval; i++) {
+            if (fread(entry, sizeof(entry), 1, fp) != 1) {
+                fprintf(stderr, "  error: %s is truncated\n", filename);
+                retval = READ_ERROR;
+            } else {
+                uint32_t color;
+                memcpy(&color, entry, sizeof(color)); // same byte order as rwpng_rgba
+                const uint64_t count = read_be(entry + 4, 8);
+                if (count && !color_counts_add(&file_counts, color, count)) {
+                    retval = OUT_OF_MEMORY_ERROR;
+                }
+            }
+        }
+    }
+    fclose(fp);
+
+    if (SUCCESS == retval) {
+        retval = color_counts_merge(table, &file_counts);
+        if (INVALID_ARGUMENT == retval) {
+            fprintf(stderr, "  error: %s has different gamma than other histograms\n", filename);
+        }
+    }
+    color_counts_free(&file_counts);
+    return retval;
+}
+
+// written to a temporary file first, like images, so that a failed write doesn't leave a truncated histogram
+static pngquant_error write_histogram_file(const char *filename, const struct color_counts *table, bool force)
+{
+    char *tempname = temp_filename(filename);
+    if (!tempname) return OUT_OF_MEMORY_ERROR;
+
+    FILE *fp = fopen(tempname, "wb");
+    if (!fp) {
+        fprintf(stderr, "  error: cannot open '%s' for writing\n", tempname);
+        free(tempname);
+        return CANT_WRITE_ERROR;
+    }
+
+    unsigned char header[16];
+    memcpy(header, histogram_file_magic, sizeof(histogram_file_magic));
+    write_be(header + 8, (uint32_t)(table->gamma * 100000.0 + 0.5), 4);
+    write_be(header + 12, table->used, 4);
+    bool ok = fwrite(header, sizeof(header), 1, fp) == 1;
+
+    unsigned char entry[12];
+    for(size_t i=0; i < table->size && ok; i++) {
+        if (table->counts[i]) {
+            memcpy(entry, &table->colors[i], 4);
+            write_be(entry + 4, table->counts[i], 8);
+            ok = fwrite(entry, sizeof(entry), 1, fp) == 1;
+        }
+    }
+
+    if (0 != fclose(fp) || !ok || !replace_file(tempname, filename, force)) {
+        fprintf(stderr, "  error: failed writing '%s'\n", filename);
+        unlink(tempname);
+        free(tempname);
+        return CANT_WRITE_ERROR;
+    }
+    free(tempname);
+    return SUCCESS;
+}
+
+/* The palette is saved as a 1-pixel-high image with one pixel of each color, which can be used with --map */
+static pngquant_error write_palette_file(const char *filename, liq_result *result, struct pngquant_options *options, liq_attr *liq)
+{
+    const liq_palette *palette = liq_get_palette(result);
+    png8_image image = {
+        .width = palette->count,
+        .height = 1,
+        .gamma = 0.45455,
+        .output_color = RWPNG_GAMA_ONLY,
+    };
+    image.indexed_data = malloc(palette->count);
+    image.row_pointers = malloc(sizeof(image.row_pointers[0]));
+    if (!image.indexed_data || !image.row_pointers) {
+        rwpng_free_image8(&image);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    image.row_pointers[0] = image.indexed_data;
+    for(unsigned int i=0; i < palette->count; i++) {
+        image.indexed_data[i] = i;
+    }
+    set_palette(result, &image);
+
+    struct pngquant_options file_options = *options;
+    file_options.using_stdout = false;
+    pngquant_error retval = write_image(&image, NULL, filename, &file_options, liq);
+    rwpng_free_image8(&image);
+    return retval;
+}
+
+/*
+ * --emit-histogram and --emit-palette only analyze the inputs, which are either images or
+ * (with --merge-histograms) histogram files saved earlier, possibly on other machines.
+ */
+static pngquant_error emit_histogram_and_palette(struct pngquant_options *options, liq_attr *liq, const struct input_file *inputs, struct memory_budget *memory_budget)
+{
+    const char *const outputs[2] = {options->emit_histogram, options->emit_palette};
+    for(int i=0; i < 2; i++) {
+        if (outputs[i] && !options->force && file_exists(outputs[i])) {
+            fprintf(stderr, "  error: '%s' exists; not overwriting\n", outputs[i]);
+            return NOT_OVERWRITING_ERROR;
+        }
+    }
+
+    struct color_counts counts = {0};
+    unsigned int counted_files = options->num_files;
+    pngquant_error retval = SUCCESS;
+    if (options->merge_histograms) {
+        for(unsigned int i=0; i < options->num_files && SUCCESS == retval; i++) {
+            retval = read_histogram_file(options->files[i], &counts);
+        }
+    } else {
+        retval = count_input_colors(options, liq, inputs, memory_budget, true, &counts, &counted_files);
+    }
+
+    if (SUCCESS == retval) {
+        verbose_printf(liq, options, "Counted %lu unique colors in %u files", (unsigned long)counts.used, counted_files);
+        if (counts.posterize_bits) {
+            verbose_printf(liq, options, "  too many colors; posterized the histogram by %u bits", counts.posterize_bits);
+        }
+    }
+
+    if (SUCCESS == retval && options->emit_histogram) {
+        retval = write_histogram_file(options->emit_histogram, &counts, options->force);
+    }
+
+    if (SUCCESS == retval && options->emit_palette) {
+        liq_result *result = NULL;
+        retval = quantize_color_counts(&counts, liq, &result);
+        if (SUCCESS == retval) {
+            liq_set_output_gamma(result, 0.45455);
+            verbose_printf(liq, options, "Made a %d-color palette (Q=%d)", liq_get_palette(result)->count, liq_get_quantization_quality(result));
+            retval = write_palette_file(options->emit_palette, result, options, liq);
+        }
+        if (result) liq_result_destroy(result);
+    }
+
+    color_counts_free(&counts);
+    return retval;
+}
+
+/*
+ * --files-from reads one file name per line ("-" reads the list from stdin), after the files on the command line.
+ * The names point into *buffer, which has to be freed together with the list.
+ */
+static pngquant_error read_file_list(const char *list_path, char *const *files, unsigned int num_files, char ***list_out, unsigned int *count_out, char **buffer)
+{
+    FILE *fp = 0 == strcmp(list_path, "-") ? stdin : fopen(list_path, "rb");
+    if (!fp) {
+        fprintf(stderr, "  error: cannot open %s for reading\n", list_path);
+        return READ_ERROR;
+    }
+
+    size_t size = 0, capacity = 1<<16;
+    char *data = malloc(capacity);
+    size_t len;
+    while (data && (len = fread(data + size, 1, capacity - size - 1, fp)) > 0) {
+        size += len;
+        if (capacity - size <= 1) {
+            char *larger = realloc(data, capacity * 2);
+            if (!larger) free(data);
+            data = larger;
+            capacity *= 2;
+        }
+    }
+    const bool read_error = ferror(fp);
+    if (fp != stdin) fclose(fp);
+    if (!data) return OUT_OF_MEMORY_ERROR;
+    if (read_error) {
+        fprintf(stderr, "  error: cannot read %s\n", list_path);
+        free(data);
+        return READ_ERROR;
+    }
+    data[size] = '\0';
+
+    unsigned int lines = 1;
+    for(size_t i=0; i < size; i++) {
+        if ('\n' == data[i]) lines++;
+    }
+    char **list = malloc((num_files + lines) * sizeof(list[0]));
+    if (!list) {
+        free(data);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    unsigned int count = 0;
+    for(unsigned int i=0; i < num_files; i++) {
+        list[count++] = files[i];
+    }
+    for(char *line = data; line;) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        size_t line_length = strlen(line);
+        if (line_length && '\r' == line[line_length-1]) line[--line_length] = '\0';
+        if (line_length) list[count++] = line;
+        line = next;
+    }
+
+    *list_out = list;
+    *count_out = count;
+    *buffer = data;
+    return SUCCESS;
+}
+
+/* --shard K/N, or 1/1 if not set */
+static bool parse_shard(const char *spec, unsigned int *shard_index, unsigned int *shard_count)
+{
+    *shard_index = *shard_count = 1;
+    if (!spec) return true;
+
+    char *end;
+    const unsigned long index = strtoul(spec, &end, 10);
+    if (end == spec || '/' != *end) return false;
+    const char *count_start = end + 1;
+    const unsigned long count = strtoul(count_start, &end, 10);
+    if (end == count_start || '\0' != *end || index < 1 || index > count || count > 1<<20) return false;
+
+    *shard_index = index;
+    *shard_count = count;
+    return true;
+}
+
+/* FNV-1a, which is the same on every machine, unlike pointer or locale-dependent hashes */
+static uint64_t shard_hash(uint64_t hash, const char *str)
+{
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+#define SHARD_HASH_SEED 0xCBF29CE484222325ULL
+
+/* Each path is given to one shard, and all shards agree which one, without talking to each other */
+static bool is_in_shard(const char *dir, const char *name, unsigned int shard_index, unsigned int shard_count)
+{
+    if (shard_count <= 1) return true;
+    uint64_t hash = SHARD_HASH_SEED;
+    if (dir) {
+        hash = shard_hash(shard_hash(hash, dir), "/");
+    }
+    hash = shard_hash(hash, name);
+    hash ^= hash >> 32; // low bits of FNV mix poorly
+    return hash % shard_count == shard_index - 1;
+}
+
+static unsigned int keep_hashed_shard(char **files, unsigned int num_files, unsigned int shard_index, unsigned int shard_count)
+{
+    unsigned int kept = 0;
+    for(unsigned int i=0; i < num_files; i++) {
+        if (is_in_shard(NULL, files[i], shard_index, shard_count)) {
+            files[kept++] = files[i];
+        }
+    }
+    return kept;
+}
+
+// each file costs at least as much as a small image, so that files without a readable header are spread too
+#define SHARD_FILE_OVERHEAD_PIXELS (256*256)
+
+static int compare_shard_order(const void *a, const void *b)
+{
+    const struct input_file *input_a = *(const struct input_file **)a, *input_b = *(const struct input_file **)b;
+    const size_t pixels_a = input_pixels(input_a), pixels_b = input_pixels(input_b);
+    if (pixels_a != pixels_b) {
+        return pixels_a < pixels_b ? 1 : -1;
+    }
+    return strcmp(input_a->filename, input_b->filename);
+}
+
+struct shard_load {
+    unsigned long long pixels;
+    unsigned int shard;
+};
+
+static bool is_less_loaded(const struct shard_load *a, const struct shard_load *b)
+{
+    return a->pixels < b->pixels || (a->pixels == b->pixels && a->shard < b->shard);
+}
+
+/*
+ * --shard-by-size gives the largest remaining file to the least loaded shard, so that shards get similar numbers of pixels.
+ * Every shard reads all the headers, and gets the same split, because it depends only on the names and sizes of the files.
+ * Files of this shard are kept in their order, and the rest are removed from inputs.
+ */
+static pngquant_error keep_balanced_shard(struct input_file *inputs, unsigned int *num_files, unsigned int shard_index, unsigned int shard_count)
+{
+    const unsigned int count = *num_files;
+    const struct input_file **sorted = malloc(count * sizeof(sorted[0]));
+    struct shard_load *heap = malloc(shard_count * sizeof(heap[0]));
+    bool *keep = calloc(count, sizeof(keep[0]));
+    if (!sorted || !heap || !keep) {
+        free(sorted); free(heap); free(keep);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    for(unsigned int i=0; i < count; i++) {
+        sorted[i] = &inputs[i];
+    }
+    qsort(sorted, count, sizeof(sorted[0]), compare_shard_order);
+
+    // min-heap of shard loads, ordered by pixels and then shard number, so that ties go the same way everywhere
+    for(unsigned int i=0; i < shard_count; i++) {
+        heap[i] = (struct shard_load){.pixels = 0, .shard = i};
+    }
+    for(unsigned int i=0; i < count; i++) {
+        if (heap[0].shard == shard_index - 1) {
+            keep[sorted[i] - inputs] = true;
+        }
+        heap[0].pixels += input_pixels(sorted[i]) + SHARD_FILE_OVERHEAD_PIXELS;
+
+        unsigned int parent = 0;
+        for(;;) {
+            const unsigned int left = 2*parent + 1, right = left + 1;
+            unsigned int smallest = parent;
+            if (left < shard_count && is_less_loaded(&heap[left], &heap[smallest])) smallest = left;
+            if (right < shard_count && is_less_loaded(&heap[right], &heap[smallest])) smallest = right;
+            if (smallest == parent) break;
+            const struct shard_load tmp = heap[parent];
+            heap[parent] = heap[smallest];
+            heap[smallest] = tmp;
+            parent = smallest;
+        }
+    }
+
+    unsigned int kept = 0;
+    for(unsigned int i=0; i < count; i++) {
+        if (keep[i]) {
+            inputs[kept] = inputs[i];
+            inputs[kept].index = kept;
+            kept++;
+        }
+    }
+    *num_files = kept;
+
+    free(sorted); free(heap); free(keep);
+    return SUCCESS;
+}
+
+/*
+ * Counts of one run, written with --summary. Shards of a batch run on different machines
+ * can be combined into one report with --merge-summaries.
+ */
+struct batch_summary {
+    unsigned int shard_index, shard_count;
+    unsigned long long files, converted, skipped, errors;
+    // of converted files only
+    unsigned long long input_bytes, output_bytes, pixels;
+    double seconds;
+};
+
+static const char summary_file_magic[] = "pngquant-summary 1";
+
+// written to a temporary file first, so that a shard that fails to write it doesn't leave a truncated summary to merge
+static pngquant_error write_summary_file(const char *filename, const struct batch_summary *summary)
+{
+    char *tempname = temp_filename(filename);
+    if (!tempname) return OUT_OF_MEMORY_ERROR;
+
+    FILE *fp = fopen(tempname, "w");
+    if (!fp) {
+        fprintf(stderr, "  error: cannot open '%s' for writing\n", tempname);
+        free(tempname);
+        return CANT_WRITE_ERROR;
+    }
+    const bool ok = fprintf(fp, "%s\nshard %u/%u\nfiles %llu\nconverted %llu\nskipped %llu\nerrors %llu\n"
+                            "input_bytes %llu\noutput_bytes %llu\npixels %llu\nseconds %.3f\n",
+                            summary_file_magic, summary->shard_index, summary->shard_count,
+                            summary->files, summary->converted, summary->skipped, summary->errors,
+                            summary->input_bytes, summary->output_bytes, summary->pixels, summary->seconds) > 0;
+    // a summary of the same shard from an earlier run is replaced
+    if (0 != fclose(fp) || !ok || !replace_file(tempname, filename, true)) {
+        fprintf(stderr, "  error: failed writing '%s'\n", filename);
+        unlink(tempname);
+        free(tempname);
+        return CANT_WRITE_ERROR;
+    }
+    free(tempname);
+    return SUCCESS;
+}
+
+/* Unknown keys are ignored, so that summaries of newer versions can still be merged */
+static pngquant_error read_summary_file(const char *filename, struct batch_summary *summary)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
+        return READ_ERROR;
+    }
+
+    *summary = (struct batch_summary){.shard_index = 1, .shard_count = 1};
+    char line[256];
+    bool valid = fgets(line, sizeof(line), fp) && 0 == strncmp(line, summary_file_magic, strlen(summary_file_magic));
+    while (valid && fgets(line, sizeof(line), fp)) {
+        char key[32];
+        int value_start;
+        if (1 != sscanf(line, "%31s %n", key, &value_start)) continue;
+        const char *value = line + value_start;
+        if (0 == strcmp(key, "shard")) {
+            valid = 2 == sscanf(value, "%u/%u", &summary->shard_index, &summary->shard_count) &&
+                    summary->shard_index >= 1 && summary->shard_index <= summary->shard_count;
+        } else if (0 == strcmp(key, "seconds")) {
+            valid = 1 == sscanf(value, "%lf", &summary->seconds);
+        } else {
+            unsigned long long *field =
+                0 == strcmp(key, "files") ? &summary->files :
+                0 == strcmp(key, "converted") ? &summary->converted :
+                0 == strcmp(key, "skipped") ? &summary->skipped :
+                0 == strcmp(key, "errors") ? &summary->errors :
+                0 == strcmp(key, "input_bytes") ? &summary->input_bytes :
+                0 == strcmp(key, "output_bytes") ? &summary->output_bytes :
+                0 == strcmp(key, "pixels") ? &summary->pixels : NULL;
+            if (field) {
+                valid = 1 == sscanf(value, "%llu", field);
+            }
+        }
+    }
+    fclose(fp);
+
+    if (!valid) {
+        fprintf(stderr, "  error: %s is not a summary file\n", filename);
+        return READ_ERROR;
+    }
+    return SUCCESS;
+}
+
+/* The merged report is printed to stdout even without --verbose, because it's the output */
+static void print_summary(const struct batch_summary *summary)
+{
+    printf("Files: %llu (%llu converted, %llu skipped, %llu failed)\n",
+           summary->files, summary->converted, summary->skipped, summary->errors);
+    if (summary->input_bytes) {
+        printf("Converted: %llu -> %llu bytes (%.1f%%), %.1f megapixels\n",
+               summary->input_bytes, summary->output_bytes, 100.0 * summary->output_bytes / summary->input_bytes, summary->pixels / 1e6);
+    }
+}
+
+/*
+ * Inputs of --merge-summaries are summary files of shards. Shards that are missing or given twice are reported,
+ * since the totals would be wrong then.
+ */
+static pngquant_error merge_summary_files(struct pngquant_options *options, liq_attr *liq)
+{
+    struct batch_summary total = {.shard_index = 1, .shard_count = 1};
+    unsigned int *shard_seen = NULL;
+    double longest_shard = 0;
+    pngquant_error retval = SUCCESS;
+
+    for(unsigned int i=0; i < options->num_files && SUCCESS == retval; i++) {
+        struct batch_summary summary;
+        retval = read_summary_file(options->files[i], &summary);
+        if (SUCCESS != retval) break;
+
+        if (!shard_seen) {
+            total.shard_count = summary.shard_count;
+            shard_seen = calloc(summary.shard_count, sizeof(shard_seen[0]));
+            if (!shard_seen) {
+                retval = OUT_OF_MEMORY_ERROR;
+                break;
+            }
+        } else if (summary.shard_count != total.shard_count) {
+            fprintf(stderr, "  error: %s is a shard of %u, but other summaries are shards of %u\n", options->files[i], summary.shard_count, total.shard_count);
+            retval = INVALID_ARGUMENT;
+            break;
+        }
+        if (shard_seen[summary.shard_index - 1]++) {
+            fprintf(stderr, "  warning: shard %u/%u is in more than one summary\n", summary.shard_index, summary.shard_count);
+        }
+
+        total.files += summary.files;
+        total.converted += summary.converted;
+        total.skipped += summary.skipped;
+        total.errors += summary.errors;
+        total.input_bytes += summary.input_bytes;
+        total.output_bytes += summary.output_bytes;
+        total.pixels += summary.pixels;
+        total.seconds += summary.seconds;
+        if (summary.seconds > longest_shard) longest_shard = summary.seconds;
+    }
+
+    if (SUCCESS == retval) {
+        unsigned int present = 0;
+        for(unsigned int i=0; i < total.shard_count; i++) {
+            if (shard_seen[i]) {
+                present++;
+            } else {
+                fprintf(stderr, "  warning: summary of shard %u/%u is missing\n", i+1, total.shard_count);
+            }
+        }
+
+        printf("Shards: %u of %u\n", present, total.shard_count);
+        print_summary(&total);
+        printf("Time: %.1fs for the longest shard, %.1fs in total\n", longest_shard, total.seconds);
+
+        if (options->summary_file) {
+            // the merged summary is of the whole batch, not of any one shard
+            struct batch_summary merged = total;
+            merged.shard_index = merged.shard_count = 1;
+            verbose_printf(liq, options, "Writing merged summary to %s", options->summary_file);
+            retval = write_summary_file(options->summary_file, &merged);
+        }
+    }
+
+    free(shard_seen);
+    return retval;
+}
+
+pngquant_error pngquant_main_internal(struct pngquant_options *options, liq_attr *liq);
+static pngquant_error pngquant_file_internal(const char *filename, const char *outname, struct pngquant_options *options, liq_attr *liq, struct auto_speed_model *auto_speed, struct pngquant_file_stats *stats);
+
+/* Converts one file with variants, to target size or normally, depending on options */
+static pngquant_error convert_file(const char *filename, const char *outname, const struct variant_list *variants, struct pngquant_options *options, liq_attr *liq, struct auto_speed_model *auto_speed, struct pngquant_file_stats *stats)
+{
+    if (variants->count) {
+        return pngquant_file_variants(filename, variants, options, liq, stats);
+    }
+    if (options->target_size) {
+        return pngquant_file_target_size(filename, outname, options, liq, stats);
+    }
+    return pngquant_file_internal(filename, outname, options, liq, auto_speed, stats);
+}
+
+/* Sets options->fixed_palette_image to the colors of the --map image */
+static pngquant_error load_map_file(struct pngquant_options *options, liq_attr *liq)
+{
+    png24_image tmp = {.width=0};
+    if (SUCCESS != read_image(liq, options->map_file, NULL, &tmp, &options->fixed_palette_image, true, true, false)) {
+        fprintf(stderr, "  error: unable to load %s", options->map_file);
+        return INVALID_ARGUMENT;
+    }
+    liq_result *tmp_quantize = liq_quantize_image(liq, options->fixed_palette_image);
+    const liq_palette *pal = liq_get_palette(tmp_quantize);
+    if (!pal) {
+        fprintf(stderr, "  error: unable to read colors from %s", options->map_file);
+        return INVALID_ARGUMENT;
+    }
+    for(unsigned int i=0; i < pal->count; i++) {
+        liq_image_add_fixed_color(options->fixed_palette_image, pal->entries[i]);
+    }
+    liq_result_destroy(tmp_quantize);
+    return SUCCESS;
+}
+
+#if !(defined(_WIN32) || defined(WIN32) || defined(__WIN32__))
+/*
+ * Files found by --watch and --recursive are converted as soon as they're found, each one by one thread,
+ * while the rest of the OpenMP team keeps looking for more.
+ */
+struct file_stream {
+    struct pngquant_options *options;
+    liq_attr *liq;
+    const struct variant_list *variants;
+    char *output_pattern; // glob matching output and temporary files, so that they're not converted again
+    char *undithered_pattern; // the same for "-or8" names that --speed auto may pick, or NULL
+    struct memory_budget memory_budget;
+    struct auto_speed_model auto_speed;
+    unsigned int file_count, skipped_count, error_count;
+    pngquant_error latest_error;
+    // for --shard and --summary
+    unsigned int shard_index, shard_count;
+    unsigned int converted_count;
+    unsigned long long converted_input_bytes, converted_output_bytes, converted_pixels;
+    double start_time;
+    // for --dry-run
+    unsigned int estimated_count;
+    unsigned long long estimated_input_bytes, estimated_output_bytes;
+    double estimated_quality_sum;
+};
+
+/* --ext as a glob, with {colors} and {dither} of --variants replaced by wildcards */
+static char *output_glob(const char *extension)
+{
+    char *pattern = malloc(strlen(extension) + 2);
+    if (!pattern) return NULL;
+    char *out = pattern;
+    *out++ = '*';
+    while (*extension) {
+        if (0 == strncmp(extension, "{colors}", 8) || 0 == strncmp(extension, "{dither}", 8)) {
+            *out++ = '*';
+            extension += 8;
+        } else if (strchr("*?[\\", *extension)) {
+            *out++ = '?'; // close enough, and doesn't need escaping
+            extension++;
+        } else {
+            *out++ = *extension++;
+        }
+    }
+    *out = '\0';
+    return pattern;
+}
+
+/* With --ext .png the output of a file is written over it, so it's an input even though it looks like an output */
+static bool is_converted_in_place(const char *name, const char *extension)
+{
+    const size_t length = strlen(name);
+    return length > 4 && (0 == strcmp(name+length-4, ".png") || 0 == strcmp(name+length-4, ".PNG")) &&
+           0 == strcmp(name+length-4, extension);
+}
+
+/* the output name, or the temporary file the output is written to */
+static bool is_output_name(const char *pattern, const char *name)
+{
+    const size_t pattern_length = strlen(pattern);
+    char temp_pattern[pattern_length + 5];
+    memcpy(temp_pattern, pattern, pattern_length);
+    strcpy(temp_pattern + pattern_length, ".tmp");
+
+    return 0 == fnmatch(pattern, name, 0) || 0 == fnmatch(temp_pattern, name, 0);
+}
+
+/* relative_dir is the subdirectory of --recursive, if any, which makes the path that's sharded */
+static bool is_wanted_file(const char *relative_dir, const char *name, const struct file_stream *stream)
+{
+    if (is_output_name(stream->output_pattern, name) && !is_converted_in_place(name, stream->options->extension)) {
+        return false;
+    }
+    if (stream->undithered_pattern && is_output_name(stream->undithered_pattern, name)) {
+        return false;
+    }
+    if (stream->options->exclude_glob && 0 == fnmatch(stream->options->exclude_glob, name, 0)) {
+        return false;
+    }
+    return 0 == fnmatch(stream->options->include_glob ? stream->options->include_glob : "*.[pP][nN][gG]", name, 0) &&
+           is_in_shard(relative_dir, name, stream->shard_index, stream->shard_count);
+}
+
+static void file_stream_add(struct file_stream *stream, const char *filename, pngquant_error retval, const struct pngquant_file_stats *stats)
+{
+    const bool dry_run = stream->options->dry_run;
+    const bool estimated = dry_run && print_dry_run_estimate(filename, stats, retval);
+
+    #pragma omp critical (file_stream)
+    {
+        if (estimated) {
+            stream->estimated_count++;
+            stream->estimated_input_bytes += stats->input_size;
+            stream->estimated_output_bytes += stats->estimated_size;
+            stream->estimated_quality_sum += stats->quality_percent;
+        }
+        stream->file_count++;
+        if (SUCCESS == retval) {
+            stream->converted_count++;
+            stream->converted_input_bytes += stats->input_size;
+            stream->converted_output_bytes += dry_run ? stats->estimated_size : stats->output_size;
+            stream->converted_pixels += stats->pixels;
+        }
+        if (retval) {
+            stream->latest_error = retval;
+            if (retval == TOO_LOW_QUALITY || retval == TOO_LARGE_FILE || retval == DEADLINE_EXCEEDED || retval == SKIPPED_INPUT) {
+                stream->skipped_count++;
+            } else {
+                stream->error_count++;
+            }
+        }
+    }
+}
+
+/*
+ * Converts one image of --watch, --recursive, --serve or pngquant_context in one thread of the team.
+ * It's read from opts->input_stream and written to opts->output_stream when these are set.
+ * The header, if it could be read, is returned in input.
+ */
+static pngquant_error convert_streamed_image(const char *filename, const char *outname, const struct pngquant_options *options, struct input_file *input, struct pngquant_file_stats *stats, struct file_stream *stream)
+{
+    struct pngquant_options opts = *options;
+    liq_attr *local_liq = liq_attr_copy(stream->liq);
+
+    #ifdef _OPENMP
+    struct buffered_log buf = {0};
+    if (opts.log_callback && omp_get_num_threads() > 1) {
+        liq_set_log_callback(local_liq, log_callback_buferred, &buf);
+        liq_set_log_flush_callback(local_liq, log_callback_buferred_flush, &buf);
+        opts.log_callback = log_callback_buferred;
+        opts.log_callback_user_info = &buf;
+    }
+    #endif
+
+    *input = (struct input_file){.filename = filename};
+    if (opts.input_stream) {
+        input->has_header = SUCCESS == rwpng_read_header(opts.input_stream, &input->header);
+        rewind(opts.input_stream);
+    } else {
+        prescan_file(input);
+    }
+
+    pngquant_error retval = SUCCESS;
+    if (input->has_header) {
+        retval = check_input_policy(input, &opts, local_liq);
+        if (SKIPPED_INPUT == retval && opts.copy_if_larger && !opts.dry_run && !opts.input_stream && !opts.output_stream) {
+            pngquant_error write_retval = copy_original_file(filename, outname, &opts, local_liq);
+            if (write_retval) {
+                retval = write_retval;
+            }
+        }
+    }
+
+    size_t memory_reserved = 0;
+    if (SUCCESS == retval && opts.max_memory && input->has_header) {
+        memory_reserved = estimate_memory_use(input->header.width, input->header.height);
+        memory_budget_acquire(&stream->memory_budget, memory_reserved);
+    }
+
+    if (SUCCESS == retval) {
+        retval = convert_file(filename, outname, stream->variants, &opts, local_liq, &stream->auto_speed, stats);
+    }
+
+    if (memory_reserved) {
+        memory_budget_release(&stream->memory_budget, memory_reserved);
+    }
+    liq_attr_destroy(local_liq);
+    return retval;
+}
+
+/* Takes ownership of filename and outname */
+static void convert_streamed_file(char *filename, char *outname, struct file_stream *stream)
+{
+    pngquant_error retval = SUCCESS;
+    if (!stream->variants->count && !stream->options->dry_run && !stream->options->force && file_exists(outname)) {
+        fprintf(stderr, "  error: '%s' exists; not overwriting\n", outname);
+        retval = NOT_OVERWRITING_ERROR;
+    }
+
+    struct input_file input;
+    struct pngquant_file_stats stats = {0};
+    if (SUCCESS == retval) {
+        retval = convert_streamed_image(filename, outname, stream->options, &input, &stats, stream);
+    }
+
+    file_stream_add(stream, filename, retval, &stats);
+
+    free(outname);
+    free(filename);
+}
+
+static pngquant_error file_stream_init(struct file_stream *stream, struct pngquant_options *options, liq_attr *liq, const struct variant_list *variants)
+{
+    const char *undithered_ext = options->speed_auto ? undithered_extension(options) : NULL;
+    *stream = (struct file_stream){
+        .options = options,
+        .liq = liq,
+        .variants = variants,
+        .output_pattern = output_glob(options->extension),
+        .undithered_pattern = undithered_ext ? output_glob(undithered_ext) : NULL,
+        .memory_budget = {.limit = options->max_memory},
+        .auto_speed = {.time_scale = 1.0},
+        .start_time = current_time(),
+    };
+    parse_shard(options->shard, &stream->shard_index, &stream->shard_count); // already checked
+    if (!stream->output_pattern || (undithered_ext && !stream->undithered_pattern)) {
+        free(stream->output_pattern);
+        free(stream->undithered_pattern);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    return SUCCESS;
+}
+
+/* Returns error only if --summary can't be written */
+static pngquant_error file_stream_finish(struct file_stream *stream)
+{
+    free(stream->output_pattern);
+    stream->output_pattern = NULL;
+    free(stream->undithered_pattern);
+    stream->undithered_pattern = NULL;
+
+    liq_attr *liq = stream->liq;
+    struct pngquant_options *options = stream->options;
+    if (stream->error_count) {
+        verbose_printf(liq, options, "There were errors quantizing %d file%s out of a total of %d file%s.",
+                       stream->error_count, (stream->error_count == 1)? "" : "s", stream->file_count, (stream->file_count == 1)? "" : "s");
+    }
+    if (stream->skipped_count) {
+        verbose_printf(liq, options, "Skipped %d file%s out of a total of %d file%s.",
+                       stream->skipped_count, (stream->skipped_count == 1)? "" : "s", stream->file_count, (stream->file_count == 1)? "" : "s");
+    }
+    if (!stream->skipped_count && !stream->error_count) {
+        verbose_printf(liq, options, "Quantized %d image%s.",
+                       stream->file_count, (stream->file_count == 1)? "" : "s");
+    }
+    if (options->dry_run) {
+        print_dry_run_total(stream->estimated_count, stream->estimated_input_bytes, stream->estimated_output_bytes, stream->estimated_quality_sum);
+    }
+    if (options->summary_file) {
+        const struct batch_summary summary = {
+            .shard_index = stream->shard_index,
+            .shard_count = stream->shard_count,
+            .files = stream->file_count,
+            .converted = stream->converted_count,
+            .skipped = stream->skipped_count,
+            .errors = stream->error_count,
+            .input_bytes = stream->converted_input_bytes,
+            .output_bytes = stream->converted_output_bytes,
+            .pixels = stream->converted_pixels,
+            .seconds = current_time() - stream->start_time,
+        };
+        return write_summary_file(options->summary_file, &summary);
+    }
+    return SUCCESS;
+}
+
+/* Path of the file in dir, with the slash added only if needed */
+static char *join_path(const char *dir, const char *name)
+{
+    const size_t dir_length = strlen(dir);
+    const bool has_slash = dir_length && dir[dir_length-1] == '/';
+    char *path = malloc(dir_length + 1 + strlen(name) + 1);
+    if (path) {
+        sprintf(path, has_slash ? "%s%s" : "%s/%s", dir, name);
+    }
+    return path;
+}
+
+/* relative_dir and name joined to dir, where relative_dir may be NULL */
+static char *join_relative_path(const char *dir, const char *relative_dir, const char *name)
+{
+    if (!relative_dir) {
+        return join_path(dir, name);
+    }
+    char *subdir = join_path(dir, relative_dir);
+    char *path = subdir ? join_path(subdir, name) : NULL;
+    free(subdir);
+    return path;
+}
+
+/* Output name for --output-dir: same relative path, under the other directory */
+static char *mirrored_outname(const char *relative_dir, const char *name, const struct pngquant_options *options)
+{
+    char *outpath = join_relative_path(options->output_dir, relative_dir, name);
+    char *outname = outpath ? add_filename_extension(outpath, options->extension) : NULL;
+    free(outpath);
+    return outname;
+}
+
+/* Like mkdir -p */
+static bool make_directories(const char *path)
+{
+    char *copy = strdup(path);
+    if (!copy) return false;
+    bool ok = true;
+    for(char *slash = copy + 1; ok; slash++) {
+        if (*slash == '/' || *slash == '\0') {
+            const char c = *slash;
+            *slash = '\0';
+            ok = 0 == mkdir(copy, 0777) || EEXIST == errno;
+            *slash = c;
+            if (!c) break;
+        }
+    }
+    free(copy);
+    return ok;
+}
+
+/*
+ * Reads one directory, and makes a task for each wanted file and subdirectory in it.
+ * The directory is opened by dir_name in parent_fd, and relative_dir is its path under --recursive (NULL for the top).
+ * Entries are checked relative to the directory's descriptor, and only paths of the files to convert are built.
+ * Symlinks to directories aren't followed, so there are no loops, even if a directory is replaced while it's walked.
+ */
+static void walk_directory(int parent_fd, const char *dir_name, char *relative_dir, struct file_stream *stream)
+{
+    const struct pngquant_options *options = stream->options;
+
+    int fd = openat(parent_fd, dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (relative_dir ? O_NOFOLLOW : 0));
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        const int error = errno;
+        char *path = relative_dir ? join_path(options->recursive_dir, relative_dir) : NULL;
+        fprintf(stderr, "  error: cannot read directory %s (%s)\n", path ? path : dir_name, strerror(error));
+        free(path);
+        if (fd >= 0) close(fd);
+        #pragma omp critical (file_stream)
+        {
+            stream->error_count++;
+            stream->latest_error = READ_ERROR;
+        }
+        free(relative_dir);
+        return;
+    }
+
+    bool made_output_dir = false;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        bool is_dir = entry->d_type == DT_DIR, is_file = entry->d_type == DT_REG;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat st;
+            // symlinks to files are converted, but symlinks to directories aren't followed
+            const bool follow = entry->d_type == DT_LNK;
+            if (0 == fstatat(fd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW)) {
+                is_dir = !follow && S_ISDIR(st.st_mode);
+                is_file = S_ISREG(st.st_mode);
+            }
+        }
+
+        if (is_dir) {
+            char *subdir_relative = relative_dir ? join_path(relative_dir, name) : strdup(name);
+            if (subdir_relative) {
+                // entry is reused by readdir, but the name is also the end of subdir_relative, which the task owns
+                const char *subdir_name = subdir_relative + strlen(subdir_relative) - strlen(name);
+                #pragma omp task firstprivate(fd, subdir_name, subdir_relative) if (omp_get_num_threads() > 1)
+                walk_directory(fd, subdir_name, subdir_relative, stream);
+            }
+        } else if (is_file && is_wanted_file(relative_dir, name, stream)) {
+            if (options->output_dir && !made_output_dir && !options->dry_run) {
+                char *outdir = relative_dir ? join_path(options->output_dir, relative_dir) : strdup(options->output_dir);
+                if (!outdir || !make_directories(outdir)) {
+                    fprintf(stderr, "  error: cannot create directory %s\n", outdir ? outdir : options->output_dir);
+                }
+                free(outdir);
+                made_output_dir = true;
+            }
+
+            char *filename = join_relative_path(options->recursive_dir, relative_dir, name);
+            char *outname = NULL;
+            if (filename && !stream->variants->count) {
+                outname = options->output_dir ? mirrored_outname(relative_dir, name, options) : add_filename_extension(filename, options->extension);
+            }
+            if (filename && (outname || stream->variants->count)) {
+                #pragma omp task firstprivate(filename, outname) if (omp_get_num_threads() > 1)
+                convert_streamed_file(filename, outname, stream);
+            } else {
+                free(filename);
+            }
+        }
+    }
+    // subdirectories are opened relative to fd
+    #pragma omp taskwait
+    closedir(dir);
+    free(relative_dir);
+}
+
+/*
+ * Converts all wanted files in the directory and its subdirectories. The directories are read by several threads,
+ * and files are converted while the rest of the tree is still being read.
+ */
+static pngquant_error convert_directory_tree(struct pngquant_options *options, liq_attr *liq, const struct variant_list *variants)
+{
+    struct file_stream stream;
+    if (SUCCESS != file_stream_init(&stream, options, liq, variants)) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    #pragma omp parallel shared(stream)
+    #pragma omp single
+    walk_directory(AT_FDCWD, options->recursive_dir, NULL, &stream);
+
+    const pngquant_error summary_retval = file_stream_finish(&stream);
+    return summary_retval ? summary_retval : stream.latest_error;
+}
+#endif
+
+#if defined(__linux__)
+#define WATCH_SETTLE_MS 250 // files are converted once nothing has been written to them for this long
+
+struct watch_pending {
+    char *name;
+    double ready_time;
+};
+
+struct watch_pending_list {
+    struct watch_pending *files;
+    unsigned int count, capacity;
+};
+
+/* Returns false if there's no memory for it */
+static bool watch_pending_add(struct watch_pending_list *pending, const char *name, double ready_time)
+{
+    if (pending->count == pending->capacity) {
+        const unsigned int capacity = pending->capacity ? pending->capacity * 2 : 16;
+        struct watch_pending *larger = realloc(pending->files, capacity * sizeof(pending->files[0]));
+        if (!larger) {
+            return false;
+        }
+        pending->files = larger;
+        pending->capacity = capacity;
+    }
+    pending->files[pending->count++] = (struct watch_pending){
+        .name = strdup(name),
+        .ready_time = ready_time,
+    };
+    return true;
+}
+
+static bool watch_pending_has(const struct watch_pending_list *pending, const char *name)
+{
+    for(unsigned int i=0; i < pending->count; i++) {
+        if (pending->files[i].name && 0 == strcmp(pending->files[i].name, name)) return true;
+    }
+    return false;
+}
+
+/*
+ * When the event queue overflows, events are lost, so the directory is read again. Files that have changed since
+ * watching started, and don't have an output newer than themselves, are converted as if they've just appeared.
+ * Returns false if there's no memory.
+ */
+static bool watch_rescan(const struct pngquant_options *options, const struct file_stream *stream, time_t since, struct watch_pending_list *pending, double ready_time)
+{
+    DIR *dir = opendir(options->watch_dir);
+    if (!dir) {
+        fprintf(stderr, "  error: cannot read directory %s (%s)\n", options->watch_dir, strerror(errno));
+        return true;
+    }
+
+    bool ok = true;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        if (!is_wanted_file(NULL, name, stream) || watch_pending_has(pending, name)) {
+            continue;
+        }
+
+        char *filename = join_path(options->watch_dir, name);
+        struct stat st;
+        if (!filename || 0 != stat(filename, &st) || !S_ISREG(st.st_mode) || st.st_mtime < since) {
+            free(filename);
+            continue;
+        }
+        bool converted = false;
+        if (!stream->variants->count) {
+            char *outname = add_filename_extension(filename, options->extension);
+            struct stat out_st;
+            converted = outname && 0 == stat(outname, &out_st) && out_st.st_mtime >= st.st_mtime;
+            free(outname);
+        }
+        free(filename);
+
+        if (!converted) {
+            ok = watch_pending_add(pending, name, ready_time);
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+/*
+ * Converts files as they're written to or moved into the directory, until the directory is removed.
+ * Files that are closed after writing are converted once nothing has been written to them for a moment,
+ * so that writers that close and reopen files don't get them converted half-way.
+ * The OpenMP team stays running, and each file is a task for one of its threads.
+ */
+static pngquant_error watch_directory(struct pngquant_options *options, liq_attr *liq, const struct variant_list *variants)
+{
+    const int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "  error: can't watch files (%s)\n", strerror(errno));
+        return READ_ERROR;
+    }
+    if (inotify_add_watch(fd, options->watch_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) < 0) {
+        fprintf(stderr, "  error: can't watch %s (%s)\n", options->watch_dir, strerror(errno));
+        close(fd);
+        return READ_ERROR;
+    }
+
+    struct file_stream stream;
+    if (SUCCESS != file_stream_init(&stream, options, liq, variants)) {
+        close(fd);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    verbose_printf(liq, options, "Watching %s for new files", options->watch_dir);
+    const time_t watch_start = time(NULL);
+
+    struct watch_pending_list pending = {NULL};
+    pngquant_error retval = SUCCESS;
+
+    #pragma omp parallel shared(stream, pending, retval)
+    #pragma omp single
+    {
+        bool watching = true;
+        while (watching) {
+            double now = current_time(), next_ready = 0;
+            for(unsigned int i=0; i < pending.count; i++) {
+                if (!next_ready || pending.files[i].ready_time < next_ready) next_ready = pending.files[i].ready_time;
+            }
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            const int timeout = pending.count ? (next_ready > now ? (int)((next_ready - now) * 1000.0) + 1 : 0) : -1;
+            const int polled = poll(&pfd, 1, timeout);
+            if (polled < 0 && errno != EINTR) {
+                fprintf(stderr, "  error: can't watch %s (%s)\n", options->watch_dir, strerror(errno));
+                retval = READ_ERROR;
+                break;
+            }
+
+            if (polled > 0) {
+                char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+                const ssize_t length = read(fd, events, sizeof(events));
+                now = current_time();
+                bool overflowed = false;
+                for(ssize_t offset = 0; offset < length;) {
+                    const struct inotify_event *event = (const struct inotify_event *)(events + offset);
+                    offset += sizeof(struct inotify_event) + event->len;
+
+                    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                        watching = false;
+                        continue;
+                    }
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        overflowed = true;
+                        continue;
+                    }
+                    if (!event->len || (event->mask & IN_ISDIR)) continue;
+
+                    unsigned int i = 0;
+                    while (i < pending.count && (!pending.files[i].name || 0 != strcmp(pending.files[i].name, event->name))) i++;
+                    if (i < pending.count) {
+                        pending.files[i].ready_time = now + WATCH_SETTLE_MS / 1000.0; // still being written
+                    } else if (!(event->mask & IN_MODIFY) && is_wanted_file(NULL, event->name, &stream)) {
+                        if (!watch_pending_add(&pending, event->name, now + WATCH_SETTLE_MS / 1000.0)) {
+                            retval = OUT_OF_MEMORY_ERROR;
+                            watching = false;
+                            break;
+                        }
+                    }
+                }
+
+                if (overflowed && watching) {
+                    verbose_printf(liq, options, "  too many files at once; looking for them in %s", options->watch_dir);
+                    if (!watch_rescan(options, &stream, watch_start, &pending, now + WATCH_SETTLE_MS / 1000.0)) {
+                        retval = OUT_OF_MEMORY_ERROR;
+                        watching = false;
+                    }
+                }
+            }
+
+            // files that settled are sent to the other threads; the list is only touched by this thread
+            for(unsigned int i=0; i < pending.count;) {
+                if (pending.files[i].ready_time > now && watching) {
+                    i++;
+                    continue;
+                }
+                char *filename = pending.files[i].name ? join_path(options->watch_dir, pending.files[i].name) : NULL;
+                char *outname = filename && !variants->count ? add_filename_extension(filename, options->extension) : NULL;
+                if (filename && (outname || variants->count)) {
+                    // with only one thread the file is converted right away
+                    #pragma omp task firstprivate(filename, outname) if (omp_get_num_threads() > 1)
+                    convert_streamed_file(filename, outname, &stream);
+                } else {
+                    free(filename);
+                }
+                free(pending.files[i].name);
+                pending.files[i] = pending.files[--pending.count];
+            }
+        }
+        #pragma omp taskwait
+    }
+
+    free(pending.files);
+    close(fd);
+
+    verbose_printf(liq, options, "Stopped watching %s", options->watch_dir);
+    const pngquant_error summary_retval = file_stream_finish(&stream);
+    return retval ? retval : summary_retval;
+}
+
+#define SERVE_MAX_CONNECTIONS 1024
+#define SERVE_MAX_PENDING_JOBS 16 // per connection. Further requests wait in the socket until a job is done.
+#define SERVE_SEND_TIMEOUT_S 10 // a client that doesn't read its responses can't keep a thread waiting for long
+#define SERVE_CHECK_MS 1000 // how often it's checked that the socket file hasn't been removed
+
+struct serve_connection {
+    int fd;
+    int wake_fd; // eventfd that interrupts poll() when a full connection can take requests again
+    unsigned int pending_jobs; // responses that haven't been sent yet
+    bool closed; // by the client, and it's closed once pending jobs are done
+};
+
+static bool send_serve_response(int fd, const struct pngquant_serve_response *response, int output_fd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = (void *)response, .iov_len = sizeof(*response)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (output_fd >= 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &output_fd, sizeof(int));
+    }
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(*response);
+}
+
+/*
+ * The input memfd is mapped, so the image isn't copied through a pipe or socket, and the output is written
+ * to a new memfd, which is given to the client. Seals guarantee that neither changes while the other side reads it.
+ */
+static pngquant_error convert_serve_job(const char *name, int input_fd, int *output_fd, uint64_t *output_size, struct pngquant_file_stats *stats, struct file_stream *stream)
+{
+    const int required_seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+    const int seals = fcntl(input_fd, F_GET_SEALS);
+    if (seals < 0 || (seals & required_seals) != required_seals) {
+        fprintf(stderr, "  error: %s: input has to be a memfd sealed with F_SEAL_SHRINK and F_SEAL_WRITE\n", name);
+        return INVALID_ARGUMENT;
+    }
+    struct stat st;
+    if (0 != fstat(input_fd, &st) || st.st_size <= 0) {
+        fprintf(stderr, "  error: %s: input is empty\n", name);
+        return READ_ERROR;
+    }
+    void *input = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, input_fd, 0);
+    if (MAP_FAILED == input) {
+        fprintf(stderr, "  error: %s: cannot map input (%s)\n", name, strerror(errno));
+        return READ_ERROR;
+    }
+
+    struct pngquant_options opts = *stream->options;
+    opts.input_stream = fmemopen(input, st.st_size, "rb");
+    *output_fd = memfd_create("pngquant-output", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    const int output_dup = *output_fd >= 0 ? dup(*output_fd) : -1; // closed by fclose
+    opts.output_stream = output_dup >= 0 ? fdopen(output_dup, "wb") : NULL;
+    if (!opts.output_stream && output_dup >= 0) {
+        close(output_dup);
+    }
+
+    pngquant_error retval = SUCCESS;
+    if (!opts.input_stream) {
+        retval = OUT_OF_MEMORY_ERROR;
+    } else if (!opts.output_stream) {
+        fprintf(stderr, "  error: %s: cannot create output (%s)\n", name, strerror(errno));
+        retval = CANT_WRITE_ERROR;
+    }
+
+    struct input_file header;
+    if (SUCCESS == retval) {
+        retval = convert_streamed_image(name, name, &opts, &header, stats, stream);
+    }
+
+    if (opts.output_stream && 0 != fclose(opts.output_stream) && SUCCESS == retval) {
+        retval = CANT_WRITE_ERROR;
+    }
+    if (opts.input_stream) {
+        fclose(opts.input_stream);
+    }
+    munmap(input, st.st_size);
+
+    // the original is the output when the converted image is too large, with --copy-if-larger
+    const bool has_output = SUCCESS == retval || (TOO_LARGE_FILE == retval && opts.copy_if_larger);
+    if (has_output && 0 == fstat(*output_fd, &st) && st.st_size > 0 &&
+        0 == fcntl(*output_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+        *output_size = st.st_size;
+    } else if (*output_fd >= 0) {
+        close(*output_fd);
+        *output_fd = -1;
+    }
+    return retval;
+}
+
+static void serve_job(struct serve_connection *connection, uint64_t id, int input_fd, struct file_stream *stream)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "job %llu", (unsigned long long)id);
+
+    struct pngquant_serve_response response = {.magic = PNGQUANT_SERVE_MAGIC, .id = id, .quality = -1};
+    struct pngquant_file_stats stats = {0};
+    int output_fd = -1;
+    pngquant_error retval = INVALID_ARGUMENT;
+    if (input_fd >= 0) {
+        retval = convert_serve_job(name, input_fd, &output_fd, &response.size, &stats, stream);
+        close(input_fd);
+    }
+    response.status = retval;
+    if (SUCCESS == retval) {
+        response.quality = stats.quality_percent;
+    }
+
+    // if the client has gone away, there's no one to tell
+    send_serve_response(connection->fd, &response, output_fd);
+    if (output_fd >= 0) {
+        close(output_fd);
+    }
+    file_stream_add(stream, name, retval, &stats);
+
+    bool was_full;
+    #pragma omp critical (serve)
+    {
+        was_full = connection->pending_jobs-- >= SERVE_MAX_PENDING_JOBS;
+    }
+    if (was_full) {
+        const uint64_t one = 1;
+        if (write(connection->wake_fd, &one, sizeof(one)) < 0) {
+            // the counter is already non-zero, so poll() wakes up anyway
+        }
+    }
+}
+
+/* Reads one request, and makes a task for it. Returns false when the client has closed the connection. */
+static bool receive_serve_request(struct serve_connection *connection, struct file_stream *stream)
+{
+    union {
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct pngquant_serve_request request = {0};
+    struct iovec iov = {.iov_base = &request, .iov_len = sizeof(request)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    const ssize_t received = recvmsg(connection->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (received < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) {
+        return true;
+    }
+    if (received <= 0) {
+        return false;
+    }
+
+    int input_fd = -1;
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type) continue;
+        const unsigned int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(unsigned int i=0; i < num_fds; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (input_fd < 0) {
+                input_fd = fd;
+            } else {
+                close(fd); // only one image per request
+            }
+        }
+    }
+
+    if (sizeof(request) != received || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+        PNGQUANT_SERVE_MAGIC != request.magic || PNGQUANT_SERVE_VERSION != request.version || input_fd < 0) {
+        fprintf(stderr, "  error: invalid request for job %llu\n", (unsigned long long)request.id);
+        if (input_fd >= 0) close(input_fd);
+        input_fd = -1; // the task only sends the error
+    }
+
+    #pragma omp critical (serve)
+    connection->pending_jobs++;
+
+    const uint64_t id = request.id;
+    #pragma omp task firstprivate(connection, id, input_fd) if (omp_get_num_threads() > 1)
+    serve_job(connection, id, input_fd, stream);
+    return true;
+}
+
+static bool same_file(const char *path, const struct stat *expected)
+{
+    struct stat st;
+    return 0 == lstat(path, &st) && st.st_ino == expected->st_ino && st.st_dev == expected->st_dev;
+}
+
+/*
+ * Converts images sent over a Unix socket in memfds, until the socket file is removed.
+ * The OpenMP team stays running, and each image is a task for one of its threads,
+ * while one thread accepts connections and reads requests.
+ */
+static pngquant_error serve_jobs(struct pngquant_options *options, liq_attr *liq, const struct variant_list *variants)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(options->serve_socket) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "  error: socket path %s is too long\n", options->serve_socket);
+        return INVALID_ARGUMENT;
+    }
+    strcpy(address.sun_path, options->serve_socket);
+
+    // a socket left by a server that didn't exit cleanly is replaced, but other files aren't
+    struct stat st;
+    if (0 == lstat(options->serve_socket, &st) && S_ISSOCK(st.st_mode)) {
+        unlink(options->serve_socket);
+    }
+
+    const int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || 0 != bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) ||
+        0 != listen(listen_fd, 64) || 0 != lstat(options->serve_socket, &st)) {
+        fprintf(stderr, "  error: can't listen on %s (%s)\n", options->serve_socket, strerror(errno));
+        if (listen_fd >= 0) close(listen_fd);
+        return CANT_WRITE_ERROR;
+    }
+
+    const int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        fprintf(stderr, "  error: can't serve on %s (%s)\n", options->serve_socket, strerror(errno));
+        close(listen_fd);
+        return CANT_WRITE_ERROR;
+    }
+
+    struct file_stream stream;
+    if (SUCCESS != file_stream_init(&stream, options, liq, variants)) {
+        close(wake_fd);
+        close(listen_fd);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    verbose_printf(liq, options, "Serving on %s", options->serve_socket);
+
+    struct serve_connection *connections[SERVE_MAX_CONNECTIONS];
+    unsigned int num_connections = 0;
+    pngquant_error retval = SUCCESS;
+
+    #pragma omp parallel shared(stream, connections, num_connections, retval)
+    #pragma omp single
+    {
+        while (same_file(options->serve_socket, &st)) {
+            // connections closed by clients are freed once their responses have been sent
+            for(unsigned int i=0; i < num_connections; i++) {
+                bool finished;
+                #pragma omp critical (serve)
+                finished = connections[i]->closed && !connections[i]->pending_jobs;
+                if (finished) {
+                    close(connections[i]->fd);
+                    free(connections[i]);
+                    connections[i--] = connections[--num_connections];
+                }
+            }
+
+            // connections with too many jobs in progress aren't read until one of them is done
+            struct pollfd pfds[2 + SERVE_MAX_CONNECTIONS];
+            struct serve_connection *polled_connections[SERVE_MAX_CONNECTIONS];
+            unsigned int num_polled = 0;
+            pfds[0] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+            pfds[1] = (struct pollfd){.fd = wake_fd, .events = POLLIN};
+            for(unsigned int i=0; i < num_connections; i++) {
+                bool can_take_jobs;
+                #pragma omp critical (serve)
+                can_take_jobs = !connections[i]->closed && connections[i]->pending_jobs < SERVE_MAX_PENDING_JOBS;
+                if (can_take_jobs) {
+                    polled_connections[num_polled] = connections[i];
+                    pfds[2 + num_polled++] = (struct pollfd){.fd = connections[i]->fd, .events = POLLIN};
+                }
+            }
+
+            const int polled = poll(pfds, 2 + num_polled, SERVE_CHECK_MS);
+            if (polled < 0 && errno != EINTR) {
+                fprintf(stderr, "  error: can't serve on %s (%s)\n", options->serve_socket, strerror(errno));
+                retval = READ_ERROR;
+                break;
+            }
+            if (polled <= 0) continue;
+
+            if (pfds[1].revents & POLLIN) {
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) < 0) {
+                    // another wakeup has already reset it
+                }
+            }
+
+            for(unsigned int i=0; i < num_polled; i++) {
+                if (pfds[2 + i].revents && !receive_serve_request(polled_connections[i], &stream)) {
+                    #pragma omp critical (serve)
+                    polled_connections[i]->closed = true;
+                }
+            }
+
+            if (pfds[0].revents & POLLIN) {
+                const int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                struct serve_connection *connection = fd >= 0 && num_connections < SERVE_MAX_CONNECTIONS ? calloc(1, sizeof(*connection)) : NULL;
+                const struct timeval send_timeout = {.tv_sec = SERVE_SEND_TIMEOUT_S};
+                if (connection) {
+                    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+                    connection->fd = fd;
+                    connection->wake_fd = wake_fd;
+                    connections[num_connections++] = connection;
+                } else if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        }
+        #pragma omp taskwait
+    }
+
+    for(unsigned int i=0; i < num_connections; i++) {
+        close(connections[i]->fd);
+        free(connections[i]);
+    }
+    close(wake_fd);
+    close(listen_fd);
+
+    verbose_printf(liq, options, "Stopped serving on %s", options->serve_socket);
+    const pngquant_error summary_retval = file_stream_finish(&stream);
+    return retval ? retval : summary_retval;
+}
+#endif
+
+#if !(defined(_WIN32) || defined(WIN32) || defined(__WIN32__))
+#define OUTPUT_BUFFER_MIN_SIZE (1<<16)
+#define CONTEXT_POOLED_JOBS_PER_THREAD 2 // released results kept with their buffers, for reuse by the next images
+
+/* In-memory output of pngquant_context, which is written by stdio as if it was a file */
+struct output_buffer {
+    unsigned char *data;
+    size_t size, capacity, position;
+};
+
+static bool output_buffer_write(struct output_buffer *buf, const char *data, size_t size)
+{
+    if (size > buf->capacity - buf->position) {
+        size_t capacity = buf->capacity ? buf->capacity : OUTPUT_BUFFER_MIN_SIZE;
+        while (size > capacity - buf->position) {
+            capacity *= 2;
+        }
+        unsigned char *new_data = realloc(buf->data, capacity);
+        if (!new_data) return false;
+        buf->data = new_data;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->position, data, size);
+    buf->position += size;
+    if (buf->position > buf->size) {
+        buf->size = buf->position;
+    }
+    return true;
+}
+
+/* Returns the new position or -1. Rewinding truncates, because write_image() only rewinds to replace the output. */
+static long long output_buffer_seek(struct output_buffer *buf, long long offset, int whence)
+{
+    const long long base = SEEK_END == whence ? (long long)buf->size : (SEEK_CUR == whence ? (long long)buf->position : 0);
+    if (offset < -base || base + offset > (long long)buf->size) {
+        return -1;
+    }
+    buf->position = base + offset;
+    if (!buf->position) {
+        buf->size = 0;
+    }
+    return buf->position;
+}
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+static int output_buffer_funopen_write(void *cookie, const char *data, int size)
+{
+    return output_buffer_write(cookie, data, size) ? size : -1;
+}
+
+static fpos_t output_buffer_funopen_seek(void *cookie, fpos_t offset, int whence)
+{
+    return output_buffer_seek(cookie, offset, whence);
+}
+
+static FILE *output_buffer_open(struct output_buffer *buf)
+{
+    return funopen(buf, NULL, output_buffer_funopen_write, output_buffer_funopen_seek, NULL);
+}
+#else
+static ssize_t output_buffer_cookie_write(void *cookie, const char *data, size_t size)
+{
+    return output_buffer_write(cookie, data, size) ? (ssize_t)size : 0;
+}
+
+static int output_buffer_cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+    const long long position = output_buffer_seek(cookie, *offset, whence);
+    if (position < 0) return -1;
+    *offset = position;
+    return 0;
+}
+
+static FILE *output_buffer_open(struct output_buffer *buf)
+{
+    return fopencookie(buf, "wb", (cookie_io_functions_t){.write = output_buffer_cookie_write, .seek = output_buffer_cookie_seek});
+}
+#endif
+
+struct context_job {
+    pngquant_result result; // first, so that the job is found from the result
+    struct context_job *next; // in the queue or the pool
+    char *filename, *outname;
+    const void *png;
+    size_t png_size;
+    pngquant_callback *callback;
+    void *user_info;
+    struct output_buffer output; // kept in the pool, and reused by the next image
+};
+
+struct pngquant_context {
+    struct pngquant_options options;
+    liq_attr *liq;
+    struct variant_list variants; // always empty
+    struct file_stream stream;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_added, job_done;
+    struct context_job *queue_head, *queue_tail, *pooled_jobs;
+    unsigned int pending_jobs, pooled_job_count, max_pooled_jobs;
+    bool stopping;
+};
+
+static void run_context_job(pngquant_context *context, struct context_job *job)
+{
+    const double start_time = current_time();
+    char name[32];
+    const char *filename = job->filename;
+    if (!filename) {
+        snprintf(name, sizeof(name), "job %llu", (unsigned long long)job->result.id);
+        filename = name;
+    }
+
+    struct pngquant_options opts = context->options;
+    pngquant_error retval = SUCCESS;
+    if (job->png && !(opts.input_stream = fmemopen((void *)job->png, job->png_size, "rb"))) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+    if (!job->outname) {
+        job->output.size = job->output.position = 0;
+        if (!(opts.output_stream = output_buffer_open(&job->output))) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+    } else if (!opts.force && file_exists(job->outname)) {
+        fprintf(stderr, "  error: '%s' exists; not overwriting\n", job->outname);
+        retval = NOT_OVERWRITING_ERROR;
+    }
+
+    struct input_file input = {.filename = filename};
+    struct pngquant_file_stats stats = {0};
+    if (SUCCESS == retval) {
+        retval = convert_streamed_image(filename, job->outname ? job->outname : filename, &opts, &input, &stats, &context->stream);
+    }
+
+    if (opts.output_stream && 0 != fclose(opts.output_stream) && SUCCESS == retval) {
+        retval = CANT_WRITE_ERROR;
+    }
+    if (opts.input_stream) {
+        fclose(opts.input_stream);
+    }
+    file_stream_add(&context->stream, filename, retval, &stats);
+
+    // the original is the output when the converted image is too large, with --copy-if-larger
+    const bool has_output = SUCCESS == retval || (TOO_LARGE_FILE == retval && opts.copy_if_larger);
+    job->result = (pngquant_result){
+        .status = retval,
+        .id = job->result.id,
+        .data = has_output && !job->outname ? job->output.data : NULL,
+        .size = !has_output ? 0 : (job->outname ? stats.output_size : job->output.size),
+        .input_size = input.has_header ? input.header.file_size : 0,
+        .width = input.has_header ? input.header.width : 0,
+        .height = input.has_header ? input.header.height : 0,
+        .quality = SUCCESS == retval ? stats.quality_percent : -1,
+        .mse = stats.mse,
+        .seconds = current_time() - start_time,
+    };
+    job->callback(&job->result, job->user_info);
+
+    pthread_mutex_lock(&context->mutex);
+    if (!--context->pending_jobs) {
+        pthread_cond_broadcast(&context->job_done);
+    }
+    pthread_mutex_unlock(&context->mutex);
+}
+
+/* Waits for the next job. Returns NULL once the context is destroyed and there are no more jobs. */
+static struct context_job *next_context_job(pngquant_context *context)
+{
+    pthread_mutex_lock(&context->mutex);
+    while (!context->queue_head && !context->stopping) {
+        pthread_cond_wait(&context->job_added, &context->mutex);
+    }
+    struct context_job *job = context->queue_head;
+    if (job) {
+        context->queue_head = job->next;
+        if (!context->queue_head) {
+            context->queue_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&context->mutex);
+    return job;
+}
+
+/*
+ * Like --serve, the OpenMP team stays running, and each image is a task for one of its threads,
+ * while one thread waits for images to be submitted.
+ */
+static void *context_thread(void *user_info)
+{
+    pngquant_context *context = user_info;
+#ifdef _OPENMP
+    omp_set_nested(0); // there may be many images at once, so each is converted by one thread
+#endif
+
+    #pragma omp parallel
+    #pragma omp single
+    {
+        struct context_job *job;
+        while ((job = next_context_job(context))) {
+            #pragma omp task firstprivate(job) if (omp_get_num_threads() > 1)
+            run_context_job(context, job);
+        }
+        #pragma omp taskwait
+    }
+    return NULL;
+}
+
+static void free_context(pngquant_context *context)
+{
+    while (context->pooled_jobs) {
+        struct context_job *job = context->pooled_jobs;
+        context->pooled_jobs = job->next;
+        free(job->output.data);
+        free(job);
+    }
+    if (context->options.fixed_palette_image) {
+        liq_image_destroy(context->options.fixed_palette_image);
+    }
+    if (context->liq) {
+        liq_attr_destroy(context->liq);
+    }
+    free(context);
+}
+
+pngquant_context *pngquant_context_create(const struct pngquant_options *options, const liq_attr *liq, pngquant_error *error)
+{
+    pngquant_error unused_error;
+    if (!error) error = &unused_error;
+    *error = INVALID_ARGUMENT;
+
+    if (options->num_files || options->files || options->using_stdin || options->using_stdout || options->output_file_path ||
+        options->input_stream || options->output_stream || options->fixed_palette_image ||
+        options->variants || options->dedupe || options->shared_palette || options->emit_histogram || options->emit_palette || options->merge_histograms ||
+        options->watch_dir || options->recursive_dir || options->output_dir || options->include_glob || options->exclude_glob ||
+        options->files_from || options->shard || options->merge_summaries || options->serve_socket || options->dry_run) {
+        fputs("pngquant_context converts images submitted to it, and can't be used with input files, --output, stdout, --variants, --dedupe, --shared-palette, --emit-histogram, --emit-palette, --watch, --recursive, --files-from, --shard, --serve or --dry-run\n", stderr);
+        return NULL;
+    }
+    if (options->raw && (options->skip_if_larger || options->target_size)) {
+        fputs("--raw files aren't compressed, so they can't be used with --skip-if-larger, --copy-if-larger or --target-size\n", stderr);
+        return NULL;
+    }
+    if (options->target_size && (options->map_file || options->deadline_ms || options->speed_auto)) {
+        fputs("--target-size picks its own palette, and can't be used with --map, --deadline or --speed auto\n", stderr);
+        return NULL;
+    }
+
+    pngquant_context *context = calloc(1, sizeof(*context));
+    if (!context) {
+        *error = OUT_OF_MEMORY_ERROR;
+        return NULL;
+    }
+    context->options = *options;
+    context->liq = liq_attr_copy(liq);
+    if (!context->liq) {
+        free_context(context);
+        *error = OUT_OF_MEMORY_ERROR;
+        return NULL;
+    }
+    if (options->map_file) {
+        pngquant_error map_retval = load_map_file(&context->options, context->liq);
+        if (map_retval) {
+            free_context(context);
+            *error = map_retval;
+            return NULL;
+        }
+    }
+
+    context->max_pooled_jobs = CONTEXT_POOLED_JOBS_PER_THREAD * omp_get_max_threads();
+    context->stream = (struct file_stream){
+        .options = &context->options,
+        .liq = context->liq,
+        .variants = &context->variants,
+        .memory_budget = {.limit = options->max_memory},
+        .auto_speed = {.time_scale = 1.0},
+        .shard_index = 1,
+        .shard_count = 1,
+        .start_time = current_time(),
+    };
+
+    pthread_mutex_init(&context->mutex, NULL);
+    pthread_cond_init(&context->job_added, NULL);
+    pthread_cond_init(&context->job_done, NULL);
+    if (0 != pthread_create(&context->thread, NULL, context_thread, context)) {
+        pthread_cond_destroy(&context->job_done);
+        pthread_cond_destroy(&context->job_added);
+        pthread_mutex_destroy(&context->mutex);
+        free_context(context);
+        *error = OUT_OF_MEMORY_ERROR;
+        return NULL;
+    }
+
+    *error = SUCCESS;
+    return context;
+}
+
+/* A job from the pool, with the buffer of an earlier image, or a new one */
+static struct context_job *new_context_job(pngquant_context *context, uint64_t id, pngquant_callback *callback, void *user_info)
+{
+    pthread_mutex_lock(&context->mutex);
+    struct context_job *job = context->pooled_jobs;
+    if (job) {
+        context->pooled_jobs = job->next;
+        context->pooled_job_count--;
+    }
+    pthread_mutex_unlock(&context->mutex);
+
+    if (!job && !(job = calloc(1, sizeof(*job)))) {
+        return NULL;
+    }
+    const struct output_buffer output = job->output;
+    *job = (struct context_job){
+        .result = {.id = id},
+        .callback = callback,
+        .user_info = user_info,
+        .output = output,
+    };
+    return job;
+}
+
+static void submit_context_job(pngquant_context *context, struct context_job *job)
+{
+    pthread_mutex_lock(&context->mutex);
+    if (context->queue_tail) {
+        context->queue_tail->next = job;
+    } else {
+        context->queue_head = job;
+    }
+    context->queue_tail = job;
+    context->pending_jobs++;
+    pthread_cond_signal(&context->job_added);
+    pthread_mutex_unlock(&context->mutex);
+}
+
+pngquant_error pngquant_submit_file(pngquant_context *context, const char *filename, const char *outname, uint64_t id, pngquant_callback *callback, void *user_info)
+{
+    if (!filename || !callback) {
+        return INVALID_ARGUMENT;
+    }
+    struct context_job *job = new_context_job(context, id, callback, user_info);
+    if (!job) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    job->filename = strdup(filename);
+    job->outname = outname ? strdup(outname) : NULL;
+    if (!job->filename || (outname && !job->outname)) {
+        pngquant_result_release(context, &job->result);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    submit_context_job(context, job);
+    return SUCCESS;
+}
+
+pngquant_error pngquant_submit_memory(pngquant_context *context, const void *png, size_t size, uint64_t id, pngquant_callback *callback, void *user_info)
+{
+    if (!png || !size || !callback) {
+        return INVALID_ARGUMENT;
+    }
+    struct context_job *job = new_context_job(context, id, callback, user_info);
+    if (!job) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    job->png = png;
+    job->png_size = size;
+    submit_context_job(context, job);
+    return SUCCESS;
+}
+
+void pngquant_result_release(pngquant_context *context, pngquant_result *result)
+{
+    struct context_job *job = (struct context_job *)result;
+    free(job->filename);
+    free(job->outname);
+    job->filename = job->outname = NULL;
+
+    pthread_mutex_lock(&context->mutex);
+    if (context->pooled_job_count < context->max_pooled_jobs) {
+        job->next = context->pooled_jobs;
+        context->pooled_jobs = job;
+        context->pooled_job_count++;
+        job = NULL;
+    }
+    pthread_mutex_unlock(&context->mutex);
+
+    if (job) {
+        free(job->output.data);
+        free(job);
+    }
+}
+
+void pngquant_context_wait(pngquant_context *context)
+{
+    pthread_mutex_lock(&context->mutex);
+    while (context->pending_jobs) {
+        pthread_cond_wait(&context->job_done, &context->mutex);
+    }
+    pthread_mutex_unlock(&context->mutex);
+}
+
+pngquant_error pngquant_context_destroy(pngquant_context *context)
+{
+    pthread_mutex_lock(&context->mutex);
+    context->stopping = true;
+    pthread_cond_signal(&context->job_added);
+    pthread_mutex_unlock(&context->mutex);
+    pthread_join(context->thread, NULL);
+
+    const pngquant_error retval = file_stream_finish(&context->stream);
+    pthread_cond_destroy(&context->job_done);
+    pthread_cond_destroy(&context->job_added);
+    pthread_mutex_destroy(&context->mutex);
+    free_context(context);
+    return retval;
+}
+#else
+pngquant_context *pngquant_context_create(const struct pngquant_options *options, const liq_attr *liq, pngquant_error *error)
+{
+    fputs("pngquant_context isn't supported on Windows\n", stderr);
+    if (error) *error = INVALID_ARGUMENT;
+    return NULL;
+}
+
+pngquant_error pngquant_submit_file(pngquant_context *context, const char *filename, const char *outname, uint64_t id, pngquant_callback *callback, void *user_info)
+{
+    return INVALID_ARGUMENT;
+}
+
+pngquant_error pngquant_submit_memory(pngquant_context *context, const void *png, size_t size, uint64_t id, pngquant_callback *callback, void *user_info)
+{
+    return INVALID_ARGUMENT;
+}
+
+void pngquant_result_release(pngquant_context *context, pngquant_result *result)
+{
+}
+
+void pngquant_context_wait(pngquant_context *context)
+{
+}
+
+pngquant_error pngquant_context_destroy(pngquant_context *context)
+{
+    return SUCCESS;
+}
+#endif
+
+#ifndef PNGQUANT_NO_MAIN
+int main(int argc, char *argv[])
+{
+    struct pngquant_options options = {
+        .floyd = 1.f, // floyd-steinberg dithering
+        .strip = false,
+    };
+
+    pngquant_error retval = pngquant_parse_options(argc, argv, &options);
+    if (retval != SUCCESS) {
+        return retval;
+    }
+
+    if (options.print_version) {
+        puts(PNGQUANT_VERSION);
+        return SUCCESS;
+    }
+
+    if (options.missing_arguments) {
+        print_full_version(stderr);
+        print_usage(stderr);
+        return MISSING_ARGUMENT;
+    }
+
+    if (options.print_help) {
+        print_full_version(stdout);
+        print_usage(stdout);
+        return SUCCESS;
+    }
+
+#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
+    setlocale(LC_ALL, ".65001"); // issue #376; set UTF-8 for Unicode filenames
+#endif
+
+    liq_attr *liq = liq_attr_create();
+
+    if (!liq) {
+        fputs("SSE-capable CPU is required for this build.\n", stderr);
+        return WRONG_ARCHITECTURE;
+    }
+
+    if (options.quality && !parse_quality(options.quality, liq, &options.min_quality_limit)) {
+        fputs("Quality should be in format min-max where min and max are numbers in range 0-100.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.iebug) {
+        // opacities above 238 will be rounded up to 255, because IE6 truncates <255 to 0.
+        liq_set_min_opacity(liq, 238);
+        fputs("  warning: the workaround for IE6 is deprecated\n", stderr);
+    }
+
+    if (options.verbose) {
+        liq_set_log_callback(liq, log_callback, NULL);
+        options.log_callback = log_callback;
+    }
+
+    if (options.last_index_transparent) {
+        liq_set_last_index_transparent(liq, true);
+    }
+
+    if (options.speed >= 10) {
+        options.fast_compression = true;
+        if (options.speed == 11) {
+            options.floyd = 0;
+            options.speed = 10;
+        }
+    }
+
+    if (options.speed && LIQ_OK != liq_set_speed(liq, options.speed)) {
+        fputs("Speed should be between 1 (slow) and 11 (fast).\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.colors && LIQ_OK != liq_set_max_colors(liq, options.colors)) {
+        fputs("Number of colors must be between 2 and 256.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.posterize && LIQ_OK != liq_set_min_posterization(liq, options.posterize)) {
+        fputs("Posterization should be number of bits in range 0-4.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.extension && options.output_file_path) {
+        fputs("--ext and --output options can't be used at the same time\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    // new filename extension depends on options used. Typically basename-fs8.png
+    if (options.extension == NULL) {
+        if (options.variants) {
+            options.extension = options.raw ? "-{dither}-{colors}.raw" : "-{dither}-{colors}.png";
+        } else if (options.floyd > 0) {
+            options.extension = options.raw ? "-fs8.raw" : "-fs8.png";
+        } else {
+            options.extension = options.raw ? "-or8.raw" : "-or8.png";
+        }
+    }
+
+    if (options.output_file_path && options.num_files != 1) {
+        fputs("  error: Only one input file is allowed when --output is used. This error also happens when filenames with spaces are not in quotes.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.using_stdout && !options.using_stdin && options.num_files != 1) {
+        fputs("  error: Only one input file is allowed when using the special output path \"-\" to write to stdout. This error also happens when filenames with spaces are not in quotes.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (!options.num_files && !options.using_stdin && !options.watch_dir && !options.recursive_dir && !options.files_from && !options.serve_socket) {
+        fputs("No input files specified.\n", stderr);
+        if (options.verbose) {
+            print_full_version(stderr);
+        }
+        print_usage(stderr);
+        return MISSING_ARGUMENT;
+    }
+
+    retval = pngquant_main_internal(&options, liq);
+    liq_attr_destroy(liq);
+    return retval;
+}
+#endif
+
+// Don't use this. This is not a public API, which is in pngquant.h.
+pngquant_error pngquant_main_internal(struct pngquant_options *options, liq_attr *liq)
+{
+#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
+    setlocale(LC_ALL, ".65001"); // issue #376; set UTF-8 for Unicode filenames
+#endif
+
+    if (options->merge_summaries) {
+        if (options->using_stdin || options->shard || options->files_from || options->watch_dir || options->recursive_dir) {
+            fputs("--merge-summaries only reads summary files, and can't be used with stdin, --shard, --files-from, --watch or --recursive\n", stderr);
+            return INVALID_ARGUMENT;
+        }
+        return merge_summary_files(options, liq);
+    }
+
+    if (options->merge_histograms && !options->emit_histogram && !options->emit_palette) {
+        fputs("--merge-histograms needs --emit-histogram or --emit-palette\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if ((options->emit_histogram || options->emit_palette) && (options->using_stdin || options->map_file || options->shared_palette || options->variants)) {
+        fputs("--emit-histogram and --emit-palette only read files, and can't be used with stdin, --map, --shared-palette or --variants\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options->shared_palette && (options->map_file || options->using_stdin)) {
+        fputs("--shared-palette can't be used with --map or stdin, because it needs to read all files twice\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options->map_file) {
+        pngquant_error map_retval = load_map_file(options, liq);
+        if (map_retval) {
+            return map_retval;
+        }
     }
 
-    if (options.quality && !parse_quality(options.quality, liq, &options.min_quality_limit)) {
-        fputs("Quality should be in format min-max where min and max are numbers in range 0-100.\n", stderr);
+    if (options->watch_dir && (options->num_files || options->using_stdin || options->output_file_path || options->using_stdout ||
+                               options->dedupe || options->shared_palette || options->emit_histogram || options->emit_palette || options->dry_run)) {
+        fputs("--watch converts files as they appear, and can't be used with input files, --output, stdout, --dedupe, --shared-palette, --emit-histogram, --emit-palette or --dry-run\n", stderr);
         return INVALID_ARGUMENT;
     }
 
-    if (options.iebug) {
-        // opacities above 238 will be rounded up to 255, because IE6 truncates <255 to 0.
-        liq_set_min_opacity(liq, 238);
-        fputs("  warning: the workaround for IE6 is deprecated\n", stderr);
+    if (options->watch_dir && (0 == strcmp(options->extension, ".png") || 0 == strcmp(options->extension, ".PNG"))) {
+        fputs("--watch can't write files over themselves with --ext .png, because every written file would be converted again\n", stderr);
+        return INVALID_ARGUMENT;
     }
 
-    if (options.verbose) {
-        liq_set_log_callback(liq, log_callback, NULL);
-        options.log_callback = log_callback;
+    if (options->recursive_dir && (options->num_files || options->using_stdin || options->output_file_path || options->using_stdout || options->watch_dir ||
+                                   options->dedupe || options->shared_palette || options->emit_histogram || options->emit_palette)) {
+        fputs("--recursive finds its own input files, and can't be used with input files, --output, stdout, --watch, --dedupe, --shared-palette, --emit-histogram or --emit-palette\n", stderr);
+        return INVALID_ARGUMENT;
     }
 
-    if (options.last_index_transparent) {
-        liq_set_last_index_transparent(liq, true);
+    if (options->serve_socket && (options->num_files || options->using_stdin || options->output_file_path || options->using_stdout ||
+                                  options->watch_dir || options->recursive_dir || options->files_from || options->shard || options->variants ||
+                                  options->dedupe || options->shared_palette || options->emit_histogram || options->emit_palette || options->dry_run)) {
+        fputs("--serve converts images sent to it, and can't be used with input files, --output, stdout, --watch, --recursive, --files-from, --shard, --variants, --dedupe, --shared-palette, --emit-histogram, --emit-palette or --dry-run\n", stderr);
+        return INVALID_ARGUMENT;
     }
 
-    if (options.speed >= 10) {
-        options.fast_compression = true;
-        if (options.speed == 11) {
-            options.floyd = 0;
-            options.speed = 10;
-        }
+    if ((options->include_glob || options->exclude_glob) && !options->watch_dir && !options->recursive_dir) {
+        fputs("--include and --exclude only apply to --watch and --recursive\n", stderr);
+        return INVALID_ARGUMENT;
     }
 
-    if (options.speed && LIQ_OK != liq_set_speed(liq, options.speed)) {
-        fputs("Speed should be between 1 (slow) and 11 (fast).\n", stderr);
+    if (options->output_dir && (!options->recursive_dir || options->variants)) {
+        fputs("--output-dir only applies to --recursive, and can't be used with --variants\n", stderr);
         return INVALID_ARGUMENT;
     }
 
-    if (options.colors && LIQ_OK != liq_set_max_colors(liq, options.colors)) {
-        fputs("Number of colors must be between 2 and 256.\n", stderr);
+    if (options->raw && (options->skip_if_larger || options->target_size || options->dry_run || options->emit_histogram || options->emit_palette)) {
+        fputs("--raw files aren't compressed, so they can't be used with --skip-if-larger, --copy-if-larger, --target-size, --dry-run, --emit-histogram or --emit-palette\n", stderr);
         return INVALID_ARGUMENT;
     }
 
-    if (options.posterize && LIQ_OK != liq_set_min_posterization(liq, options.posterize)) {
-        fputs("Posterization should be number of bits in range 0-4.\n", stderr);
+    if (options->dry_run && (options->variants || options->target_size || options->dedupe || options->emit_histogram || options->emit_palette)) {
+        fputs("--dry-run can't be used with --variants, --target-size, --dedupe, --emit-histogram or --emit-palette\n", stderr);
         return INVALID_ARGUMENT;
     }
 
-    if (options.extension && options.output_file_path) {
-        fputs("--ext and --output options can't be used at the same time\n", stderr);
+    if (options->target_size && (options->variants || options->map_file || options->shared_palette || options->deadline_ms || options->speed_auto)) {
+        fputs("--target-size picks its own palette, and can't be used with --variants, --map, --shared-palette, --deadline or --speed auto\n", stderr);
         return INVALID_ARGUMENT;
     }
 
-    // new filename extension depends on options used. Typically basename-fs8.png
-    if (options.extension == NULL) {
-        options.extension = options.floyd > 0 ? "-fs8.png" : "-or8.png";
+    if (options->files_from && (options->using_stdin || options->watch_dir || options->recursive_dir)) {
+        fputs("--files-from can't be used with stdin, --watch or --recursive\n", stderr);
+        return INVALID_ARGUMENT;
     }
 
-    if (options.output_file_path && options.num_files != 1) {
-        fputs("  error: Only one input file is allowed when --output is used. This error also happens when filenames with spaces are not in quotes.\n", stderr);
+    unsigned int shard_index, shard_count;
+    if (!parse_shard(options->shard, &shard_index, &shard_count)) {
+        fputs("--shard should be K/N, where K is from 1 to N\n", stderr);
         return INVALID_ARGUMENT;
     }
-
-    if (options.using_stdout && !options.using_stdin && options.num_files != 1) {
-        fputs("  error: Only one input file is allowed when using the special output path \"-\" to write to stdout. This error also happens when filenames with spaces are not in quotes.\n", stderr);
+    if (options->shard && (options->using_stdin || options->shared_palette)) {
+        fputs("--shard splits input files between runs, and can't be used with stdin or --shared-palette\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+    if (options->shard_by_size && (!options->shard || options->watch_dir || options->recursive_dir)) {
+        fputs("--shard-by-size needs --shard and the whole list of files up front, so it can't be used with --watch or --recursive\n", stderr);
         return INVALID_ARGUMENT;
     }
 
-    if (!options.num_files && !options.using_stdin) {
-        fputs("No input files specified.\n", stderr);
-        if (options.verbose) {
-            print_full_version(stderr);
+    struct variant_list variants = {0};
+    if (options->variants) {
+        if (!parse_variants(options->variants, liq_get_max_colors(liq), options->floyd, &variants)) {
+            fprintf(stderr, "--variants should be in format colors=256,128;floyd=1,0 with at most %d combinations\n", MAX_VARIANTS);
+            return INVALID_ARGUMENT;
+        }
+        if (options->using_stdout || options->output_file_path || options->copy_if_larger || options->map_file || options->deadline_ms || options->speed_auto) {
+            fputs("--variants writes a file for each variant, and can't be used with --output, stdout, --copy-if-larger, --map, --deadline or --speed auto\n", stderr);
+            return INVALID_ARGUMENT;
+        }
+        if (options->shared_palette || options->dedupe) {
+            fputs("--variants can't be used with --shared-palette or --dedupe\n", stderr);
+            return INVALID_ARGUMENT;
+        }
+        if (!variant_extensions_are_unique(options->extension, &variants)) {
+            fputs("--ext needs {colors} and {dither} in it to give each variant its own file name\n", stderr);
+            return INVALID_ARGUMENT;
         }
-        print_usage(stderr);
-        return MISSING_ARGUMENT;
     }
 
-    retval = pngquant_main_internal(&options, liq);
-    liq_attr_destroy(liq);
-    return retval;
-}
+    if (options->recursive_dir) {
+#if !(defined(_WIN32) || defined(WIN32) || defined(__WIN32__))
+#ifdef _OPENMP
+        omp_set_nested(0); // there may be many files at once, so each is converted by one thread
+#endif
+        pngquant_error recursive_retval = convert_directory_tree(options, liq, &variants);
+        if (options->fixed_palette_image) liq_image_destroy(options->fixed_palette_image);
+        return recursive_retval;
+#else
+        fputs("--recursive isn't supported on Windows\n", stderr);
+        return INVALID_ARGUMENT;
 #endif
+    }
 
-// Don't use this. This is not a public API.
-pngquant_error pngquant_main_internal(struct pngquant_options *options, liq_attr *liq)
-{
-#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
-    setlocale(LC_ALL, ".65001"); // issue #376; set UTF-8 for Unicode filenames
+    if (options->serve_socket) {
+#if defined(__linux__)
+#ifdef _OPENMP
+        omp_set_nested(0); // there may be many images at once, so each is converted by one thread
+#endif
+        pngquant_error serve_retval = serve_jobs(options, liq, &variants);
+        if (options->fixed_palette_image) liq_image_destroy(options->fixed_palette_image);
+        return serve_retval;
+#else
+        fputs("--serve is only supported on Linux\n", stderr);
+        return INVALID_ARGUMENT;
 #endif
+    }
 
-    if (options->map_file) {
-        png24_image tmp = {.width=0};
-        if (SUCCESS != read_image(liq, options->map_file, false, &tmp, &options->fixed_palette_image, true, true, false)) {
-            fprintf(stderr, "  error: unable to load %s", options->map_file);
-            return INVALID_ARGUMENT;
-        }
-        liq_result *tmp_quantize = liq_quantize_image(liq, options->fixed_palette_image);
-        const liq_palette *pal = liq_get_palette(tmp_quantize);
-        if (!pal) {
-            fprintf(stderr, "  error: unable to read colors from %s", options->map_file);
-            return INVALID_ARGUMENT;
+    if (options->watch_dir) {
+#if defined(__linux__)
+#ifdef _OPENMP
+        omp_set_nested(0); // there may be many files at once, so each is converted by one thread
+#endif
+        pngquant_error watch_retval = watch_directory(options, liq, &variants);
+        if (options->fixed_palette_image) liq_image_destroy(options->fixed_palette_image);
+        return watch_retval;
+#else
+        fputs("--watch is only supported on Linux\n", stderr);
+        return INVALID_ARGUMENT;
+#endif
+    }
+
+    const double start_time = current_time();
+
+    // the list is copied, because the files of other shards are removed from it
+    char **file_list = NULL, *file_list_buffer = NULL;
+    if (options->files_from || shard_count > 1) {
+        const unsigned int all_files = options->num_files;
+        unsigned int list_count = all_files;
+        if (options->files_from) {
+            pngquant_error list_retval = read_file_list(options->files_from, options->files, options->num_files, &file_list, &list_count, &file_list_buffer);
+            if (list_retval) {
+                return list_retval;
+            }
+        } else {
+            file_list = malloc((all_files + 1) * sizeof(file_list[0]));
+            if (!file_list) {
+                return OUT_OF_MEMORY_ERROR;
+            }
+            memcpy(file_list, options->files, all_files * sizeof(file_list[0]));
         }
-        for(unsigned int i=0; i < pal->count; i++) {
-            liq_image_add_fixed_color(options->fixed_palette_image, pal->entries[i]);
+        if (shard_count > 1 && !options->shard_by_size) {
+            const unsigned int listed = list_count;
+            list_count = keep_hashed_shard(file_list, list_count, shard_index, shard_count);
+            verbose_printf(liq, options, "Shard %u/%u has %u of %u files", shard_index, shard_count, list_count, listed);
         }
-        liq_result_destroy(tmp_quantize);
+        options->files = file_list;
+        options->num_files = list_count;
     }
 
 #ifdef _OPENMP
@@ -356,13 +4022,96 @@ pngquant_error pngquant_main_internal(struct pngquant_options *options, liq_attr
     }
 #endif
 
-    unsigned int error_count=0, skipped_count=0, file_count=0;
+    unsigned int error_count=0, skipped_count=0, file_count=0, memory_wait_count=0, deadline_fallback_count=0, deduplicated_count=0;
+    double memory_wait_time=0;
     pngquant_error latest_error=SUCCESS;
+    struct memory_budget memory_budget = {.limit = options->max_memory};
+    struct auto_speed_model auto_speed = {.time_scale = 1.0};
+    unsigned int auto_speed_counts[12] = {0};
+    unsigned int estimated_count = 0;
+    unsigned long long estimated_input_bytes = 0, estimated_output_bytes = 0;
+    double estimated_quality_sum = 0;
+    unsigned int converted_count = 0;
+    unsigned long long converted_input_bytes = 0, converted_output_bytes = 0, converted_pixels = 0;
+
+    // headers are read up front, so that files can be skipped and scheduled by size before decoding any of them
+    struct input_file *inputs = NULL;
+    unsigned int duplicate_count = 0, *input_positions = NULL;
+    if (!options->using_stdin) {
+        inputs = calloc(options->num_files, sizeof(inputs[0]));
+        if (!inputs) {
+            free(file_list);
+            free(file_list_buffer);
+            return OUT_OF_MEMORY_ERROR;
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int i=0; i < options->num_files; i++) {
+            inputs[i].filename = options->files[i];
+            inputs[i].index = i;
+            prescan_file(&inputs[i]);
+        }
+
+        if (options->shard_by_size) {
+            const unsigned int listed = options->num_files;
+            if (SUCCESS != keep_balanced_shard(inputs, &options->num_files, shard_index, shard_count)) {
+                free(inputs);
+                free(file_list);
+                free(file_list_buffer);
+                return OUT_OF_MEMORY_ERROR;
+            }
+            verbose_printf(liq, options, "Shard %u/%u has %u of %u files", shard_index, shard_count, options->num_files, listed);
+        }
+
+        if (options->dedupe && options->num_files > 1 && !options->emit_histogram && !options->emit_palette) {
+            duplicate_count = find_duplicate_inputs(inputs, options->num_files);
+        }
+
+        // largest images are started first, so that they don't end up running alone at the end of the batch
+        qsort(inputs, options->num_files, sizeof(inputs[0]), compare_largest_first);
+
+        if (duplicate_count) {
+            input_positions = malloc(options->num_files * sizeof(input_positions[0]));
+            if (!input_positions) {
+                free(inputs);
+                free(file_list);
+                free(file_list_buffer);
+                return OUT_OF_MEMORY_ERROR;
+            }
+            for(unsigned int i=0; i < options->num_files; i++) {
+                input_positions[inputs[i].index] = i;
+            }
+        }
+    }
+
+    if (options->emit_histogram || options->emit_palette) {
+        pngquant_error emit_retval = emit_histogram_and_palette(options, liq, inputs, &memory_budget);
+        free(inputs);
+        free(file_list);
+        free(file_list_buffer);
+        return emit_retval;
+    }
+
+    if (options->shared_palette) {
+        pngquant_error palette_retval = make_shared_palette(options, liq, inputs, &memory_budget);
+        if (palette_retval) {
+            free(input_positions);
+            free(inputs);
+            free(file_list);
+            free(file_list_buffer);
+            return palette_retval;
+        }
+    }
 
     #pragma omp parallel for \
-        schedule(static, 1) reduction(+:skipped_count) reduction(+:error_count) reduction(+:file_count) shared(latest_error)
+        schedule(dynamic, 1) reduction(+:skipped_count) reduction(+:error_count) reduction(+:file_count) \
+        reduction(+:memory_wait_count) reduction(+:memory_wait_time) reduction(+:deadline_fallback_count) \
+        reduction(+:deduplicated_count) reduction(+:estimated_count) reduction(+:estimated_input_bytes) \
+        reduction(+:estimated_output_bytes) reduction(+:estimated_quality_sum) reduction(+:converted_count) \
+        reduction(+:converted_input_bytes) reduction(+:converted_output_bytes) reduction(+:converted_pixels) \
+        shared(latest_error, memory_budget, auto_speed, auto_speed_counts)
     for(int i=0; i < options->num_files; i++) {
-        const char *filename = options->using_stdin ? "stdin" : options->files[i];
+        const char *filename = options->using_stdin ? "stdin" : inputs[i].filename;
         struct pngquant_options opts = *options;
         liq_attr *local_liq = liq_attr_copy(liq);
 
@@ -382,18 +4131,92 @@ pngquant_error pngquant_main_internal(struct pngquant_options *options, liq_attr
 
         const char *outname = opts.output_file_path;
         char *outname_free = NULL;
-        if (!opts.using_stdout) {
+        if (!opts.using_stdout && !variants.count) {
             if (!outname) {
                 outname = outname_free = add_filename_extension(filename, opts.extension);
             }
-            if (!opts.force && file_exists(outname)) {
+            if (!opts.force && !opts.dry_run && file_exists(outname)) {
                 fprintf(stderr, "  error: '%s' exists; not overwriting\n", outname);
                 retval = NOT_OVERWRITING_ERROR;
             }
         }
 
+        // files identical to one that's converted successfully get a copy or link of its output
+        bool deduplicated = false;
+        if (SUCCESS == retval && inputs && inputs[i].is_duplicate) {
+            const struct input_file *original = &inputs[input_positions[inputs[i].duplicate_of]];
+            if (SUCCESS == wait_for_original(original)) {
+                verbose_printf(local_liq, &opts, "%s: same as %s", filename, original->filename);
+                char *renamed = original->undithered_name && outname ? undithered_filename(outname, &opts) : NULL;
+                if (renamed) {
+                    free(outname_free);
+                    outname = outname_free = renamed;
+                }
+                retval = duplicate_output_file(original->outname, outname, &opts, local_liq);
+                deduplicated = true;
+                deduplicated_count++;
+            }
+        }
+
+        if (SUCCESS == retval && !deduplicated && inputs && inputs[i].has_header) {
+            retval = check_input_policy(&inputs[i], &opts, local_liq);
+            if (SKIPPED_INPUT == retval && !opts.dry_run && ((opts.using_stdout && !opts.raw) || opts.copy_if_larger)) {
+                pngquant_error write_retval = copy_original_file(filename, outname, &opts, local_liq);
+                if (write_retval) {
+                    retval = write_retval;
+                }
+            }
+        }
+
+        size_t memory_reserved = 0;
+        if (SUCCESS == retval && !deduplicated && opts.max_memory && inputs && inputs[i].has_header) {
+            memory_reserved = estimate_memory_use(inputs[i].header.width, inputs[i].header.height);
+            const double waited = memory_budget_acquire(&memory_budget, memory_reserved);
+            if (waited >= 0.001) {
+                memory_wait_count++;
+                memory_wait_time += waited;
+                verbose_printf(local_liq, &opts, "%s: waited %.2fs for %luMB of memory", filename, waited, (unsigned long)(memory_reserved >> 20));
+            }
+            if (memory_reserved > opts.max_memory) {
+                verbose_printf(local_liq, &opts, "%s: needs about %luMB of memory, so it's processed on its own", filename, (unsigned long)(memory_reserved >> 20));
+            }
+        }
+
+        struct pngquant_file_stats stats = {0};
+        if (SUCCESS == retval && !deduplicated) {
+            retval = convert_file(filename, outname, &variants, &opts, local_liq, &auto_speed, &stats);
+        }
+        if (stats.deadline_fallback) {
+            deadline_fallback_count++;
+        }
+        if (opts.dry_run && print_dry_run_estimate(filename, &stats, retval)) {
+            estimated_count++;
+            estimated_input_bytes += stats.input_size;
+            estimated_output_bytes += stats.estimated_size;
+            estimated_quality_sum += stats.quality_percent;
+        }
         if (SUCCESS == retval) {
-            retval = pngquant_file_internal(filename, outname, &opts, local_liq);
+            converted_count++;
+            converted_input_bytes += stats.input_size;
+            converted_output_bytes += opts.dry_run ? stats.estimated_size : stats.output_size;
+            converted_pixels += stats.pixels;
+        }
+        if (stats.auto_speed) {
+            #pragma omp atomic
+            auto_speed_counts[stats.auto_speed]++;
+        }
+
+        if (memory_reserved) {
+            memory_budget_release(&memory_budget, memory_reserved);
+        }
+
+        if (inputs && inputs[i].has_duplicates) {
+            inputs[i].outname = !outname ? NULL : stats.undithered_name ? undithered_filename(outname, &opts) : strdup(outname);
+            inputs[i].undithered_name = stats.undithered_name;
+            inputs[i].retval = inputs[i].outname ? retval : OUT_OF_MEMORY_ERROR;
+            #pragma omp flush
+            #pragma omp atomic write
+            inputs[i].done = true;
         }
 
         free(outname_free);
@@ -405,7 +4228,7 @@ pngquant_error pngquant_main_internal(struct pngquant_options *options, liq_attr
             {
                 latest_error = retval;
             }
-            if (retval == TOO_LOW_QUALITY || retval == TOO_LARGE_FILE) {
+            if (retval == TOO_LOW_QUALITY || retval == TOO_LARGE_FILE || retval == DEADLINE_EXCEEDED || retval == SKIPPED_INPUT) {
                 skipped_count++;
             } else {
                 error_count++;
@@ -426,30 +4249,106 @@ pngquant_error pngquant_main_internal(struct pngquant_options *options, liq_attr
         verbose_printf(liq, options, "Quantized %d image%s.",
                        file_count, (file_count == 1)? "" : "s");
     }
+    if (deadline_fallback_count) {
+        verbose_printf(liq, options, "Used faster settings for %d file%s to meet the deadline.",
+                       deadline_fallback_count, (deadline_fallback_count == 1)? "" : "s");
+    }
+    if (options->speed_auto) {
+        char speeds[11*32] = "";
+        size_t len = 0;
+        for(int speed=1; speed <= 11 && len < sizeof(speeds); speed++) {
+            if (auto_speed_counts[speed]) {
+                len += snprintf(speeds + len, sizeof(speeds) - len, "%s%d (%u file%s)", len ? ", " : "", speed,
+                                auto_speed_counts[speed], (auto_speed_counts[speed] == 1)? "" : "s");
+            }
+        }
+        if (len) {
+            verbose_printf(liq, options, "Speeds chosen: %s.", speeds);
+        }
+    }
+    if (memory_wait_count) {
+        verbose_printf(liq, options, "Waited for memory %d time%s, %.2fs in total.",
+                       memory_wait_count, (memory_wait_count == 1)? "" : "s", memory_wait_time);
+    }
+
+    if (options->dry_run) {
+        print_dry_run_total(estimated_count, estimated_input_bytes, estimated_output_bytes, estimated_quality_sum);
+    }
+
+    if (duplicate_count) {
+        verbose_printf(liq, options, "Found %d duplicate file%s, and reused conversions of %d of them (dedupe ratio %.2f).",
+                       duplicate_count, (duplicate_count == 1)? "" : "s", deduplicated_count,
+                       (double)file_count / (file_count - deduplicated_count));
+        for(unsigned int i=0; i < options->num_files; i++) {
+            free(inputs[i].outname);
+        }
+    }
+
+    if (options->summary_file) {
+        const struct batch_summary summary = {
+            .shard_index = shard_index,
+            .shard_count = shard_count,
+            .files = file_count,
+            .converted = converted_count,
+            .skipped = skipped_count,
+            .errors = error_count,
+            .input_bytes = converted_input_bytes,
+            .output_bytes = converted_output_bytes,
+            .pixels = converted_pixels,
+            .seconds = current_time() - start_time,
+        };
+        pngquant_error summary_retval = write_summary_file(options->summary_file, &summary);
+        if (summary_retval) {
+            latest_error = summary_retval;
+        }
+    }
 
+    free(input_positions);
+    free(inputs);
+    free(file_list);
+    free(file_list_buffer);
     if (options->fixed_palette_image) liq_image_destroy(options->fixed_palette_image);
 
     return latest_error;
 }
 
 /// Don't hack this. Instead use https://github.com/ImageOptim/libimagequant/blob/f54d2f1a3e1cf728e17326f4db0d45811c63f063/example.c
-static pngquant_error pngquant_file_internal(const char *filename, const char *outname, struct pngquant_options *options, liq_attr *liq)
+static pngquant_error pngquant_file_internal(const char *filename, const char *outname, struct pngquant_options *options, liq_attr *liq, struct auto_speed_model *auto_speed, struct pngquant_file_stats *stats)
 {
     pngquant_error retval = SUCCESS;
 
+    // after the deadline faster settings are used, and after twice the deadline it gives up
+    const double start_time = current_time();
+    const double hard_deadline = start_time + options->deadline_ms / 500.0;
+    double deadline = start_time + options->deadline_ms / 1000.0;
+    if (options->deadline_ms) {
+        liq_attr_set_progress_callback(liq, deadline_progress_callback, &deadline);
+    }
+
     verbose_printf(liq, options, "%s:", filename);
 
     liq_image *input_image = NULL;
-    png24_image input_image_rwpng = {.width=0};
-    bool keep_input_pixels = options->skip_if_larger || (options->using_stdout && options->min_quality_limit); // original may need to be output to stdout
+    png24_image input_image_rwpng = {.maximum_pixels = options->max_pixels};
+    // original may need to be output to stdout, or copied with --copy-if-larger
+    const bool keep_original = !options->dry_run && !options->raw && (options->copy_if_larger || (options->using_stdout && (options->skip_if_larger || options->min_quality_limit || options->deadline_ms)));
+    input_image_rwpng.keep_file_data = keep_original;
+    // Cocoa reader can't keep the file, so the pixels are re-encoded instead
+    const bool keep_input_pixels = keep_original && USE_COCOA;
+    // options that change colors, even if there are only a few of them, need libimagequant.
+    // Quality below 100 asks for fewer colors if they're good enough.
+    const bool may_be_lossless = liq_get_max_quality(liq) >= 100 && !options->fixed_palette_image && !options->posterize && !options->iebug && !options->last_index_transparent;
     if (SUCCESS == retval) {
-        retval = read_image(liq, filename, options->using_stdin, &input_image_rwpng, &input_image, keep_input_pixels, options->strip, options->verbose);
+        retval = read_image(liq, filename, input_stream(options), &input_image_rwpng, &input_image, keep_input_pixels || may_be_lossless || options->dry_run, options->strip, options->verbose);
     }
 
     int quality_percent = 90; // quality on 0-100 scale, updated upon successful remap
+    double palette_error = -1;
+    double quantization_start_time = 0;
     png8_image output_image = {.width=0};
     if (SUCCESS == retval) {
         verbose_printf(liq, options, "  read %luKB file", (input_image_rwpng.file_size+1023UL)/1024UL);
+        stats->input_size = input_image_rwpng.file_size;
+        stats->pixels = (size_t)input_image_rwpng.width * input_image_rwpng.height;
 
         if (RWPNG_ICCP == input_image_rwpng.input_color) {
             verbose_printf(liq, options, "  used embedded ICC profile to transform image to sRGB colorspace");
@@ -465,10 +4364,75 @@ static pngquant_error pngquant_file_internal(const char *filename, const char *o
             verbose_printf(liq, options, "  converted image from gamma %2.1f to gamma 2.2",
                            1.0/input_image_rwpng.gamma);
         }
+    }
+
+    bool lossless = false;
+    if (SUCCESS == retval && may_be_lossless) {
+        lossless = index_exact_colors(&input_image_rwpng, options->colors ? options->colors : 256, &output_image);
+        if (lossless) {
+            quality_percent = 100;
+            palette_error = 0;
+            verbose_printf(liq, options, "  image has only %d colors, so it's converted losslessly", output_image.num_palette);
+
+            output_image.fast_compression = options->fast_compression;
+            output_image.chunks = input_image_rwpng.chunks; input_image_rwpng.chunks = NULL;
+
+            if (!keep_input_pixels) {
+                liq_image_destroy(input_image);
+                input_image = NULL;
+                if (!input_image_rwpng.file_data) {
+                    rwpng_free_image24(&input_image_rwpng);
+                }
+            }
+        } else {
+            rwpng_free_image8(&output_image);
+        }
+    }
+
+    // the speed can turn dithering off, and the default output name says whether the image is dithered
+    char *undithered_outname = NULL;
+    if (SUCCESS == retval && !lossless) {
+        quantization_start_time = current_time();
+    }
+    if (SUCCESS == retval && !lossless && options->speed_auto > 0) {
+        const size_t pixels = (size_t)input_image_rwpng.width * input_image_rwpng.height;
+        stats->auto_speed = choose_auto_speed(auto_speed, options->speed_auto, pixels);
+        liq_set_speed(liq, stats->auto_speed < 10 ? stats->auto_speed : 10);
+        options->fast_compression = stats->auto_speed >= 10;
+        verbose_printf(liq, options, "  using speed %d for %.1f megapixels", stats->auto_speed, pixels / 1e6);
+        if (stats->auto_speed == 11 && options->floyd > 0) {
+            options->floyd = 0;
+            undithered_outname = undithered_filename(outname, options);
+            if (undithered_outname) {
+                outname = undithered_outname;
+                stats->undithered_name = true;
+                if (!options->force && !options->dry_run && file_exists(outname)) {
+                    fprintf(stderr, "  error: '%s' exists; not overwriting\n", outname);
+                    retval = NOT_OVERWRITING_ERROR;
+                }
+            }
+        }
+    }
+
+    if (SUCCESS == retval && !lossless) {
+
+        // without anything faster to fall back to, the whole budget is for the first try
+        if (liq_get_speed(liq) >= 10) {
+            deadline = hard_deadline;
+        }
 
         // when using image as source of a fixed palette the palette is extracted using regular quantization
         liq_result *remap;
+        PNGQUANT_PROBE2(quantize__start, input_image_rwpng.width, input_image_rwpng.height);
         liq_error remap_error = liq_image_quantize(options->fixed_palette_image ? options->fixed_palette_image : input_image, liq, &remap);
+        if (LIQ_ABORTED == remap_error && options->deadline_ms && liq_get_speed(liq) < 10) {
+            verbose_printf(liq, options, "  quantization took over %ums, retrying at speed 10", options->deadline_ms);
+            stats->deadline_fallback |= DEADLINE_FASTER_SPEED;
+            deadline = hard_deadline;
+            liq_set_speed(liq, 10);
+            remap_error = liq_image_quantize(options->fixed_palette_image ? options->fixed_palette_image : input_image, liq, &remap);
+        }
+        PNGQUANT_PROBE2(quantize__done, remap_error, LIQ_OK == remap_error ? liq_get_quantization_quality(remap) : -1);
 
         if (LIQ_OK == remap_error) {
 
@@ -477,54 +4441,108 @@ static pngquant_error pngquant_file_internal(const char *filename, const char *o
             liq_set_output_gamma(remap, 0.45455);
             liq_set_dithering_level(remap, options->floyd);
 
-            retval = prepare_output_image(remap, input_image, input_image_rwpng.output_color, &output_image);
-            if (SUCCESS == retval) {
-                if (LIQ_OK != liq_write_remapped_image_rows(remap, input_image, output_image.row_pointers)) {
+            if (options->dry_run) {
+                retval = estimate_remapped_file_size(remap, liq, &input_image_rwpng, options->fast_compression, &stats->estimated_size);
+                palette_error = liq_get_quantization_error(remap);
+                quality_percent = liq_get_quantization_quality(remap);
+            } else {
+                retval = prepare_output_image(remap, input_image, input_image_rwpng.output_color, &output_image);
+                output_image.fast_compression = options->fast_compression;
+                output_image.chunks = input_image_rwpng.chunks; input_image_rwpng.chunks = NULL;
+            }
+
+            if (SUCCESS == retval && !options->dry_run) {
+                PNGQUANT_PROBE3(remap__start, output_image.width, output_image.height, output_image.num_palette);
+                if (options->deadline_ms) {
+                    if (options->floyd <= 0) {
+                        deadline = hard_deadline; // there's no dithering to turn off
+                    }
+                    liq_result_set_progress_callback(remap, deadline_progress_callback, &deadline);
+                }
+                liq_error write_error = liq_write_remapped_image_rows(remap, input_image, output_image.row_pointers);
+                if (LIQ_ABORTED == write_error && options->deadline_ms && options->floyd > 0) {
+                    verbose_printf(liq, options, "  remapping took over %ums, retrying without dithering", options->deadline_ms);
+                    stats->deadline_fallback |= DEADLINE_NO_DITHERING;
+                    deadline = hard_deadline;
+                    liq_set_dithering_level(remap, 0);
+                    write_error = liq_write_remapped_image_rows(remap, input_image, output_image.row_pointers);
+                }
+                PNGQUANT_PROBE1(remap__done, write_error);
+                if (LIQ_ABORTED == write_error && options->deadline_ms) {
+                    retval = DEADLINE_EXCEEDED;
+                } else if (LIQ_OK != write_error) {
                     retval = OUT_OF_MEMORY_ERROR;
                 }
 
                 set_palette(remap, &output_image);
 
-                double palette_error = liq_get_quantization_error(remap);
+                palette_error = liq_get_quantization_error(remap);
                 if (palette_error >= 0) {
                     quality_percent = liq_get_quantization_quality(remap);
                     verbose_printf(liq, options, "  mapped image to new colors...MSE=%.3f (Q=%d)", palette_error, quality_percent);
                 }
             }
             liq_result_destroy(remap);
+
+            // input pixels aren't needed any more, so don't hold on to them while compressing
+            if (!keep_input_pixels) {
+                liq_image_destroy(input_image);
+                input_image = NULL;
+                if (!input_image_rwpng.file_data) {
+                    rwpng_free_image24(&input_image_rwpng);
+                }
+            }
         } else if (LIQ_QUALITY_TOO_LOW == remap_error) {
             retval = TOO_LOW_QUALITY;
+        } else if (LIQ_ABORTED == remap_error && options->deadline_ms) {
+            retval = DEADLINE_EXCEEDED;
         } else {
             retval = INVALID_ARGUMENT; // dunno
         }
     }
 
     if (SUCCESS == retval) {
+        stats->quality_percent = quality_percent;
+        stats->mse = palette_error;
+    }
+
+    if (SUCCESS == retval && options->dry_run) {
+        if (lossless) {
+            retval = rwpng_write_image8(NULL, &output_image);
+            stats->estimated_size = output_image.file_size;
+        }
+        if (SUCCESS == retval && options->skip_if_larger && stats->estimated_size > maximum_file_size(input_image_rwpng.file_size, quality_percent)) {
+            retval = TOO_LARGE_FILE;
+        }
+    } else if (SUCCESS == retval) {
 
         if (options->skip_if_larger) {
-            // this is very rough approximation, but generally avoid losing more quality than is gained in file size.
-            // Quality is raised to 1.5, because even greater savings are needed to justify big quality loss.
-            // but >50% savings are considered always worthwhile in order to allow low quality conversions to work at all
-            const double quality = quality_percent/100.0;
-            const double expected_reduced_size = pow(quality, 1.5);
-            output_image.maximum_file_size = (input_image_rwpng.file_size-1) * (expected_reduced_size < 0.5 ? 0.5 : expected_reduced_size);
+            output_image.maximum_file_size = maximum_file_size(input_image_rwpng.file_size, quality_percent);
         }
 
-        output_image.fast_compression = options->fast_compression;
-        output_image.chunks = input_image_rwpng.chunks; input_image_rwpng.chunks = NULL;
         retval = write_image(&output_image, NULL, outname, options, liq);
 
         if (TOO_LARGE_FILE == retval) {
             verbose_printf(liq, options, "  file exceeded expected size of %luKB", (unsigned long)output_image.maximum_file_size/1024UL);
         }
+        if (SUCCESS == retval) {
+            stats->output_size = output_image.file_size;
+        }
         if (SUCCESS == retval && output_image.metadata_size > 0) {
             verbose_printf(liq, options, "  copied %dKB of additional PNG metadata", (int)(output_image.metadata_size+999)/1000);
         }
+        if (SUCCESS == retval && stats->auto_speed && !stats->deadline_fallback) {
+            update_auto_speed_model(auto_speed, stats->auto_speed, (size_t)output_image.width * output_image.height, current_time() - quantization_start_time);
+        }
+    }
+
+    if (DEADLINE_EXCEEDED == retval) {
+        verbose_printf(liq, options, "  gave up after %ums", 2*options->deadline_ms);
     }
 
-    if (options->using_stdout && keep_input_pixels && (TOO_LARGE_FILE == retval || TOO_LOW_QUALITY == retval)) {
+    if (keep_original && (TOO_LARGE_FILE == retval || (options->using_stdout && (TOO_LOW_QUALITY == retval || DEADLINE_EXCEEDED == retval)))) {
         // when outputting to stdout it'd be nasty to create 0-byte file
-        // so if quality is too low, output 24-bit original
+        // so if quality is too low, output the original
         pngquant_error write_retval = write_image(NULL, &input_image_rwpng, outname, options, liq);
         if (write_retval) {
             retval = write_retval;
@@ -534,6 +4552,7 @@ static pngquant_error pngquant_file_internal(const char *filename, const char *o
     if (input_image) liq_image_destroy(input_image);
     rwpng_free_image24(&input_image_rwpng);
     rwpng_free_image8(&output_image);
+    free(undithered_outname);
 
     return retval;
 }
@@ -580,6 +4599,31 @@ static char *add_filename_extension(const char *filename, const char *newext)
     return outname;
 }
 
+/* "-or8" counterpart of the default "-fs8" extension, or NULL if the extension isn't the default one */
+static const char *undithered_extension(const struct pngquant_options *options)
+{
+    return !strcmp(options->extension, "-fs8.png") ? "-or8.png" : !strcmp(options->extension, "-fs8.raw") ? "-or8.raw" : NULL;
+}
+
+/* the name with the default "-fs8" extension changed to "-or8", or NULL if the name isn't the default one */
+static char *undithered_filename(const char *outname, const struct pngquant_options *options)
+{
+    if (!outname || options->output_file_path || options->using_stdout) {
+        return NULL;
+    }
+    const char *newext = undithered_extension(options);
+    const size_t x = strlen(outname), ext_len = strlen(options->extension);
+    if (!newext || x < ext_len || strcmp(outname+x-ext_len, options->extension)) {
+        return NULL;
+    }
+
+    char *renamed = strdup(outname);
+    if (renamed) {
+        memcpy(renamed+x-ext_len, newext, ext_len);
+    }
+    return renamed;
+}
+
 static char *temp_filename(const char *basename) {
     size_t x = strlen(basename);
 
@@ -619,17 +4663,142 @@ static bool replace_file(const char *from, const char *to, const bool force) {
     return (0 == rename(from, to));
 }
 
+static bool link_file(const char *from, const char *to, unsigned int mode)
+{
+#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
+    return mode == DEDUPE_HARDLINK && CreateHardLinkA(to, from, NULL);
+#else
+    if (mode == DEDUPE_HARDLINK) {
+        return 0 == link(from, to);
+    }
+#if defined(__linux__) && defined(FICLONE)
+    int from_fd = open(from, O_RDONLY);
+    if (from_fd < 0) return false;
+    int to_fd = open(to, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    bool cloned = to_fd >= 0 && 0 == ioctl(to_fd, FICLONE, from_fd);
+    if (to_fd >= 0) close(to_fd);
+    close(from_fd);
+    return cloned;
+#elif defined(__APPLE__)
+    return 0 == clonefile(from, to, 0);
+#else
+    return false;
+#endif
+#endif
+}
+
+/*
+ * Gives a duplicate input the same output as the identical file that has been converted already.
+ * Links are made under a temporary name and renamed like written files are. Copying is the fallback when they can't be made.
+ */
+static pngquant_error duplicate_output_file(const char *original_outname, const char *outname, struct pngquant_options *options, liq_attr *liq)
+{
+    if (options->dedupe == DEDUPE_HARDLINK || options->dedupe == DEDUPE_REFLINK) {
+        char *tempname = temp_filename(outname);
+        if (!tempname) return OUT_OF_MEMORY_ERROR;
+
+        unlink(tempname);
+        bool linked = link_file(original_outname, tempname, options->dedupe);
+        if (linked && replace_file(tempname, outname, options->force)) {
+            free(tempname);
+            return SUCCESS;
+        }
+        if (linked) unlink(tempname);
+        free(tempname);
+        verbose_printf(liq, options, "  can't %s %s, so it's copied", options->dedupe == DEDUPE_HARDLINK ? "hardlink" : "reflink", filename_part(outname));
+    }
+    return copy_original_file(original_outname, outname, options, liq);
+}
+
+static void put_le32(unsigned char *dst, uint32_t value)
+{
+    for(int i=0; i < 4; i++) {
+        dst[i] = value >> (8*i);
+    }
+}
+
+static void put_le64(unsigned char *dst, uint64_t value)
+{
+    put_le32(dst, value);
+    put_le32(dst + 4, value >> 32);
+}
+
+/*
+ * The --raw format from pngquant_raw.h: the header and palette, padded up to the indices, and then the rows.
+ */
+static pngquant_error write_raw_image(FILE *outfile, png8_image *image, unsigned int raw)
+{
+    const uint32_t palette_offset = PNGQUANT_RAW_HEADER_SIZE;
+    uint64_t indices_offset = palette_offset + 256 * 4;
+    if (RAW_PAGE_ALIGNED == raw) {
+        indices_offset = (indices_offset + PNGQUANT_RAW_PAGE_SIZE - 1) / PNGQUANT_RAW_PAGE_SIZE * PNGQUANT_RAW_PAGE_SIZE;
+    }
+    const uint64_t indices_size = (uint64_t)image->width * image->height;
+
+    unsigned char start[PNGQUANT_RAW_PAGE_SIZE] = {0}; // header, palette and padding up to the indices
+    memcpy(start, PNGQUANT_RAW_MAGIC, 8);
+    put_le32(start + 8, PNGQUANT_RAW_VERSION);
+    put_le32(start + 12, image->width);
+    put_le32(start + 16, image->height);
+    put_le32(start + 20, image->num_palette);
+    put_le32(start + 24, palette_offset);
+    put_le32(start + 28, image->width);
+    put_le64(start + 32, indices_offset);
+    put_le64(start + 40, indices_size);
+    put_le32(start + 48, image->gamma * 100000.0 + 0.5);
+    put_le32(start + 52, RWPNG_SRGB == image->output_color ? PNGQUANT_RAW_SRGB : 0);
+    for(unsigned int i=0; i < image->num_palette; i++) {
+        unsigned char *entry = start + palette_offset + i * 4;
+        entry[0] = image->palette[i].r;
+        entry[1] = image->palette[i].g;
+        entry[2] = image->palette[i].b;
+        entry[3] = image->palette[i].a;
+    }
+    if (fwrite(start, indices_offset, 1, outfile) != 1) {
+        return CANT_WRITE_ERROR;
+    }
+
+    for(uint32_t row = 0; row < image->height; row++) {
+        if (fwrite(image->row_pointers[row], image->width, 1, outfile) != 1) {
+            return CANT_WRITE_ERROR;
+        }
+    }
+
+    image->metadata_size = 0;
+    image->file_size = indices_offset + indices_size;
+    return SUCCESS;
+}
+
 static pngquant_error write_image(png8_image *output_image, png24_image *output_image24, const char *outname, struct pngquant_options *options, liq_attr *liq)
 {
     FILE *outfile;
     char *tempname = NULL;
 
-    if (options->using_stdout) {
+    if (options->output_stream) {
+        outfile = options->output_stream;
+#if !(defined(_WIN32) || defined(WIN32) || defined(__WIN32__))
+        // like a file, the output is replaced, e.g. by the original after the converted image turned out too large.
+        // buffers of pngquant_context have no descriptor, and are truncated when rewound.
+        fflush(outfile);
+        rewind(outfile);
+        const int fd = fileno(outfile);
+        if (fd >= 0 && 0 != ftruncate(fd, 0)) {
+            return CANT_WRITE_ERROR;
+        }
+#endif
+        if (output_image) {
+            verbose_printf(liq, options, "  writing %d-color image to the output buffer", output_image->num_palette);
+        } else {
+            verbose_printf(liq, options, "  writing %s image to the output buffer", output_image24->file_data ? "original" : "truecolor");
+        }
+    } else if (options->using_stdout) {
         set_binary_mode(stdout);
         outfile = stdout;
 
         if (output_image) {
             verbose_printf(liq, options, "  writing %d-color image to stdout", output_image->num_palette);
+        } else if (output_image24->file_data) {
+            verbose_printf(liq, options, "  writing original image to stdout");
         } else {
             verbose_printf(liq, options, "  writing truecolor image to stdout");
         }
@@ -645,30 +4814,49 @@ static pngquant_error write_image(png8_image *output_image, png24_image *output_
 
         if (output_image) {
             verbose_printf(liq, options, "  writing %d-color image as %s", output_image->num_palette, filename_part(outname));
+        } else if (output_image24->file_data) {
+            verbose_printf(liq, options, "  copying original image as %s", filename_part(outname));
         } else {
             verbose_printf(liq, options, "  writing truecolor image as %s", filename_part(outname));
         }
     }
 
+    struct palette_order order = {.changed = false};
+    if (output_image) {
+        reorder_palette(output_image, options->raw || !may_reorder_palette(options), &order);
+    }
+
     pngquant_error retval;
-    #pragma omp critical (libpng)
-    {
-        if (output_image) {
-            retval = rwpng_write_image8(outfile, output_image);
-        } else {
-            retval = rwpng_write_image24(outfile, output_image24);
+    if (output_image && options->raw) {
+        retval = write_raw_image(outfile, output_image, options->raw); // doesn't use libpng
+    } else {
+        #pragma omp critical (libpng)
+        {
+            if (output_image) {
+                retval = rwpng_write_image8(outfile, output_image);
+            } else if (output_image24->file_data) {
+                retval = fwrite(output_image24->file_data, 1, output_image24->file_size, outfile) == output_image24->file_size ? SUCCESS : CANT_WRITE_ERROR;
+            } else {
+                retval = rwpng_write_image24(outfile, output_image24);
+            }
         }
     }
 
-    if (!options->using_stdout) {
+    if (options->output_stream) {
+        if (0 != fflush(outfile) && SUCCESS == retval) {
+            retval = CANT_WRITE_ERROR;
+        }
+    } else if (!options->using_stdout) {
         fclose(outfile);
 
         if (SUCCESS == retval) {
             // Image has been written to a temporary file and then moved over destination.
             // This makes replacement atomic and avoids damaging destination file on write error.
+            PNGQUANT_PROBE1(commit__start, outname);
             if (!replace_file(tempname, outname, options->force)) {
                 retval = CANT_WRITE_ERROR;
             }
+            PNGQUANT_PROBE2(commit__done, outname, retval);
         }
 
         if (retval) {
@@ -681,17 +4869,34 @@ static pngquant_error write_image(png8_image *output_image, png24_image *output_
         fprintf(stderr, "  error: failed writing image to %s (%d)\n", options->using_stdout ? "stdout" : outname, retval);
     }
 
+    if (SUCCESS == retval && order.changed) {
+        // the tRNS chunk is measured exactly, without compressing the image in the old order again
+        verbose_printf(liq, options, "  reordered palette: %u tRNS entries (was %u), %u bytes smaller",
+                       order.num_translucent, order.old_num_trans, trns_chunk_size(order.old_num_trans) - trns_chunk_size(order.num_translucent));
+    }
+
     return retval;
 }
 
-static pngquant_error read_image(liq_attr *options, const char *filename, int using_stdin, png24_image *input_image_p, liq_image **liq_image_p, bool keep_input_pixels, bool strip, bool verbose)
+/* stdin, the input of a --serve job, or NULL if the file is opened by name */
+static FILE *input_stream(const struct pngquant_options *options)
 {
-    FILE *infile;
-
-    if (using_stdin) {
+    if (options->input_stream) {
+        return options->input_stream;
+    }
+    if (options->using_stdin) {
         set_binary_mode(stdin);
-        infile = stdin;
-    } else if ((infile = fopen(filename, "rb")) == NULL) {
+        return stdin;
+    }
+    return NULL;
+}
+
+static pngquant_error read_image(liq_attr *options, const char *filename, FILE *input_stream, png24_image *input_image_p, liq_image **liq_image_p, bool keep_input_pixels, bool strip, bool verbose)
+{
+    FILE *infile = input_stream;
+    const bool using_stdin = input_stream == stdin;
+
+    if (!infile && (infile = fopen(filename, "rb")) == NULL) {
         fprintf(stderr, "  error: cannot open %s for reading\n", filename);
         return READ_ERROR;
     }
@@ -702,10 +4907,14 @@ static pngquant_error read_image(liq_attr *options, const char *filename, int us
         retval = rwpng_read_image24(infile, input_image_p, strip, verbose);
     }
 
-    if (!using_stdin) {
+    if (!input_stream) {
         fclose(infile);
     }
 
+    if (TOO_MANY_PIXELS == retval) {
+        fprintf(stderr, "  error: image %s has more pixels than --max-pixels allows\n", using_stdin ? "from stdin" : filename_part(filename));
+        return retval;
+    }
     if (retval) {
         fprintf(stderr, "  error: cannot decode image %s\n", using_stdin ? "from stdin" : filename_part(filename));
         return retval;
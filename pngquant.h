@@ -0,0 +1,67 @@
+/*
+** Library interface of pngquant
+**
+** See COPYRIGHT file for license.
+*/
+
+#ifndef PNGQUANT_H
+#define PNGQUANT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "rwpng.h"  /* pngquant_error */
+#include "libimagequant.h"
+#include "pngquant_opts.h"
+
+/*
+ * A context is created once, and then converts any number of images submitted to it, from files or memory.
+ * It has its own thread, running an OpenMP team, so that submission doesn't wait and images are converted
+ * concurrently, within the limits of --max-memory. Built without OpenMP, that thread converts one image
+ * at a time. The --map palette is loaded only once, when the context is created.
+ *
+ * When an image is done, its callback is called from one of the context's threads, with a result that
+ * stays valid until it's released. Output buffers of released results are reused by later images.
+ *
+ * Not available on Windows.
+ */
+typedef struct pngquant_context pngquant_context;
+
+typedef struct pngquant_result {
+    pngquant_error status;
+    uint64_t id; // given to pngquant_submit_*()
+    const unsigned char *data; // the PNG file (or --raw file), if the output is in memory and there is one
+    size_t size; // of the output, 0 if there isn't one
+    size_t input_size;
+    uint32_t width, height; // 0 if the header couldn't be read
+    int quality; // 0-100, or -1 if the image wasn't converted
+    double mse;
+    double seconds; // spent converting, not waiting in the queue
+} pngquant_result;
+
+typedef void pngquant_callback(pngquant_result *result, void *user_info);
+
+/*
+ * Options and liq are copied, and can be freed once this returns.
+ * Options of the command line that convert batches of files, like files, --output, --variants or --watch,
+ * can't be used. Returns NULL and sets error if the options are invalid or --map can't be loaded.
+ */
+pngquant_context *pngquant_context_create(const struct pngquant_options *options, const liq_attr *liq, pngquant_error *error);
+
+/* If outname is NULL, the output is in the result's data */
+pngquant_error pngquant_submit_file(pngquant_context *context, const char *filename, const char *outname, uint64_t id, pngquant_callback *callback, void *user_info);
+
+/* The PNG file is read in place, so it has to stay unchanged until the callback is called */
+pngquant_error pngquant_submit_memory(pngquant_context *context, const void *png, size_t size, uint64_t id, pngquant_callback *callback, void *user_info);
+
+/* Every result has to be released once, from any thread, before the context is destroyed */
+void pngquant_result_release(pngquant_context *context, pngquant_result *result);
+
+/* Waits until all submitted images are done, and their callbacks have returned */
+void pngquant_context_wait(pngquant_context *context);
+
+/* Waits for all submitted images. Returns error only if --summary can't be written. */
+pngquant_error pngquant_context_destroy(pngquant_context *context);
+
+#endif
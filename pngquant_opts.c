@@ -52,7 +52,12 @@ static void fix_obsolete_options(const unsigned int argc, char *argv[])
 }
 
 enum {arg_floyd=1, arg_ordered, arg_ext, arg_no_force, arg_iebug,
-    arg_transbug, arg_map, arg_posterize, arg_skip_larger, arg_strip};
+    arg_transbug, arg_map, arg_posterize, arg_skip_larger, arg_strip,
+    arg_max_memory, arg_deadline, arg_copy_larger, arg_max_pixels,
+    arg_skip_palette, arg_skip_smaller, arg_variants, arg_shared_palette,
+    arg_emit_histogram, arg_emit_palette, arg_merge_histograms, arg_dedupe, arg_target_size, arg_dry_run,
+    arg_watch, arg_include, arg_exclude, arg_recursive, arg_output_dir,
+    arg_files_from, arg_shard, arg_shard_by_size, arg_summary, arg_merge_summaries, arg_serve, arg_raw};
 
 static const struct option long_options[] = {
     {"verbose", no_argument, NULL, 'v'},
@@ -66,17 +71,64 @@ static const struct option long_options[] = {
     {"transbug", no_argument, NULL, arg_transbug},
     {"ext", required_argument, NULL, arg_ext},
     {"skip-if-larger", no_argument, NULL, arg_skip_larger},
+    {"copy-if-larger", no_argument, NULL, arg_copy_larger},
+    {"shared-palette", no_argument, NULL, arg_shared_palette},
+    {"emit-histogram", required_argument, NULL, arg_emit_histogram},
+    {"emit-palette", required_argument, NULL, arg_emit_palette},
+    {"merge-histograms", no_argument, NULL, arg_merge_histograms},
+    {"dedupe", optional_argument, NULL, arg_dedupe},
+    {"dry-run", no_argument, NULL, arg_dry_run},
+    {"watch", required_argument, NULL, arg_watch},
+    {"recursive", required_argument, NULL, arg_recursive},
+    {"output-dir", required_argument, NULL, arg_output_dir},
+    {"include", required_argument, NULL, arg_include},
+    {"exclude", required_argument, NULL, arg_exclude},
+    {"files-from", required_argument, NULL, arg_files_from},
+    {"shard", required_argument, NULL, arg_shard},
+    {"shard-by-size", no_argument, NULL, arg_shard_by_size},
+    {"summary", required_argument, NULL, arg_summary},
+    {"merge-summaries", no_argument, NULL, arg_merge_summaries},
+    {"serve", required_argument, NULL, arg_serve},
+    {"raw", optional_argument, NULL, arg_raw},
     {"output", required_argument, NULL, 'o'},
     {"speed", required_argument, NULL, 's'},
     {"quality", required_argument, NULL, 'Q'},
     {"posterize", required_argument, NULL, arg_posterize},
     {"strip", no_argument, NULL, arg_strip},
     {"map", required_argument, NULL, arg_map},
+    {"max-memory", required_argument, NULL, arg_max_memory},
+    {"deadline", required_argument, NULL, arg_deadline},
+    {"max-pixels", required_argument, NULL, arg_max_pixels},
+    {"skip-palette", required_argument, NULL, arg_skip_palette},
+    {"skip-smaller", required_argument, NULL, arg_skip_smaller},
+    {"variants", required_argument, NULL, arg_variants},
+    {"target-size", required_argument, NULL, arg_target_size},
     {"version", no_argument, NULL, 'V'},
     {"help", no_argument, NULL, 'h'},
     {NULL, 0, NULL, 0},
 };
 
+/**
+ * Number of bytes with optional K, M or G suffix (powers of 1024)
+ */
+static bool parse_size(const char *str, size_t *size)
+{
+    char *end;
+    double value = strtod(str, &end);
+    if (end == str) return false;
+
+    switch (*end) {
+        case 'k': case 'K': value *= 1024.0; end++; break;
+        case 'm': case 'M': value *= 1024.0*1024.0; end++; break;
+        case 'g': case 'G': value *= 1024.0*1024.0*1024.0; end++; break;
+    }
+    if ('\0' != end[0] && ('\0' != end[1] || ('b' != end[0] && 'B' != end[0]))) return false;
+    if (!(value >= 1 && value < (double)SIZE_MAX)) return false; // also rejects NaN
+
+    *size = value;
+    return true;
+}
+
 pngquant_error pngquant_parse_options(int argc, char *argv[], struct pngquant_options *options)
 {
     fix_obsolete_options(argc, argv);
@@ -128,7 +180,20 @@ pngquant_error pngquant_parse_options(int argc, char *argv[], struct pngquant_op
                 options->skip_if_larger = true;
                 break;
 
+            case arg_copy_larger:
+                options->skip_if_larger = true;
+                options->copy_if_larger = true;
+                break;
+
             case 's':
+                if (0 == strncmp(optarg, "auto", 4) && ('\0' == optarg[4] || '=' == optarg[4])) {
+                    options->speed_auto = optarg[4] ? atof(optarg+5) : 4.f;
+                    if (options->speed_auto <= 0) {
+                        fputs("--speed auto=N should be a number of megapixels per second\n", stderr);
+                        return INVALID_ARGUMENT;
+                    }
+                    break;
+                }
                 options->speed = optarg[0] == '0' ? -1 : atoi(optarg);
                 break;
 
@@ -148,6 +213,134 @@ pngquant_error pngquant_parse_options(int argc, char *argv[], struct pngquant_op
                 options->map_file = optarg;
                 break;
 
+            case arg_max_memory:
+                if (!parse_size(optarg, &options->max_memory)) {
+                    fputs("--max-memory should be a number of bytes, optionally with K, M or G suffix\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_deadline:
+                options->deadline_ms = atoi(optarg);
+                break;
+
+            case arg_max_pixels:
+                if (!parse_size(optarg, &options->max_pixels)) {
+                    fputs("--max-pixels should be a number of pixels, optionally with K, M or G suffix\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_skip_palette:
+                options->skip_palette_colors = atoi(optarg);
+                break;
+
+            case arg_skip_smaller:
+                if (!parse_size(optarg, &options->skip_smaller)) {
+                    fputs("--skip-smaller should be a number of bytes, optionally with K, M or G suffix\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_target_size:
+                if (!parse_size(optarg, &options->target_size)) {
+                    fputs("--target-size should be a number of bytes, optionally with K, M or G suffix\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_variants:
+                options->variants = optarg;
+                break;
+
+            case arg_shared_palette:
+                options->shared_palette = true;
+                break;
+
+            case arg_emit_histogram:
+                options->emit_histogram = optarg;
+                break;
+
+            case arg_emit_palette:
+                options->emit_palette = optarg;
+                break;
+
+            case arg_merge_histograms:
+                options->merge_histograms = true;
+                break;
+
+            case arg_dry_run:
+                options->dry_run = true;
+                break;
+
+            case arg_watch:
+                options->watch_dir = optarg;
+                break;
+
+            case arg_recursive:
+                options->recursive_dir = optarg;
+                break;
+
+            case arg_output_dir:
+                options->output_dir = optarg;
+                break;
+
+            case arg_include:
+                options->include_glob = optarg;
+                break;
+
+            case arg_exclude:
+                options->exclude_glob = optarg;
+                break;
+
+            case arg_files_from:
+                options->files_from = optarg;
+                break;
+
+            case arg_shard:
+                options->shard = optarg;
+                break;
+
+            case arg_shard_by_size:
+                options->shard_by_size = true;
+                break;
+
+            case arg_summary:
+                options->summary_file = optarg;
+                break;
+
+            case arg_merge_summaries:
+                options->merge_summaries = true;
+                break;
+
+            case arg_serve:
+                options->serve_socket = optarg;
+                break;
+
+            case arg_dedupe:
+                if (!optarg || 0 == strcmp(optarg, "copy")) {
+                    options->dedupe = DEDUPE_COPY;
+                } else if (0 == strcmp(optarg, "hardlink")) {
+                    options->dedupe = DEDUPE_HARDLINK;
+                } else if (0 == strcmp(optarg, "reflink")) {
+                    options->dedupe = DEDUPE_REFLINK;
+                } else {
+                    fputs("--dedupe should be copy, hardlink or reflink\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_raw:
+                if (!optarg) {
+                    options->raw = RAW_PACKED;
+                } else if (0 == strcmp(optarg, "page")) {
+                    options->raw = RAW_PAGE_ALIGNED;
+                } else {
+                    fputs("--raw can only be followed by =page\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
             case 'h':
                 options->print_help = true;
                 break;
@@ -173,7 +366,7 @@ pngquant_error pngquant_parse_options(int argc, char *argv[], struct pngquant_op
             argn++;
         }
 
-        if (argn == argc || (argn == argc-1 && 0==strcmp(argv[argn],"-"))) {
+        if ((argn == argc && !options->watch_dir && !options->recursive_dir && !options->files_from && !options->serve_socket) || (argn == argc-1 && 0==strcmp(argv[argn],"-"))) {
             options->using_stdin = true;
             options->using_stdout = !options->output_file_path;
             argn = argc-1;
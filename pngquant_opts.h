@@ -1,22 +1,58 @@
 #ifndef PNGQUANT_OPTS_H
 #define PNGQUANT_OPTS_H
 
+enum pngquant_dedupe {
+    DEDUPE_NONE,
+    DEDUPE_COPY, // identical inputs get a copy of the first one's output
+    DEDUPE_HARDLINK,
+    DEDUPE_REFLINK, // copy-on-write clone where the filesystem supports it
+};
+
+enum pngquant_raw_output {
+    RAW_NONE, // PNG
+    RAW_PACKED, // indices right after the palette, see pngquant_raw.h
+    RAW_PAGE_ALIGNED, // indices at the start of a page, for mmap
+};
+
 struct pngquant_options {
     liq_image *fixed_palette_image;
     liq_log_callback_function *log_callback;
     void *log_callback_user_info;
+    FILE *input_stream, *output_stream; // used instead of files by --serve
     const char *quality;
     const char *extension;
     const char *output_file_path;
     const char *map_file;
+    const char *variants;
+    const char *emit_histogram;
+    const char *emit_palette;
+    const char *watch_dir;
+    const char *recursive_dir;
+    const char *output_dir;
+    const char *include_glob;
+    const char *exclude_glob;
+    const char *files_from;
+    const char *shard;
+    const char *summary_file;
+    const char *serve_socket;
     char *const *files;
     unsigned int num_files;
     unsigned int colors;
     unsigned int speed;
     unsigned int posterize;
+    unsigned int deadline_ms;
+    unsigned int skip_palette_colors;
+    unsigned int dedupe; // enum pngquant_dedupe
+    unsigned int raw; // enum pngquant_raw_output
+    size_t max_memory;
+    size_t max_pixels;
+    size_t skip_smaller;
+    size_t target_size;
     float floyd;
+    float speed_auto; // target megapixels per second, 0 = fixed speed
     bool using_stdin, using_stdout, force, fast_compression,
-        min_quality_limit, skip_if_larger,
+        min_quality_limit, skip_if_larger, copy_if_larger, shared_palette, merge_histograms, dry_run,
+        shard_by_size, merge_summaries,
         strip, iebug, last_index_transparent,
         print_help, print_version, missing_arguments,
         verbose;
@@ -0,0 +1,44 @@
+/*
+** File format of pngquant --raw
+**
+** See COPYRIGHT file for license.
+*/
+
+#ifndef PNGQUANT_RAW_H
+#define PNGQUANT_RAW_H
+
+#include <stdint.h>
+
+/*
+ * The converted image without compression, for uploading straight to the GPU: the palette fits a 256x1 RGBA8
+ * texture, and the indices an R8 (e.g. GL_R8UI) texture of width x height. Nothing needs to be decoded,
+ * so the file can be mapped into memory and its parts used in place.
+ *
+ * The file starts with the header below. All numbers in it are little-endian, and offsets are from the start
+ * of the file. The palette always has 256 entries of R, G, B, A bytes (not premultiplied), and entries past
+ * num_palette are 0. Indices are one byte per pixel, rows from the top, row_stride bytes apart.
+ * With --raw=page indices start at a multiple of PNGQUANT_RAW_PAGE_SIZE, otherwise right after the palette.
+ */
+
+#define PNGQUANT_RAW_MAGIC "PQRAW\r\n\x1a" // 8 bytes, without the terminating 0
+#define PNGQUANT_RAW_VERSION 1
+#define PNGQUANT_RAW_HEADER_SIZE 64
+#define PNGQUANT_RAW_PAGE_SIZE 4096
+
+#define PNGQUANT_RAW_SRGB 1 // flag: colors are sRGB. Otherwise only gamma is known.
+
+struct pngquant_raw_header {
+    unsigned char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t num_palette; // 1-256
+    uint32_t palette_offset;
+    uint32_t row_stride; // the same as width in this version
+    uint64_t indices_offset;
+    uint64_t indices_size; // row_stride * height
+    uint32_t gamma; // like in PNG's gAMA, 45455 = 1/2.2
+    uint32_t flags;
+    uint32_t reserved[2];
+};
+
+#endif
@@ -0,0 +1,46 @@
+/*
+** Protocol of pngquant --serve
+**
+** See COPYRIGHT file for license.
+*/
+
+#ifndef PNGQUANT_SERVE_H
+#define PNGQUANT_SERVE_H
+
+#include <stdint.h>
+
+/*
+ * Clients connect to the SOCK_SEQPACKET Unix socket given to --serve, and send one request message per image,
+ * with a memfd containing the PNG file attached with SCM_RIGHTS. The memfd has to be sealed with
+ * F_SEAL_SHRINK and F_SEAL_WRITE, so that it can be mapped and read without copying it.
+ *
+ * Each request gets one response message, in the order in which images are done, which isn't necessarily
+ * the order of requests. Only a few requests of one connection are converted at a time, and the rest wait
+ * in the socket until their turn. Clients need to read responses, or they may be dropped.
+ *
+ * If there's an output, a new memfd with the PNG file, sealed against any changes, is attached to the
+ * response. The output is the converted image if status is SUCCESS, or a copy of the original if status
+ * is TOO_LARGE_FILE with --copy-if-larger.
+ *
+ * All fields are in the byte order of the machine, since both ends are on the same one.
+ */
+
+#define PNGQUANT_SERVE_MAGIC 0x51474E50 // "PNGQ" in little-endian
+#define PNGQUANT_SERVE_VERSION 1
+
+struct pngquant_serve_request {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t id; // chosen by the client, and returned in the response
+};
+
+struct pngquant_serve_response {
+    uint32_t magic;
+    int32_t status; // pngquant_error
+    uint64_t id;
+    uint64_t size; // of the attached output, 0 if there isn't one
+    int32_t quality; // 0-100, or -1 if the image wasn't converted
+    uint32_t reserved;
+};
+
+#endif
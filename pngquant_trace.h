@@ -0,0 +1,38 @@
+/*
+** Static (USDT) tracepoints
+**
+** See COPYRIGHT file for license.
+*/
+
+#ifndef PNGQUANT_TRACE_H
+#define PNGQUANT_TRACE_H
+
+/*
+   Compile with USE_SDT=1 (cargo feature "usdt") to emit probes that can be
+   attached to with bpftrace, perf or systemtap. They're nops until attached.
+
+   Provider "pngquant":
+     read24__start()                                     read24__done(width, height, file_size, retval)
+     transform__start(width, height, input_color)        transform__done(width, height)
+     quantize__start(width, height)                      quantize__done(liq_error, quality)
+     remap__start(width, height, num_palette)            remap__done(liq_error)
+     write8__start(width, height, num_palette)           write8__done(bytes_written, retval)
+     commit__start(outname)                              commit__done(outname, retval)
+ */
+
+#if USE_SDT
+#include <sys/sdt.h>
+#define PNGQUANT_PROBE(name) DTRACE_PROBE(pngquant, name)
+#define PNGQUANT_PROBE1(name, a) DTRACE_PROBE1(pngquant, name, a)
+#define PNGQUANT_PROBE2(name, a, b) DTRACE_PROBE2(pngquant, name, a, b)
+#define PNGQUANT_PROBE3(name, a, b, c) DTRACE_PROBE3(pngquant, name, a, b, c)
+#define PNGQUANT_PROBE4(name, a, b, c, d) DTRACE_PROBE4(pngquant, name, a, b, c, d)
+#else
+#define PNGQUANT_PROBE(name) do {} while(0)
+#define PNGQUANT_PROBE1(name, a) do {} while(0)
+#define PNGQUANT_PROBE2(name, a, b) do {} while(0)
+#define PNGQUANT_PROBE3(name, a, b, c) do {} while(0)
+#define PNGQUANT_PROBE4(name, a, b, c, d) do {} while(0)
+#endif
+
+#endif
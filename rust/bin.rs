@@ -4,26 +4,19 @@
 ** See COPYRIGHT file for license.
 */
 
-extern crate libpng_sys;
-
-#[cfg(feature = "cocoa")]
-pub mod rwpng_cocoa;
-
-#[cfg(feature = "lcms2")]
-extern crate lcms2_sys;
 use imagequant_sys::liq_error::LIQ_OK;
 use imagequant_sys::*;
 use libc::FILE;
-use crate::ffi::pngquant_internal_print_config;
+use pngquant::ffi::pngquant_internal_print_config;
 use std::os::raw::{c_uint, c_char};
 
 use std::ptr;
 use std::io;
 use std::ffi::{CString, CStr};
 
-mod ffi;
-use crate::ffi::*;
-use crate::ffi::pngquant_error::*;
+use pngquant::ffi;
+use pngquant::ffi::*;
+use pngquant::ffi::pngquant_error::*;
 
 fn unwrap_ptr(opt: Option<&CString>) -> *const c_char {
     opt.map_or(ptr::null(), |c| c.as_ptr())
@@ -74,6 +67,24 @@ fn parse_quality(quality: &str) -> Option<(u8, u8)> {
     })
 }
 
+/**
+ * Number of bytes with optional K, M or G suffix (powers of 1024)
+ */
+fn parse_size(size: &str) -> Option<usize> {
+    let size = size.strip_suffix(['b', 'B']).unwrap_or(size);
+    let (num, multiplier) = match size.as_bytes().last()? {
+        b'k' | b'K' => (&size[..size.len()-1], 1u64 << 10),
+        b'm' | b'M' => (&size[..size.len()-1], 1 << 20),
+        b'g' | b'G' => (&size[..size.len()-1], 1 << 30),
+        _ => (size, 1),
+    };
+    let size = num.parse::<f64>().ok()? * multiplier as f64;
+    if !(size >= 1. && size < usize::MAX as f64) {
+        return None;
+    }
+    Some(size as usize)
+}
+
 unsafe extern "C" fn log_callback(_a: &liq_attr, msg: *const c_char, _user: AnySyncSendPtr) {
     println!("{}", CStr::from_ptr(msg).to_str().unwrap());
 }
@@ -95,9 +106,17 @@ fn run() -> ffi::pngquant_error {
     opts.optflag("", "iebug", "");
     opts.optflag("", "transbug", "");
     opts.optflag("", "skip-if-larger", "");
+    opts.optflag("", "copy-if-larger", "");
+    opts.optflag("", "shared-palette", "");
+    opts.optflag("", "dry-run", "");
+    opts.optflag("", "shard-by-size", "");
+    opts.optflag("", "merge-summaries", "");
+    opts.optflag("", "merge-histograms", "");
     opts.optflag("", "strip", "");
     opts.optflag("V", "version", "");
     opts.optflagopt("", "floyd", "0.0-1.0", "");
+    opts.optflagopt("", "dedupe", "copy|hardlink|reflink", "");
+    opts.optflagopt("", "raw", "page", "");
     opts.optopt("", "ext", "extension", "");
     opts.optopt("o", "output", "file", "");
     opts.optopt("s", "speed", "4", "");
@@ -105,6 +124,24 @@ fn run() -> ffi::pngquant_error {
     opts.optopt("", "posterize", "0", "");
     opts.optopt("", "map", "png", "");
     opts.optopt("", "colors", "0", "");
+    opts.optopt("", "max-memory", "SIZE", "");
+    opts.optopt("", "deadline", "MS", "");
+    opts.optopt("", "max-pixels", "N", "");
+    opts.optopt("", "skip-palette", "N", "");
+    opts.optopt("", "skip-smaller", "SIZE", "");
+    opts.optopt("", "variants", "SPEC", "");
+    opts.optopt("", "target-size", "SIZE", "");
+    opts.optopt("", "emit-histogram", "file", "");
+    opts.optopt("", "emit-palette", "file", "");
+    opts.optopt("", "watch", "DIR", "");
+    opts.optopt("", "recursive", "DIR", "");
+    opts.optopt("", "output-dir", "DIR", "");
+    opts.optopt("", "include", "GLOB", "");
+    opts.optopt("", "exclude", "GLOB", "");
+    opts.optopt("", "files-from", "file", "");
+    opts.optopt("", "shard", "K/N", "");
+    opts.optopt("", "summary", "file", "");
+    opts.optopt("", "serve", "socket", "");
 
     let args: Vec<_> = wild::args().skip(1).collect();
     let has_some_explicit_args = !args.is_empty();
@@ -118,16 +155,91 @@ fn run() -> ffi::pngquant_error {
     };
 
     let posterize = m.opt_str("posterize").and_then(|p| p.parse().ok()).unwrap_or(0);
+    let deadline_ms = m.opt_str("deadline").and_then(|p| p.parse().ok()).unwrap_or(0);
+    let skip_palette_colors = m.opt_str("skip-palette").and_then(|p| p.parse().ok()).unwrap_or(0);
     let floyd = m.opt_str("floyd").and_then(|p| p.parse().ok()).unwrap_or(1.);
+    let dedupe = if m.opt_present("dedupe") {
+        match m.opt_str("dedupe").as_deref() {
+            None | Some("copy") => 1,
+            Some("hardlink") => 2,
+            Some("reflink") => 3,
+            Some(_) => {
+                eprintln!("--dedupe should be copy, hardlink or reflink");
+                return INVALID_ARGUMENT;
+            },
+        }
+    } else {0};
+    let raw = if m.opt_present("raw") {
+        match m.opt_str("raw").as_deref() {
+            None => 1,
+            Some("page") => 2,
+            Some(_) => {
+                eprintln!("--raw can only be followed by =page");
+                return INVALID_ARGUMENT;
+            },
+        }
+    } else {0};
 
     let quality = m.opt_str("quality");
     let extension = m.opt_str("ext").and_then(|s| CString::new(s).ok());
     let map_file = m.opt_str("map").and_then(|s| CString::new(s).ok());
+    let variants = m.opt_str("variants").and_then(|s| CString::new(s).ok());
+    let emit_histogram = m.opt_str("emit-histogram").and_then(|s| CString::new(s).ok());
+    let emit_palette = m.opt_str("emit-palette").and_then(|s| CString::new(s).ok());
+    let watch_dir = m.opt_str("watch").and_then(|s| CString::new(s).ok());
+    let recursive_dir = m.opt_str("recursive").and_then(|s| CString::new(s).ok());
+    let output_dir = m.opt_str("output-dir").and_then(|s| CString::new(s).ok());
+    let include_glob = m.opt_str("include").and_then(|s| CString::new(s).ok());
+    let exclude_glob = m.opt_str("exclude").and_then(|s| CString::new(s).ok());
+    let files_from = m.opt_str("files-from").and_then(|s| CString::new(s).ok());
+    let shard = m.opt_str("shard").and_then(|s| CString::new(s).ok());
+    let summary_file = m.opt_str("summary").and_then(|s| CString::new(s).ok());
+    let serve_socket = m.opt_str("serve").and_then(|s| CString::new(s).ok());
+    let max_memory = match m.opt_str("max-memory") {
+        Some(s) => match parse_size(&s) {
+            Some(size) => size,
+            None => {
+                eprintln!("--max-memory should be a number of bytes, optionally with K, M or G suffix");
+                return INVALID_ARGUMENT;
+            },
+        },
+        None => 0,
+    };
+    let max_pixels = match m.opt_str("max-pixels") {
+        Some(s) => match parse_size(&s) {
+            Some(size) => size,
+            None => {
+                eprintln!("--max-pixels should be a number of pixels, optionally with K, M or G suffix");
+                return INVALID_ARGUMENT;
+            },
+        },
+        None => 0,
+    };
+    let skip_smaller = match m.opt_str("skip-smaller") {
+        Some(s) => match parse_size(&s) {
+            Some(size) => size,
+            None => {
+                eprintln!("--skip-smaller should be a number of bytes, optionally with K, M or G suffix");
+                return INVALID_ARGUMENT;
+            },
+        },
+        None => 0,
+    };
+    let target_size = match m.opt_str("target-size") {
+        Some(s) => match parse_size(&s) {
+            Some(size) => size,
+            None => {
+                eprintln!("--target-size should be a number of bytes, optionally with K, M or G suffix");
+                return INVALID_ARGUMENT;
+            },
+        },
+        None => 0,
+    };
 
     let colors = if let Some(c) = m.opt_str("colors").as_ref().or(m.free.first()).and_then(|s| s.parse().ok()) {
         if !m.opt_present("colors") {
             m.free.remove(0);
-            if m.free.is_empty() {
+            if m.free.is_empty() && !m.opt_present("watch") && !m.opt_present("recursive") && !m.opt_present("files-from") && !m.opt_present("serve") {
                 m.free.push("-".to_owned()); // stdin default
             }
         }
@@ -153,6 +265,18 @@ fn run() -> ffi::pngquant_error {
         extension: unwrap_ptr(extension.as_ref()),
         output_file_path: unwrap_ptr(output_file_path.as_ref()),
         map_file: unwrap_ptr(map_file.as_ref()),
+        variants: unwrap_ptr(variants.as_ref()),
+        emit_histogram: unwrap_ptr(emit_histogram.as_ref()),
+        emit_palette: unwrap_ptr(emit_palette.as_ref()),
+        watch_dir: unwrap_ptr(watch_dir.as_ref()),
+        recursive_dir: unwrap_ptr(recursive_dir.as_ref()),
+        output_dir: unwrap_ptr(output_dir.as_ref()),
+        include_glob: unwrap_ptr(include_glob.as_ref()),
+        exclude_glob: unwrap_ptr(exclude_glob.as_ref()),
+        files_from: unwrap_ptr(files_from.as_ref()),
+        shard: unwrap_ptr(shard.as_ref()),
+        summary_file: unwrap_ptr(summary_file.as_ref()),
+        serve_socket: unwrap_ptr(serve_socket.as_ref()),
         files: file_ptrs.as_ptr(),
         num_files: file_ptrs.len() as c_uint,
         using_stdin,
@@ -160,10 +284,25 @@ fn run() -> ffi::pngquant_error {
         missing_arguments: !has_some_explicit_args,
         colors,
         speed: 0, // handled in Rust
+        speed_auto: 0.,
         posterize,
+        deadline_ms,
+        skip_palette_colors,
+        dedupe,
+        raw,
+        max_memory,
+        max_pixels,
+        skip_smaller,
+        target_size,
         floyd,
         force: m.opt_present("force") && !m.opt_present("no-force"),
-        skip_if_larger: m.opt_present("skip-if-larger"),
+        skip_if_larger: m.opt_present("skip-if-larger") || m.opt_present("copy-if-larger"),
+        copy_if_larger: m.opt_present("copy-if-larger"),
+        shared_palette: m.opt_present("shared-palette"),
+        merge_histograms: m.opt_present("merge-histograms"),
+        dry_run: m.opt_present("dry-run"),
+        shard_by_size: m.opt_present("shard-by-size"),
+        merge_summaries: m.opt_present("merge-summaries"),
         strip: m.opt_present("strip"),
         iebug: false,
         last_index_transparent: false, // handled in Rust
@@ -174,6 +313,8 @@ fn run() -> ffi::pngquant_error {
         fixed_palette_image: ptr::null_mut(),
         log_callback: None,
         log_callback_user_info: ptr::null_mut(),
+        input_stream: ptr::null_mut(),
+        output_stream: ptr::null_mut(),
         fast_compression: false,
         min_quality_limit: false,
     };
@@ -211,7 +352,16 @@ fn run() -> ffi::pngquant_error {
         liq_set_last_index_transparent(liq, i32::from(true));
     }
 
-    if let Some(speed) = m.opt_str("speed") {
+    if let Some(target) = m.opt_str("speed").as_deref().and_then(|s| s.strip_prefix("auto")) {
+        let target = if target.is_empty() { Some(4.) } else { target.strip_prefix('=').and_then(|t| t.parse().ok()) };
+        match target.filter(|&t: &f32| t > 0.) {
+            Some(t) => options.speed_auto = t,
+            None => {
+                eprintln!("--speed auto=N should be a number of megapixels per second");
+                return INVALID_ARGUMENT;
+            },
+        }
+    } else if let Some(speed) = m.opt_str("speed") {
         let set_ok = speed.parse().ok()
             .filter(|&s: &u8| (1..=11).contains(&s))
             .map_or(false, |mut speed| {
@@ -260,7 +410,15 @@ fn run() -> ffi::pngquant_error {
 
     // new filename extension depends on options used. Typically basename-fs8.png
     if options.extension.is_null() {
-        options.extension = if options.floyd > 0. { b"-fs8.png\0" } else { b"-or8.png\0" }.as_ptr().cast();
+        let extension: &[u8] = match (!options.variants.is_null(), options.floyd > 0., options.raw != 0) {
+            (true, _, false) => b"-{dither}-{colors}.png\0",
+            (true, _, true) => b"-{dither}-{colors}.raw\0",
+            (false, true, false) => b"-fs8.png\0",
+            (false, true, true) => b"-fs8.raw\0",
+            (false, false, false) => b"-or8.png\0",
+            (false, false, true) => b"-or8.raw\0",
+        };
+        options.extension = extension.as_ptr().cast();
     }
 
     if !options.output_file_path.is_null() && options.num_files != 1 {
@@ -273,7 +431,7 @@ fn run() -> ffi::pngquant_error {
         return INVALID_ARGUMENT;
     }
 
-    if options.num_files == 0 && !options.using_stdin {
+    if options.num_files == 0 && !options.using_stdin && options.watch_dir.is_null() && options.recursive_dir.is_null() && options.files_from.is_null() && options.serve_socket.is_null() {
         eprintln!("No input files specified.");
         if options.verbose {
             print_full_version(&mut io::stdout(), unsafe { pngquant_c_stdout() });
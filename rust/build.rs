@@ -20,6 +20,21 @@ fn main() {
         cc.define("USE_LCMS", Some("1"));
     }
 
+    if cfg!(feature = "usdt") {
+        cc.define("USE_SDT", Some("1"));
+    }
+
+    // without it files of a batch and images of a Context are converted one at a time
+    if cfg!(feature = "openmp") {
+        let compiler = cc.get_compiler();
+        if compiler.is_like_msvc() {
+            cc.flag("/openmp");
+        } else {
+            cc.flag("-fopenmp");
+            println!("cargo:rustc-link-lib={}", if compiler.is_like_clang() { "omp" } else { "gomp" });
+        }
+    }
+
     if env::var("PROFILE").map(|p| p != "debug").unwrap_or(true) {
         cc.define("NDEBUG", Some("1"));
     } else {
@@ -31,6 +46,8 @@ fn main() {
     }
 
     cc.file("rwpng.c");
+    cc.file("rwpng_expand.c");
+    cc.file("rwpng_shaper.c");
     cc.file("pngquant.c");
 
     if let Ok(p) = env::var("DEP_IMAGEQUANT_INCLUDE") {
@@ -0,0 +1,534 @@
+//! Safe wrapper for `pngquant_context` of pngquant.h
+
+use crate::ffi::pngquant_error::*;
+use crate::ffi::*;
+use imagequant_sys::liq_error::LIQ_OK;
+use imagequant_sys::*;
+use std::ffi::CString;
+use std::fmt;
+use std::future::Future;
+use std::os::raw::c_void;
+use std::path::{Path, PathBuf};
+use std::pin::Pin;
+use std::ptr::{self, NonNull};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard};
+use std::task::{Poll, Waker};
+use std::time::Duration;
+
+/// Why an image couldn't be converted. The codes are the same as exit codes of the command-line tool.
+#[derive(Debug, Copy, Clone)]
+pub struct Error(pub pngquant_error);
+
+impl Error {
+    pub fn code(&self) -> i32 {
+        self.0 as i32
+    }
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let reason = match self.0 {
+            SUCCESS => "success",
+            MISSING_ARGUMENT => "missing argument",
+            READ_ERROR => "can't read the image",
+            INVALID_ARGUMENT => "invalid argument",
+            NOT_OVERWRITING_ERROR => "output file exists",
+            CANT_WRITE_ERROR => "can't write the output",
+            OUT_OF_MEMORY_ERROR | PNG_OUT_OF_MEMORY_ERROR => "out of memory",
+            WRONG_ARCHITECTURE => "unsupported CPU",
+            LIBPNG_FATAL_ERROR | LIBPNG_INIT_ERROR => "libpng error",
+            WRONG_INPUT_COLOR_TYPE => "unsupported color type",
+            TOO_MANY_PIXELS => "too many pixels",
+            LCMS_FATAL_ERROR => "color profile error",
+            SKIPPED_INPUT => "skipped",
+            DEADLINE_EXCEEDED => "deadline exceeded",
+            TOO_LARGE_FILE => "converted image would be larger than the original",
+            TOO_LOW_QUALITY => "quality is too low",
+        };
+        write!(f, "{reason} ({})", self.code())
+    }
+}
+
+impl std::error::Error for Error {}
+
+/// The same as options of the command-line tool that apply to one image at a time
+#[derive(Debug, Clone)]
+pub struct Options {
+    /// 2-256, `--colors`
+    pub colors: u32,
+    /// min and max 0-100, `--quality`
+    pub quality: Option<(u8, u8)>,
+    /// 1 (slow) to 11 (fast), `--speed`
+    pub speed: u8,
+    /// Speed chosen for each image to convert this many megapixels per second, `--speed auto=N`
+    pub speed_auto: Option<f32>,
+    /// 0-1, where 0 is `--nofs`, `--floyd`
+    pub floyd: f32,
+    /// 0-4, `--posterize`
+    pub posterize: u8,
+    /// Palette of this image is used for all images, `--map`
+    pub map: Option<PathBuf>,
+    pub skip_if_larger: bool,
+    pub copy_if_larger: bool,
+    pub strip: bool,
+    /// Output files are overwritten, `--force`
+    pub force: bool,
+    pub deadline: Option<Duration>,
+    /// Images are converted only while they fit in this many bytes, `--max-memory`
+    pub max_memory: usize,
+    pub max_pixels: usize,
+    pub skip_smaller: usize,
+    pub skip_palette_colors: u32,
+    pub target_size: usize,
+}
+
+impl Default for Options {
+    fn default() -> Self {
+        Self {
+            colors: 256,
+            quality: None,
+            speed: 4,
+            speed_auto: None,
+            floyd: 1.,
+            posterize: 0,
+            map: None,
+            skip_if_larger: false,
+            copy_if_larger: false,
+            strip: false,
+            force: false,
+            deadline: None,
+            max_memory: 0,
+            max_pixels: 0,
+            skip_smaller: 0,
+            skip_palette_colors: 0,
+            target_size: 0,
+        }
+    }
+}
+
+fn path_to_cstring(path: &Path) -> Result<CString, Error> {
+    path.to_str().and_then(|s| CString::new(s).ok()).ok_or(Error(INVALID_ARGUMENT))
+}
+
+struct ContextInner {
+    ptr: NonNull<pngquant_context>,
+    /// Only for messages, which name images by id
+    next_id: AtomicU64,
+}
+
+// the C API can be used from any thread
+unsafe impl Send for ContextInner {}
+unsafe impl Sync for ContextInner {}
+
+impl Drop for ContextInner {
+    fn drop(&mut self) {
+        // can't fail without --summary
+        unsafe { pngquant_context_destroy(self.ptr.as_ptr()); }
+    }
+}
+
+/// Converts images on its own threads (in parallel only with the `openmp` feature). Cloning it is cheap, and clones share the threads.
+///
+/// Images are submitted without waiting, and each gives a [`Job`], which can be awaited
+/// in an async runtime, or waited for with [`Job::wait`].
+#[derive(Clone)]
+pub struct Context {
+    inner: Arc<ContextInner>,
+}
+
+impl Context {
+    /// The `--map` image, if any, is read once here
+    pub fn new(options: &Options) -> Result<Self, Error> {
+        let mut liq = liq_attr_create().ok_or(Error(OUT_OF_MEMORY_ERROR))?;
+        let liq = &mut *liq;
+        let mut c_options = pngquant_options {
+            colors: options.colors,
+            posterize: options.posterize.into(),
+            floyd: options.floyd,
+            speed_auto: options.speed_auto.unwrap_or(0.),
+            // the original can only be copied when the converted image is rejected for being larger
+            skip_if_larger: options.skip_if_larger || options.copy_if_larger,
+            copy_if_larger: options.copy_if_larger,
+            strip: options.strip,
+            force: options.force,
+            deadline_ms: options.deadline.map_or(0, |d| d.as_millis().clamp(1, u32::MAX.into()) as u32),
+            max_memory: options.max_memory,
+            max_pixels: options.max_pixels,
+            skip_smaller: options.skip_smaller,
+            skip_palette_colors: options.skip_palette_colors,
+            target_size: options.target_size,
+            ..Default::default()
+        };
+
+        if LIQ_OK != liq_set_max_colors(liq, options.colors as _) {
+            return Err(Error(INVALID_ARGUMENT));
+        }
+        // same as --speed 10 and 11
+        let mut speed = options.speed;
+        if speed >= 10 {
+            c_options.fast_compression = true;
+            if speed == 11 {
+                speed = 10;
+                c_options.floyd = 0.;
+            }
+        }
+        if LIQ_OK != liq_set_speed(liq, speed.into()) {
+            return Err(Error(INVALID_ARGUMENT));
+        }
+        if let Some((limit, target)) = options.quality {
+            c_options.min_quality_limit = limit > 0;
+            if LIQ_OK != liq_set_quality(liq, limit.into(), target.into()) {
+                return Err(Error(INVALID_ARGUMENT));
+            }
+        }
+        if options.posterize > 0 && LIQ_OK != liq_set_min_posterization(liq, options.posterize as _) {
+            return Err(Error(INVALID_ARGUMENT));
+        }
+
+        let map_file = options.map.as_deref().map(path_to_cstring).transpose()?;
+        c_options.map_file = map_file.as_ref().map_or(ptr::null(), |m| m.as_ptr());
+
+        let mut error = SUCCESS;
+        let ptr = unsafe { pngquant_context_create(&c_options, liq, &mut error) };
+        Ok(Self {
+            inner: Arc::new(ContextInner {
+                ptr: NonNull::new(ptr).ok_or(Error(error))?,
+                next_id: AtomicU64::new(1),
+            }),
+        })
+    }
+
+    /// Converts a PNG file in memory. The output is in memory too.
+    pub fn convert<T: AsRef<[u8]> + Send + 'static>(&self, png: T) -> Result<Job, Error> {
+        // boxing moves the data to the heap once, where C reads it in place
+        let png: Box<dyn AsRef<[u8]> + Send> = Box::new(png);
+        let (data, size) = {
+            let input = (*png).as_ref();
+            (input.as_ptr(), input.len())
+        };
+        let shared = self.new_job();
+        let in_flight = Box::into_raw(Box::new(InFlight { shared: shared.clone(), _input: Some(png) }));
+        let retval = unsafe { pngquant_submit_memory(self.inner.ptr.as_ptr(), data.cast(), size, self.next_id(), job_done, in_flight.cast()) };
+        self.submitted(retval, in_flight, shared)
+    }
+
+    /// Converts a PNG file to `output`, or to memory if it's `None`
+    pub fn convert_file(&self, input: &Path, output: Option<&Path>) -> Result<Job, Error> {
+        let input = path_to_cstring(input)?;
+        let output = output.map(path_to_cstring).transpose()?;
+        let shared = self.new_job();
+        let in_flight = Box::into_raw(Box::new(InFlight { shared: shared.clone(), _input: None }));
+        let retval = unsafe {
+            pngquant_submit_file(self.inner.ptr.as_ptr(), input.as_ptr(), output.as_ref().map_or(ptr::null(), |o| o.as_ptr()), self.next_id(), job_done, in_flight.cast())
+        };
+        self.submitted(retval, in_flight, shared)
+    }
+
+    /// Blocks until all images submitted so far are done
+    pub fn wait(&self) {
+        unsafe { pngquant_context_wait(self.inner.ptr.as_ptr()); }
+    }
+
+    fn next_id(&self) -> u64 {
+        self.inner.next_id.fetch_add(1, Ordering::Relaxed)
+    }
+
+    fn new_job(&self) -> Arc<JobShared> {
+        Arc::new(JobShared {
+            context: self.inner.ptr.as_ptr(),
+            slot: Mutex::new(JobSlot::default()),
+            done: Condvar::new(),
+        })
+    }
+
+    fn submitted(&self, retval: pngquant_error, in_flight: *mut InFlight, shared: Arc<JobShared>) -> Result<Job, Error> {
+        if !matches!(retval, SUCCESS) {
+            // the callback won't be called
+            drop(unsafe { Box::from_raw(in_flight) });
+            return Err(Error(retval));
+        }
+        Ok(Job { shared, context: self.inner.clone() })
+    }
+}
+
+#[derive(Default)]
+struct JobSlot {
+    result: Option<NonNull<pngquant_result>>,
+    waker: Option<Waker>,
+    finished: bool,
+    abandoned: bool,
+}
+
+struct JobShared {
+    /// Not owned, only for releasing results of abandoned jobs, which is done before the context can be destroyed
+    context: *mut pngquant_context,
+    slot: Mutex<JobSlot>,
+    done: Condvar,
+}
+
+unsafe impl Send for JobShared {}
+unsafe impl Sync for JobShared {}
+
+impl JobShared {
+    fn lock(&self) -> MutexGuard<'_, JobSlot> {
+        self.slot.lock().unwrap_or_else(|e| e.into_inner())
+    }
+}
+
+/// Owned by C until the callback, so that the input stays alive while it's read
+struct InFlight {
+    shared: Arc<JobShared>,
+    _input: Option<Box<dyn AsRef<[u8]> + Send>>,
+}
+
+unsafe extern "C" fn job_done(result: *mut pngquant_result, user_info: *mut c_void) {
+    let in_flight = Box::from_raw(user_info.cast::<InFlight>());
+    let shared = &in_flight.shared;
+    let mut slot = shared.lock();
+    slot.finished = true;
+    if slot.abandoned {
+        pngquant_result_release(shared.context, result);
+        return;
+    }
+    slot.result = NonNull::new(result);
+    if let Some(waker) = slot.waker.take() {
+        waker.wake();
+    }
+    shared.done.notify_all();
+}
+
+/// An image being converted. It's a future, and can also be waited for without async.
+///
+/// If it's dropped, the image is still converted.
+pub struct Job {
+    shared: Arc<JobShared>,
+    context: Arc<ContextInner>,
+}
+
+impl Job {
+    /// Blocks until the image is done
+    pub fn wait(self) -> Result<Output, Error> {
+        let mut slot = self.shared.lock();
+        loop {
+            if let Some(result) = slot.result.take() {
+                drop(slot);
+                return self.output(result);
+            }
+            slot = self.shared.done.wait(slot).unwrap_or_else(|e| e.into_inner());
+        }
+    }
+
+    fn output(&self, result: NonNull<pngquant_result>) -> Result<Output, Error> {
+        let output = Output { result, context: self.context.clone() };
+        // the original is the output when the converted image is too large, with copy_if_larger
+        match output.result().status {
+            SUCCESS => Ok(output),
+            TOO_LARGE_FILE if output.size() > 0 => Ok(output),
+            status => Err(Error(status)),
+        }
+    }
+}
+
+impl Future for Job {
+    type Output = Result<Output, Error>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut std::task::Context<'_>) -> Poll<Self::Output> {
+        let mut slot = self.shared.lock();
+        if let Some(result) = slot.result.take() {
+            drop(slot);
+            return Poll::Ready(self.output(result));
+        }
+        slot.waker = Some(cx.waker().clone());
+        Poll::Pending
+    }
+}
+
+impl Drop for Job {
+    fn drop(&mut self) {
+        let mut slot = self.shared.lock();
+        if let Some(result) = slot.result.take() {
+            unsafe { pngquant_result_release(self.context.ptr.as_ptr(), result.as_ptr()); }
+        } else if !slot.finished {
+            slot.abandoned = true;
+        }
+    }
+}
+
+/// The converted image. Its buffer is reused by the context once this is dropped.
+pub struct Output {
+    result: NonNull<pngquant_result>,
+    context: Arc<ContextInner>,
+}
+
+unsafe impl Send for Output {}
+unsafe impl Sync for Output {}
+
+impl Output {
+    fn result(&self) -> &pngquant_result {
+        unsafe { self.result.as_ref() }
+    }
+
+    /// The PNG file, or `None` if it has been written to a file
+    pub fn png(&self) -> Option<&[u8]> {
+        let result = self.result();
+        if result.data.is_null() {
+            return None;
+        }
+        Some(unsafe { std::slice::from_raw_parts(result.data, result.size) })
+    }
+
+    /// Size of the PNG file
+    pub fn size(&self) -> usize {
+        self.result().size
+    }
+
+    pub fn input_size(&self) -> usize {
+        self.result().input_size
+    }
+
+    pub fn width(&self) -> u32 {
+        self.result().width
+    }
+
+    pub fn height(&self) -> u32 {
+        self.result().height
+    }
+
+    /// 0-100, or `None` if the original has been kept because the converted image was larger
+    pub fn quality(&self) -> Option<u8> {
+        u8::try_from(self.result().quality).ok()
+    }
+
+    pub fn mse(&self) -> f64 {
+        self.result().mse
+    }
+
+    /// Time spent converting, not waiting for a thread
+    pub fn duration(&self) -> Duration {
+        Duration::from_secs_f64(self.result().seconds.max(0.))
+    }
+
+    /// With `copy_if_larger`, the output is the original image
+    pub fn is_original(&self) -> bool {
+        matches!(self.result().status, TOO_LARGE_FILE)
+    }
+}
+
+impl fmt::Debug for Output {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Output")
+            .field("size", &self.size())
+            .field("width", &self.width())
+            .field("height", &self.height())
+            .field("quality", &self.quality())
+            .field("is_original", &self.is_original())
+            .finish_non_exhaustive()
+    }
+}
+
+impl Drop for Output {
+    fn drop(&mut self) {
+        unsafe { pngquant_result_release(self.context.ptr.as_ptr(), self.result.as_ptr()); }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn test_png() -> Vec<u8> {
+        std::fs::read(Path::new(env!("CARGO_MANIFEST_DIR")).join("test/img/test.png")).unwrap()
+    }
+
+    fn check_png(png: &[u8]) {
+        assert!(png.len() > 33);
+        assert_eq!(&png[..8], b"\x89PNG\r\n\x1a\n");
+        assert_eq!(&png[12..16], b"IHDR");
+        assert_eq!(png[25], 3); // palette color type
+    }
+
+    #[test]
+    fn converts_memory() {
+        let context = Context::new(&Options::default()).unwrap();
+        let input = test_png();
+        let input_size = input.len();
+        let jobs: Vec<_> = (0..8).map(|_| context.convert(input.clone()).unwrap()).collect();
+        let outputs: Vec<_> = jobs.into_iter().map(|job| job.wait().unwrap()).collect();
+        for output in &outputs {
+            check_png(output.png().unwrap());
+            assert_eq!(output.png(), outputs[0].png());
+            assert_eq!(output.size(), output.png().unwrap().len());
+            assert_eq!(output.input_size(), input_size);
+            assert_eq!((output.width(), output.height()), (380, 287));
+            assert!(output.quality().unwrap() <= 100);
+            assert!(!output.is_original());
+        }
+
+        // buffers of dropped outputs are reused
+        let buffers: Vec<_> = outputs.iter().map(|o| o.png().unwrap().as_ptr()).collect();
+        drop(outputs);
+        let output = context.convert(input).unwrap().wait().unwrap();
+        assert!(buffers.contains(&output.png().unwrap().as_ptr()));
+    }
+
+    #[test]
+    fn converts_file() {
+        let input = Path::new(env!("CARGO_MANIFEST_DIR")).join("test/img/test.png");
+        let outname = std::env::temp_dir().join(format!("pngquant-context-test-{}.png", std::process::id()));
+        let _ = std::fs::remove_file(&outname);
+
+        let context = Context::new(&Options::default()).unwrap();
+        let output = context.convert_file(&input, Some(&outname)).unwrap().wait().unwrap();
+        let written = std::fs::read(&outname).unwrap();
+        std::fs::remove_file(&outname).unwrap();
+        check_png(&written);
+        assert!(output.png().is_none());
+        assert_eq!(output.size(), written.len());
+
+        let output = context.convert_file(&input, None).unwrap().wait().unwrap();
+        assert_eq!(output.png().unwrap(), &written[..]);
+    }
+
+    #[test]
+    fn reports_errors() {
+        let context = Context::new(&Options::default()).unwrap();
+        let error = context.convert(&b"not a png"[..]).unwrap().wait().unwrap_err();
+        assert!(matches!(error.0, READ_ERROR | LIBPNG_FATAL_ERROR), "{:?}", error.0);
+    }
+
+    #[test]
+    fn copies_original_if_larger() {
+        let context = Context::new(&Options { copy_if_larger: true, ..Default::default() }).unwrap();
+        let gray = std::fs::read(Path::new(env!("CARGO_MANIFEST_DIR")).join("test/img/gray.png")).unwrap();
+        let output = context.convert(gray).unwrap().wait().unwrap();
+        assert!(!output.is_original());
+
+        // it's converted losslessly, and converting it again doesn't make it any smaller
+        let converted = output.png().unwrap().to_vec();
+        let output = context.convert(converted.clone()).unwrap().wait().unwrap();
+        assert!(output.is_original());
+        assert_eq!(output.png().unwrap(), &converted[..]);
+    }
+
+    #[test]
+    fn awaits_jobs() {
+        struct NoopWaker;
+        impl std::task::Wake for NoopWaker {
+            fn wake(self: Arc<Self>) {}
+        }
+
+        let context = Context::new(&Options::default()).unwrap();
+        // the image is converted even if nobody waits for it
+        drop(context.convert(test_png()).unwrap());
+
+        let mut job = context.convert(test_png()).unwrap();
+        context.wait();
+        let waker = Waker::from(Arc::new(NoopWaker));
+        let mut cx = std::task::Context::from_waker(&waker);
+        match Pin::new(&mut job).poll(&mut cx) {
+            Poll::Ready(output) => check_png(output.unwrap().png().unwrap()),
+            Poll::Pending => panic!("the job should be done after Context::wait"),
+        }
+    }
+}
@@ -2,7 +2,7 @@
 
 use libc::FILE;
 use imagequant_sys::*;
-use std::os::raw::{c_char, c_uint, c_void};
+use std::os::raw::{c_char, c_int, c_uint, c_void};
 
 extern "C" {
     pub static PNGQUANT_USAGE: *const c_char;
@@ -32,8 +32,11 @@ pub enum pngquant_error {
     PNG_OUT_OF_MEMORY_ERROR = 24,
     LIBPNG_FATAL_ERROR = 25,
     WRONG_INPUT_COLOR_TYPE = 26,
+    TOO_MANY_PIXELS = 27,
     LIBPNG_INIT_ERROR = 35,
     LCMS_FATAL_ERROR = 45,
+    SKIPPED_INPUT = 96,
+    DEADLINE_EXCEEDED = 97,
     TOO_LARGE_FILE = 98,
     TOO_LOW_QUALITY = 99,
 }
@@ -43,22 +46,51 @@ pub struct pngquant_options {
     pub fixed_palette_image: *mut liq_image<'static>,
     pub log_callback: Option<liq_log_callback_function>,
     pub log_callback_user_info: *mut c_void,
+    pub input_stream: *mut FILE,
+    pub output_stream: *mut FILE,
     pub quality: *const c_char,
     pub extension: *const c_char,
     pub output_file_path: *const c_char,
     pub map_file: *const c_char,
+    pub variants: *const c_char,
+    pub emit_histogram: *const c_char,
+    pub emit_palette: *const c_char,
+    pub watch_dir: *const c_char,
+    pub recursive_dir: *const c_char,
+    pub output_dir: *const c_char,
+    pub include_glob: *const c_char,
+    pub exclude_glob: *const c_char,
+    pub files_from: *const c_char,
+    pub shard: *const c_char,
+    pub summary_file: *const c_char,
+    pub serve_socket: *const c_char,
     pub files: *const *const c_char,
     pub num_files: c_uint,
     pub colors: c_uint,
     pub speed: c_uint,
     pub posterize: c_uint,
+    pub deadline_ms: c_uint,
+    pub skip_palette_colors: c_uint,
+    pub dedupe: c_uint,
+    pub raw: c_uint,
+    pub max_memory: usize,
+    pub max_pixels: usize,
+    pub skip_smaller: usize,
+    pub target_size: usize,
     pub floyd: f32,
+    pub speed_auto: f32,
     pub using_stdin: bool,
     pub using_stdout: bool,
     pub force: bool,
     pub fast_compression: bool,
     pub min_quality_limit: bool,
     pub skip_if_larger: bool,
+    pub copy_if_larger: bool,
+    pub shared_palette: bool,
+    pub merge_histograms: bool,
+    pub dry_run: bool,
+    pub shard_by_size: bool,
+    pub merge_summaries: bool,
     pub strip: bool,
     pub iebug: bool,
     pub last_index_transparent: bool,
@@ -67,3 +99,42 @@ pub struct pngquant_options {
     pub missing_arguments: bool,
     pub verbose: bool,
 }
+
+impl Default for pngquant_options {
+    fn default() -> Self {
+        // like `{0}` in C: no strings, no callbacks, and every option off
+        unsafe { std::mem::zeroed() }
+    }
+}
+
+/// Opaque, from pngquant.h
+#[repr(C)]
+pub struct pngquant_context {
+    _private: [u8; 0],
+}
+
+#[repr(C)]
+pub struct pngquant_result {
+    pub status: pngquant_error,
+    pub id: u64,
+    pub data: *const u8,
+    pub size: usize,
+    pub input_size: usize,
+    pub width: u32,
+    pub height: u32,
+    pub quality: c_int,
+    pub mse: f64,
+    pub seconds: f64,
+}
+
+pub type pngquant_callback = unsafe extern "C" fn(result: *mut pngquant_result, user_info: *mut c_void);
+
+extern "C" {
+    #[allow(improper_ctypes)]
+    pub fn pngquant_context_create(options: &pngquant_options, liq: *const liq_attr, error: &mut pngquant_error) -> *mut pngquant_context;
+    pub fn pngquant_submit_file(context: *mut pngquant_context, filename: *const c_char, outname: *const c_char, id: u64, callback: pngquant_callback, user_info: *mut c_void) -> pngquant_error;
+    pub fn pngquant_submit_memory(context: *mut pngquant_context, png: *const c_void, size: usize, id: u64, callback: pngquant_callback, user_info: *mut c_void) -> pngquant_error;
+    pub fn pngquant_result_release(context: *mut pngquant_context, result: *mut pngquant_result);
+    pub fn pngquant_context_wait(context: *mut pngquant_context);
+    pub fn pngquant_context_destroy(context: *mut pngquant_context) -> pngquant_error;
+}
@@ -0,0 +1,33 @@
+/*
+** © 2019 by Kornel Lesiński.
+**
+** See COPYRIGHT file for license.
+*/
+
+//! Converts 24/32-bit PNG images to 8-bit palette PNGs on background threads.
+//! With the `openmp` feature many images are converted at a time, otherwise one after another.
+//!
+//! ```no_run
+//! # fn main() -> Result<(), pngquant::Error> {
+//! let context = pngquant::Context::new(&pngquant::Options { quality: Some((65, 80)), ..Default::default() })?;
+//! let png = std::fs::read("image.png").unwrap();
+//! let output = context.convert(png)?.wait()?;
+//! std::fs::write("image-fs8.png", output.png().unwrap()).unwrap();
+//! # Ok(()) }
+//! ```
+//!
+//! A [`Job`] is also a `Future`, so it can be awaited in async servers without blocking them.
+
+extern crate libpng_sys;
+
+#[cfg(feature = "cocoa")]
+pub mod rwpng_cocoa;
+
+#[cfg(feature = "lcms2")]
+extern crate lcms2_sys;
+
+#[doc(hidden)]
+pub mod ffi;
+
+mod context;
+pub use crate::context::*;
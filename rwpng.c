@@ -14,8 +14,11 @@
 
 #include "png.h"  /* if this include fails, you need to install libpng (e.g. libpng-devel package) */
 #include "rwpng.h"
+#include "rwpng_expand.h"
+#include "pngquant_trace.h"
 #if USE_LCMS
 #include "lcms2.h"
+#include "rwpng_shaper.h"
 #endif
 
 #ifndef Z_BEST_COMPRESSION
@@ -72,6 +75,8 @@ void rwpng_version_info(FILE *fp)
 struct rwpng_read_data {
     FILE *const fp;
     png_size_t bytes_read;
+    png24_image *const copy_to;
+    png_size_t copy_capacity;
 };
 
 #if !USE_COCOA
@@ -83,6 +88,20 @@ static void user_read_data(png_structp png_ptr, png_bytep data, png_size_t lengt
     if (!read) {
         png_error(png_ptr, "Read error");
     }
+
+    if (read_data->copy_to) {
+        if (read_data->bytes_read + read > read_data->copy_capacity) {
+            png_size_t capacity = read_data->copy_capacity ? read_data->copy_capacity * 2 : 1<<16;
+            while (capacity < read_data->bytes_read + read) capacity *= 2;
+            unsigned char *file_data = realloc(read_data->copy_to->file_data, capacity);
+            if (!file_data) {
+                png_error(png_ptr, "Out of memory");
+            }
+            read_data->copy_to->file_data = file_data;
+            read_data->copy_capacity = capacity;
+        }
+        memcpy(read_data->copy_to->file_data + read_data->bytes_read, data, read);
+    }
     read_data->bytes_read += read;
 }
 #endif
@@ -102,7 +121,8 @@ static void user_write_data(png_structp png_ptr, png_bytep data, png_size_t leng
         return;
     }
 
-    if (!fwrite(data, length, 1, write_state->outfile)) {
+    // without a file only the size is counted
+    if (write_state->outfile && !fwrite(data, length, 1, write_state->outfile)) {
         write_state->retval = CANT_WRITE_ERROR;
     }
 
@@ -178,6 +198,207 @@ static void rwpng_warning_stderr_handler(png_structp png_ptr, png_const_charp ms
 static void rwpng_warning_silent_handler(png_structp png_ptr, png_const_charp msg) {
 }
 
+#if USE_LCMS
+struct rwpng_color_transform {
+    cmsHPROFILE input_profile, output_profile;
+    rwpng_shaper *shaper;
+    cmsHTRANSFORM transform;
+};
+
+static pngquant_error rwpng_create_color_transform(png_structp png_ptr, png_infop info_ptr, png24_image *mainprog_ptr, int color_type, double gamma, struct rwpng_color_transform *out)
+{
+#if PNG_LIBPNG_VER < 10500
+    png_charp ProfileData;
+#else
+    png_bytep ProfileData;
+#endif
+    png_uint_32 ProfileLen;
+
+    cmsHPROFILE hInProfile = NULL;
+
+    /* color_type is read from the image before conversion to RGBA */
+    int COLOR_PNG = color_type & PNG_COLOR_MASK_COLOR;
+
+    /* embedded ICC profile */
+    if (png_get_iCCP(png_ptr, info_ptr, &(png_charp){0}, &(int){0}, &ProfileData, &ProfileLen)) {
+
+        hInProfile = cmsOpenProfileFromMem(ProfileData, ProfileLen);
+        cmsColorSpaceSignature colorspace = cmsGetColorSpace(hInProfile);
+
+        /* only RGB (and GRAY) valid for PNGs */
+        if (colorspace == cmsSigRgbData && COLOR_PNG) {
+            mainprog_ptr->input_color = RWPNG_ICCP;
+            mainprog_ptr->output_color = RWPNG_SRGB;
+        } else {
+            if (colorspace == cmsSigGrayData && !COLOR_PNG) {
+                mainprog_ptr->input_color = RWPNG_ICCP_WARN_GRAY;
+                mainprog_ptr->output_color = RWPNG_SRGB;
+            }
+            cmsCloseProfile(hInProfile);
+            hInProfile = NULL;
+        }
+    }
+
+    /* build RGB profile from cHRM and gAMA */
+    if (hInProfile == NULL && COLOR_PNG &&
+        !png_get_valid(png_ptr, info_ptr, PNG_INFO_sRGB) &&
+        png_get_valid(png_ptr, info_ptr, PNG_INFO_gAMA) &&
+        png_get_valid(png_ptr, info_ptr, PNG_INFO_cHRM)) {
+
+        cmsCIExyY WhitePoint;
+        cmsCIExyYTRIPLE Primaries;
+
+        png_get_cHRM(png_ptr, info_ptr, &WhitePoint.x, &WhitePoint.y,
+                     &Primaries.Red.x, &Primaries.Red.y,
+                     &Primaries.Green.x, &Primaries.Green.y,
+                     &Primaries.Blue.x, &Primaries.Blue.y);
+
+        WhitePoint.Y = Primaries.Red.Y = Primaries.Green.Y = Primaries.Blue.Y = 1.0;
+
+        cmsToneCurve *GammaTable[3];
+        GammaTable[0] = GammaTable[1] = GammaTable[2] = cmsBuildGamma(NULL, 1/gamma);
+
+        hInProfile = cmsCreateRGBProfile(&WhitePoint, &Primaries, GammaTable);
+
+        cmsFreeToneCurve(GammaTable[0]);
+
+        mainprog_ptr->input_color = RWPNG_GAMA_CHRM;
+        mainprog_ptr->output_color = RWPNG_SRGB;
+    }
+
+    if (hInProfile == NULL) {
+        return SUCCESS;
+    }
+
+    /* transform image to sRGB colorspace */
+    cmsHPROFILE hOutProfile = cmsCreate_sRGBProfile();
+    /* gAMA+cHRM and most ICC profiles are only curves and a matrix, which don't need all of lcms */
+    rwpng_shaper *shaper = rwpng_shaper_create(hInProfile, hOutProfile);
+    cmsHTRANSFORM hTransform = shaper ? NULL : cmsCreateTransform(hInProfile, TYPE_RGBA_8,
+                                                  hOutProfile, TYPE_RGBA_8,
+                                                  INTENT_PERCEPTUAL,
+                                                  omp_get_max_threads() > 1 ? cmsFLAGS_NOCACHE : 0);
+    if(!shaper && !hTransform) {
+        cmsCloseProfile(hOutProfile);
+        cmsCloseProfile(hInProfile);
+        return LCMS_FATAL_ERROR;
+    }
+
+    *out = (struct rwpng_color_transform){
+        .input_profile = hInProfile,
+        .output_profile = hOutProfile,
+        .shaper = shaper,
+        .transform = hTransform,
+    };
+    return SUCCESS;
+}
+
+static void rwpng_transform_rows(const struct rwpng_color_transform *t, png_bytepp row_pointers, png_uint_32 num_rows, png_uint_32 width)
+{
+    for(png_uint_32 i = 0; i < num_rows; i++) {
+        if (t->shaper) {
+            rwpng_shaper_transform_row(t->shaper, row_pointers[i], width);
+        } else {
+            /* It is safe to use the same block for input and output,
+               when both are of the same TYPE. */
+            cmsDoTransform(t->transform, row_pointers[i], row_pointers[i], width);
+        }
+    }
+}
+
+static void rwpng_destroy_color_transform(struct rwpng_color_transform *t)
+{
+    if (t->transform) cmsDeleteTransform(t->transform);
+    rwpng_shaper_destroy(t->shaper);
+    cmsCloseProfile(t->output_profile);
+    cmsCloseProfile(t->input_profile);
+    *t = (struct rwpng_color_transform){0};
+}
+
+// Rows are decompressed in strips of this height, and each strip is converted by another thread
+#define TRANSFORM_STRIP_HEIGHT 32
+
+/*
+ * Decompression is serial, so instead of converting colors after the whole image is decoded,
+ * strips are converted while the next rows are still being decompressed.
+ * This is called in critical(libpng) from the batch loop, so the tasks only get other threads when nested
+ * parallelism is enabled, i.e. for fewer files than 2 per thread. Otherwise the reading thread converts
+ * the strips itself, and the other threads work on other files.
+ */
+static pngquant_error rwpng_read_rows_transformed(png_structp png_ptr, png24_image *mainprog_ptr, png_bytepp row_pointers, rwpng_expand_type expand_type, const struct rwpng_color_transform *transform)
+{
+    const png_uint_32 width = mainprog_ptr->width, height = mainprog_ptr->height;
+    int failed = 0;
+
+    #pragma omp parallel if ((size_t)height*width > 8000)
+    #pragma omp single
+    {
+        /* libpng's longjmp on error must not leave the parallel region, so it gets its own setjmp */
+        jmp_buf outer_jmpbuf;
+        memcpy(outer_jmpbuf, mainprog_ptr->jmpbuf, sizeof(jmp_buf));
+
+        if (setjmp(mainprog_ptr->jmpbuf)) {
+            failed = 1;
+        } else {
+            for(png_uint_32 start = 0; start < height; start += TRANSFORM_STRIP_HEIGHT) {
+                const png_uint_32 rows = height - start < TRANSFORM_STRIP_HEIGHT ? height - start : TRANSFORM_STRIP_HEIGHT;
+                png_read_rows(png_ptr, row_pointers + start, NULL, rows);
+                if (expand_type) {
+                    for(png_uint_32 i = start; i < start + rows; i++) {
+                        rwpng_expand_row(expand_type, row_pointers[i], width);
+                    }
+                }
+
+                #pragma omp task firstprivate(start, rows)
+                rwpng_transform_rows(transform, row_pointers + start, rows, width);
+            }
+        }
+
+        memcpy(mainprog_ptr->jmpbuf, outer_jmpbuf, sizeof(jmp_buf));
+    }
+
+    return failed ? LIBPNG_FATAL_ERROR : SUCCESS;
+}
+
+/*
+ * Reads the whole image converted to sRGB. It has its own setjmp, so that the caller can destroy
+ * the transform when libpng fails.
+ */
+static pngquant_error rwpng_read_image_transformed(png_structp png_ptr, png_infop info_ptr, png24_image *mainprog_ptr, png_bytepp row_pointers, rwpng_expand_type expand_type, const struct rwpng_color_transform *transform)
+{
+    const png_uint_32 width = mainprog_ptr->width, height = mainprog_ptr->height;
+    pngquant_error retval = SUCCESS;
+
+    jmp_buf outer_jmpbuf;
+    memcpy(outer_jmpbuf, mainprog_ptr->jmpbuf, sizeof(jmp_buf));
+
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        retval = LIBPNG_FATAL_ERROR;
+    } else if (png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_NONE) {
+        retval = rwpng_read_rows_transformed(png_ptr, mainprog_ptr, row_pointers, expand_type, transform);
+    } else {
+        png_read_image(png_ptr, row_pointers);
+
+        if (expand_type) {
+            for(png_uint_32 i = 0; i < height; i++) {
+                rwpng_expand_row(expand_type, row_pointers[i], width);
+            }
+        }
+
+        /* interlaced images are complete only after the last pass, so they're converted afterwards */
+        #pragma omp parallel for \
+            if (height*width > 8000) \
+            schedule(static)
+        for (unsigned int i = 0; i < height; i++) {
+            rwpng_transform_rows(transform, row_pointers + i, 1, width);
+        }
+    }
+
+    memcpy(mainprog_ptr->jmpbuf, outer_jmpbuf, sizeof(jmp_buf));
+    return retval;
+}
+#endif
+
 static pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr, int strip, int verbose)
 {
     png_structp  png_ptr = NULL;
@@ -219,7 +440,7 @@ static pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainp
         png_set_read_user_chunk_fn(png_ptr, &mainprog_ptr->chunks, read_chunk_callback);
     }
 
-    struct rwpng_read_data read_data = {infile, 0};
+    struct rwpng_read_data read_data = {infile, 0, mainprog_ptr->keep_file_data ? mainprog_ptr : NULL, 0};
     png_set_read_fn(png_ptr, &read_data, user_read_data);
 
     png_read_info(png_ptr, info_ptr);  /* read all PNG info up to image data */
@@ -231,13 +452,27 @@ static pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainp
     png_get_IHDR(png_ptr, info_ptr, &mainprog_ptr->width, &mainprog_ptr->height,
                  &bit_depth, &color_type, NULL, NULL, NULL);
 
+    if (mainprog_ptr->maximum_pixels && (size_t)mainprog_ptr->width * mainprog_ptr->height > mainprog_ptr->maximum_pixels) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return TOO_MANY_PIXELS;
+    }
+
     /* expand palette images to RGB, low-bit-depth grayscale images to 8 bits,
      * transparency chunks to full alpha channel; strip 16-bit-per-sample
      * images to 8 bits per sample; and convert grayscale to RGB[A] */
 
     /* GRR TO DO:  preserve all safe-to-copy ancillary PNG chunks */
 
-    if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
+    /* gray, gray+alpha and RGB are read in their own layout, and expanded to RGBA
+     * afterwards with faster code than libpng's transforms */
+    rwpng_expand_type expand_type = 0;
+    if (bit_depth >= 8 && !png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+        if (color_type == PNG_COLOR_TYPE_GRAY) expand_type = RWPNG_EXPAND_GRAY;
+        else if (color_type == PNG_COLOR_TYPE_GRAY_ALPHA) expand_type = RWPNG_EXPAND_GRAY_ALPHA;
+        else if (color_type == PNG_COLOR_TYPE_RGB) expand_type = RWPNG_EXPAND_RGB;
+    }
+
+    if (!expand_type && !(color_type & PNG_COLOR_MASK_ALPHA)) {
 #ifdef PNG_READ_FILLER_SUPPORTED
         png_set_expand(png_ptr);
         png_set_filler(png_ptr, 65535L, PNG_FILLER_AFTER);
@@ -253,7 +488,7 @@ static pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainp
         png_set_strip_16(png_ptr);
     }
 
-    if (!(color_type & PNG_COLOR_MASK_COLOR)) {
+    if (!expand_type && !(color_type & PNG_COLOR_MASK_COLOR)) {
         png_set_gray_to_rgb(png_ptr);
     }
 
@@ -283,7 +518,7 @@ static pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainp
 
     png_read_update_info(png_ptr, info_ptr);
 
-    rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    rowbytes = expand_type ? (png_size_t)mainprog_ptr->width * 4 : png_get_rowbytes(png_ptr, info_ptr);
 
     // For overflow safety reject images that won't fit in 32-bit
     if (rowbytes > INT_MAX/mainprog_ptr->height) {
@@ -297,115 +532,50 @@ static pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainp
         return PNG_OUT_OF_MEMORY_ERROR;
     }
 
-    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->rgba_data, mainprog_ptr->height, 0);
-
-    /* now we can go ahead and just read the whole image */
-
-    png_read_image(png_ptr, row_pointers);
-
-    /* and we're done!  (png_read_end() can be omitted if no processing of
-     * post-IDAT text/time/etc. is desired) */
-
-    png_read_end(png_ptr, NULL);
+    /* kept in the image right away, like rgba_data, so that they're freed with it after a libpng error */
+    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->rgba_data, mainprog_ptr->height, rowbytes);
+    mainprog_ptr->row_pointers = (unsigned char **)row_pointers;
 
 #if USE_LCMS
-#if PNG_LIBPNG_VER < 10500
-    png_charp ProfileData;
-#else
-    png_bytep ProfileData;
-#endif
-    png_uint_32 ProfileLen;
-
-    cmsHPROFILE hInProfile = NULL;
-
-    /* color_type is read from the image before conversion to RGBA */
-    int COLOR_PNG = color_type & PNG_COLOR_MASK_COLOR;
-
-    /* embedded ICC profile */
-    if (png_get_iCCP(png_ptr, info_ptr, &(png_charp){0}, &(int){0}, &ProfileData, &ProfileLen)) {
-
-        hInProfile = cmsOpenProfileFromMem(ProfileData, ProfileLen);
-        cmsColorSpaceSignature colorspace = cmsGetColorSpace(hInProfile);
-
-        /* only RGB (and GRAY) valid for PNGs */
-        if (colorspace == cmsSigRgbData && COLOR_PNG) {
-            mainprog_ptr->input_color = RWPNG_ICCP;
-            mainprog_ptr->output_color = RWPNG_SRGB;
-        } else {
-            if (colorspace == cmsSigGrayData && !COLOR_PNG) {
-                mainprog_ptr->input_color = RWPNG_ICCP_WARN_GRAY;
-                mainprog_ptr->output_color = RWPNG_SRGB;
-            }
-            cmsCloseProfile(hInProfile);
-            hInProfile = NULL;
-        }
-    }
-
-    /* build RGB profile from cHRM and gAMA */
-    if (hInProfile == NULL && COLOR_PNG &&
-        !png_get_valid(png_ptr, info_ptr, PNG_INFO_sRGB) &&
-        png_get_valid(png_ptr, info_ptr, PNG_INFO_gAMA) &&
-        png_get_valid(png_ptr, info_ptr, PNG_INFO_cHRM)) {
-
-        cmsCIExyY WhitePoint;
-        cmsCIExyYTRIPLE Primaries;
-
-        png_get_cHRM(png_ptr, info_ptr, &WhitePoint.x, &WhitePoint.y,
-                     &Primaries.Red.x, &Primaries.Red.y,
-                     &Primaries.Green.x, &Primaries.Green.y,
-                     &Primaries.Blue.x, &Primaries.Blue.y);
-
-        WhitePoint.Y = Primaries.Red.Y = Primaries.Green.Y = Primaries.Blue.Y = 1.0;
-
-        cmsToneCurve *GammaTable[3];
-        GammaTable[0] = GammaTable[1] = GammaTable[2] = cmsBuildGamma(NULL, 1/gamma);
-
-        hInProfile = cmsCreateRGBProfile(&WhitePoint, &Primaries, GammaTable);
-
-        cmsFreeToneCurve(GammaTable[0]);
-
-        mainprog_ptr->input_color = RWPNG_GAMA_CHRM;
-        mainprog_ptr->output_color = RWPNG_SRGB;
+    /* color profile chunks are before the image data, so the transform is known before any row is decoded */
+    struct rwpng_color_transform transform = {0};
+    if (SUCCESS != rwpng_create_color_transform(png_ptr, info_ptr, mainprog_ptr, color_type, gamma, &transform)) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return LCMS_FATAL_ERROR;
     }
 
-    /* transform image to sRGB colorspace */
-    if (hInProfile != NULL) {
-
-        cmsHPROFILE hOutProfile = cmsCreate_sRGBProfile();
-        cmsHTRANSFORM hTransform = cmsCreateTransform(hInProfile, TYPE_RGBA_8,
-                                                      hOutProfile, TYPE_RGBA_8,
-                                                      INTENT_PERCEPTUAL,
-                                                      omp_get_max_threads() > 1 ? cmsFLAGS_NOCACHE : 0);
-        if(!hTransform) {
+    if (transform.input_profile) {
+        PNGQUANT_PROBE3(transform__start, mainprog_ptr->width, mainprog_ptr->height, mainprog_ptr->input_color);
+        pngquant_error retval = rwpng_read_image_transformed(png_ptr, info_ptr, mainprog_ptr, row_pointers, expand_type, &transform);
+        PNGQUANT_PROBE2(transform__done, mainprog_ptr->width, mainprog_ptr->height);
+        rwpng_destroy_color_transform(&transform);
+        mainprog_ptr->gamma = 0.45455;
+        if (SUCCESS != retval) {
             png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-            cmsCloseProfile(hOutProfile);
-            cmsCloseProfile(hInProfile);
-            return LCMS_FATAL_ERROR;
+            return retval;
         }
+    } else
+#endif
+    {
+        /* now we can go ahead and just read the whole image */
 
-        #pragma omp parallel for \
-            if (mainprog_ptr->height*mainprog_ptr->width > 8000) \
-            schedule(static)
-        for (unsigned int i = 0; i < mainprog_ptr->height; i++) {
-            /* It is safe to use the same block for input and output,
-               when both are of the same TYPE. */
-            cmsDoTransform(hTransform, row_pointers[i],
-                                       row_pointers[i],
-                                       mainprog_ptr->width);
+        png_read_image(png_ptr, row_pointers);
+
+        if (expand_type) {
+            for(png_uint_32 i = 0; i < mainprog_ptr->height; i++) {
+                rwpng_expand_row(expand_type, row_pointers[i], mainprog_ptr->width);
+            }
         }
+    }
 
-        cmsDeleteTransform(hTransform);
-        cmsCloseProfile(hOutProfile);
-        cmsCloseProfile(hInProfile);
+    /* and we're done!  (png_read_end() can be omitted if no processing of
+     * post-IDAT text/time/etc. is desired) */
 
-        mainprog_ptr->gamma = 0.45455;
-    }
-#endif
+    png_read_end(png_ptr, NULL);
 
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
     mainprog_ptr->file_size = read_data.bytes_read;
-    mainprog_ptr->row_pointers = (unsigned char **)row_pointers;
 
     return SUCCESS;
 }
@@ -426,6 +596,9 @@ void rwpng_free_image24(png24_image *image)
     free(image->rgba_data);
     image->rgba_data = NULL;
 
+    free(image->file_data);
+    image->file_data = NULL;
+
     rwpng_free_chunks(image->chunks);
     image->chunks = NULL;
 }
@@ -442,9 +615,9 @@ void rwpng_free_image8(png8_image *image)
     image->chunks = NULL;
 }
 
-pngquant_error rwpng_read_image24(FILE *infile, png24_image *out, int strip, int verbose)
-{
 #if USE_COCOA
+static pngquant_error rwpng_read_image24_cocoa(FILE *infile, png24_image *out)
+{
     rwpng_rgba *pixel_data;
     pngquant_error res = rwpng_read_image32_cocoa(infile, &out->width, &out->height, &out->file_size, &pixel_data);
     if (res != SUCCESS) {
@@ -459,11 +632,69 @@ pngquant_error rwpng_read_image24(FILE *infile, png24_image *out, int strip, int
         out->row_pointers[i] = (unsigned char *)&pixel_data[out->width*i];
     }
     return SUCCESS;
-#else
-    return rwpng_read_image24_libpng(infile, out, strip, verbose);
+}
 #endif
+
+/* Reads only the signature and IHDR, leaving the file position after them. */
+pngquant_error rwpng_read_header(FILE *infile, png_header *header)
+{
+    png_byte start[8+8+13];
+    if (fread(start, sizeof(start), 1, infile) != 1) {
+        return READ_ERROR;
+    }
+    if (png_sig_cmp(start, 0, 8) || memcmp(start+12, "IHDR", 4)) {
+        return READ_ERROR;
+    }
+
+    *header = (png_header){
+        .width = png_get_uint_32(start+16),
+        .height = png_get_uint_32(start+20),
+        .bit_depth = start[24],
+        .color_type = start[25],
+    };
+
+    // walk the chunk list up to the image data, skipping over chunk contents
+    if (fseek(infile, 4, SEEK_CUR)) { // IHDR's CRC
+        return READ_ERROR;
+    }
+    for(;;) {
+        png_byte chunk[8];
+        if (fread(chunk, sizeof(chunk), 1, infile) != 1) {
+            return READ_ERROR;
+        }
+        const png_uint_32 length = png_get_uint_32(chunk);
+        if (!memcmp(chunk+4, "IDAT", 4) || !memcmp(chunk+4, "IEND", 4)) {
+            break;
+        }
+        if (!memcmp(chunk+4, "PLTE", 4)) {
+            header->num_palette = length / 3;
+        } else if (!memcmp(chunk+4, "tRNS", 4)) {
+            header->has_trns = 1;
+        }
+        if (length > PNG_UINT_31_MAX || fseek(infile, (long)length + 4, SEEK_CUR)) {
+            return READ_ERROR;
+        }
+    }
+
+    if (fseek(infile, 0, SEEK_END)) {
+        return READ_ERROR;
+    }
+    const long file_size = ftell(infile);
+    header->file_size = file_size > 0 ? file_size : 0;
+    return SUCCESS;
 }
 
+pngquant_error rwpng_read_image24(FILE *infile, png24_image *out, int strip, int verbose)
+{
+    PNGQUANT_PROBE(read24__start);
+#if USE_COCOA
+    pngquant_error retval = rwpng_read_image24_cocoa(infile, out);
+#else
+    pngquant_error retval = rwpng_read_image24_libpng(infile, out, strip, verbose);
+#endif
+    PNGQUANT_PROBE4(read24__done, out->width, out->height, out->file_size, retval);
+    return retval;
+}
 
 static pngquant_error rwpng_write_image_init(rwpng_png_image *mainprog_ptr, png_structpp png_ptr_p, png_infopp info_ptr_p, int fast_compression)
 {
@@ -511,6 +742,93 @@ static void rwpng_write_end(png_infopp info_ptr_p, png_structpp png_ptr_p, png_b
     png_destroy_write_struct(png_ptr_p, info_ptr_p);
 }
 
+static void rwpng_write_rows(png_structp png_ptr, png_bytepp row_pointers, uint32_t num_rows, uint32_t width, const png_byte *gray_levels, png_bytep gray_row)
+{
+    if (!gray_levels) {
+        png_write_rows(png_ptr, row_pointers, num_rows);
+        return;
+    }
+    // indices are replaced with gray levels in a copy, because the image may be written again
+    for(uint32_t row = 0; row < num_rows; row++) {
+        for(uint32_t col = 0; col < width; col++) {
+            gray_row[col] = gray_levels[row_pointers[row][col]];
+        }
+        png_write_row(png_ptr, gray_row);
+    }
+}
+
+/* gray_levels are optional */
+static void rwpng_write_end8(png_infopp info_ptr_p, png_structpp png_ptr_p, png8_image *mainprog_ptr, const png_byte *gray_levels, png_bytep gray_row)
+{
+    png_write_info(*png_ptr_p, *info_ptr_p);
+
+    png_set_packing(*png_ptr_p);
+
+    rwpng_write_rows(*png_ptr_p, mainprog_ptr->row_pointers, mainprog_ptr->height, mainprog_ptr->width, gray_levels, gray_row);
+
+    png_write_end(*png_ptr_p, NULL);
+
+    png_destroy_write_struct(png_ptr_p, info_ptr_p);
+}
+
+/*
+ * If every palette entry is an opaque gray, or fully transparent, the image can be written as grayscale,
+ * without PLTE and tRNS. All transparent pixels become one gray level that isn't used by any opaque color,
+ * which tRNS marks as transparent. Levels must be exact in the bit depth, and it's not worth going deeper
+ * than the palette would be. Returns the bit depth and the level of each palette entry, or 0 if it has to be a palette.
+ */
+static int rwpng_gray_depth(const png8_image *image, int max_depth, png_byte gray_levels[], png_color_16 *trans_gray, int *has_trans)
+{
+    char used[256] = {0};
+    int trans_color = -1; // kept if it's gray and free, otherwise the color of transparent pixels doesn't matter
+    *has_trans = 0;
+    for(unsigned int i = 0; i < image->num_palette; i++) {
+        const rwpng_rgba px = image->palette[i];
+        if (px.a == 0) {
+            trans_color = (*has_trans && trans_color != px.r) || px.r != px.g || px.g != px.b ? 256 : px.r;
+            *has_trans = 1;
+        } else if (px.a < 255 || px.r != px.g || px.g != px.b) {
+            return 0;
+        } else {
+            used[px.r] = 1;
+        }
+    }
+
+#if PNG_LIBPNG_VER > 10400 /* old libpng corrupts files with low depth */
+    const int min_depth = 1;
+#else
+    const int min_depth = 8;
+#endif
+    for(int depth = min_depth; depth <= max_depth; depth *= 2) {
+        const unsigned int max_level = (1u << depth) - 1, step = 255 / max_level;
+        unsigned int gray = 0;
+        while(gray < 256 && !(used[gray] && gray % step)) {
+            gray++;
+        }
+        if (gray < 256) continue; // not exact at this depth
+
+        int trans_level = -1;
+        if (*has_trans) {
+            if (trans_color < 256 && !used[trans_color] && 0 == trans_color % step) {
+                trans_level = trans_color / step;
+            }
+            for(unsigned int level = 0; level <= max_level && trans_level < 0; level++) {
+                if (!used[level * step]) {
+                    trans_level = level;
+                }
+            }
+            if (trans_level < 0) continue; // every level is taken, maybe there's room in a deeper one
+        }
+
+        for(unsigned int i = 0; i < image->num_palette; i++) {
+            gray_levels[i] = image->palette[i].a ? image->palette[i].r / step : (unsigned int)trans_level; // set if any entry is transparent
+        }
+        *trans_gray = (png_color_16){.gray = trans_level < 0 ? 0 : trans_level};
+        return depth;
+    }
+    return 0;
+}
+
 static void rwpng_set_gamma(png_infop info_ptr, png_structp png_ptr, double gamma, rwpng_color_transform color)
 {
     if (color != RWPNG_GAMA_ONLY && color != RWPNG_NONE) {
@@ -521,7 +839,7 @@ static void rwpng_set_gamma(png_infop info_ptr, png_structp png_ptr, double gamm
     }
 }
 
-pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
+static pngquant_error rwpng_write_image8_libpng(FILE *outfile, png8_image *mainprog_ptr)
 {
     png_structp png_ptr;
     png_infop info_ptr;
@@ -539,8 +857,9 @@ pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
     };
     png_set_write_fn(png_ptr, &write_state, user_write_data, user_flush_data);
 
-    // Palette images generally don't gain anything from filtering
-    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_VALUE_NONE);
+    // Palette images generally don't gain anything from filtering, and neither do grays made from them.
+    // It has to be the PNG_FILTER_NONE flag, because 0 (PNG_FILTER_VALUE_NONE) lets libpng pick filters for 8-bit gray.
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
 
     rwpng_set_gamma(info_ptr, png_ptr, mainprog_ptr->gamma, mainprog_ptr->output_color);
 
@@ -578,8 +897,14 @@ pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
         chunk_num++;
     }
 
+    png_byte gray_levels[256];
+    png_color_16 trans_gray;
+    int has_trans_gray;
+    const int gray_depth = mainprog_ptr->keep_palette ? 0 : rwpng_gray_depth(mainprog_ptr, sample_depth, gray_levels, &trans_gray, &has_trans_gray);
+    png_bytep gray_row = gray_depth ? malloc(mainprog_ptr->width) : NULL;
+
     png_set_IHDR(png_ptr, info_ptr, mainprog_ptr->width, mainprog_ptr->height,
-      sample_depth, PNG_COLOR_TYPE_PALETTE,
+      gray_row ? gray_depth : sample_depth, gray_row ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_PALETTE,
       0, PNG_COMPRESSION_TYPE_DEFAULT,
       PNG_FILTER_TYPE_BASE);
 
@@ -598,13 +923,22 @@ pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
         }
     }
 
-    png_set_PLTE(png_ptr, info_ptr, palette, mainprog_ptr->num_palette);
+    if (gray_row) {
+        if (has_trans_gray) {
+            png_set_tRNS(png_ptr, info_ptr, NULL, 1, &trans_gray);
+        }
+    } else {
+        png_set_PLTE(png_ptr, info_ptr, palette, mainprog_ptr->num_palette);
 
-    if (num_trans > 0) {
-        png_set_tRNS(png_ptr, info_ptr, trans, num_trans, NULL);
+        if (num_trans > 0) {
+            png_set_tRNS(png_ptr, info_ptr, trans, num_trans, NULL);
+        }
     }
 
-    rwpng_write_end(&info_ptr, &png_ptr, mainprog_ptr->row_pointers);
+    rwpng_write_end8(&info_ptr, &png_ptr, mainprog_ptr, gray_row ? gray_levels : NULL, gray_row);
+    free(gray_row);
+
+    mainprog_ptr->file_size = write_state.bytes_written;
 
     if (SUCCESS == write_state.retval && write_state.maximum_file_size && write_state.bytes_written > write_state.maximum_file_size) {
         return TOO_LARGE_FILE;
@@ -613,6 +947,15 @@ pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
     return write_state.retval;
 }
 
+pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
+{
+    PNGQUANT_PROBE3(write8__start, mainprog_ptr->width, mainprog_ptr->height, mainprog_ptr->num_palette);
+    mainprog_ptr->file_size = 0;
+    pngquant_error retval = rwpng_write_image8_libpng(outfile, mainprog_ptr);
+    PNGQUANT_PROBE2(write8__done, mainprog_ptr->file_size, retval);
+    return retval;
+}
+
 pngquant_error rwpng_write_image24(FILE *outfile, const png24_image *mainprog_ptr)
 {
     png_structp png_ptr;
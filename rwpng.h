@@ -31,8 +31,11 @@ typedef enum {
     PNG_OUT_OF_MEMORY_ERROR = 24,
     LIBPNG_FATAL_ERROR = 25,
     WRONG_INPUT_COLOR_TYPE = 26,
+    TOO_MANY_PIXELS = 27,
     LIBPNG_INIT_ERROR = 35,
     LCMS_FATAL_ERROR = 45,
+    SKIPPED_INPUT = 96,
+    DEADLINE_EXCEEDED = 97,
     TOO_LARGE_FILE = 98,
     TOO_LOW_QUALITY = 99,
 } pngquant_error;
@@ -67,17 +70,32 @@ typedef struct {
     double gamma;
     unsigned char **row_pointers;
     unsigned char *rgba_data;
+    unsigned char *file_data; // copy of the original file, if keep_file_data was set (not supported by Cocoa reader)
     struct rwpng_chunk *chunks;
     rwpng_color_transform input_color;
     rwpng_color_transform output_color;
+    size_t maximum_pixels; // 0 = unlimited
+    char keep_file_data;
 } png24_image;
 
+// What can be learned from the chunks before image data, without decoding it
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    size_t file_size;
+    unsigned int num_palette; // 0 if there's no PLTE chunk
+    unsigned char bit_depth;
+    unsigned char color_type; // as in IHDR, 3 = indexed
+    char has_trns;
+} png_header;
+
 typedef struct {
     jmp_buf jmpbuf;
     uint32_t width;
     uint32_t height;
     size_t maximum_file_size;
     size_t metadata_size;
+    size_t file_size;
     double gamma;
     unsigned char **row_pointers;
     unsigned char *indexed_data;
@@ -86,6 +104,7 @@ typedef struct {
     rwpng_rgba palette[256];
     rwpng_color_transform output_color;
     char fast_compression;
+    char keep_palette; // otherwise a palette of only grays is written as grayscale
 } png8_image;
 
 typedef union {
@@ -98,7 +117,9 @@ typedef union {
 
 void rwpng_version_info(FILE *fp);
 
+pngquant_error rwpng_read_header(FILE *infile, png_header *header);
 pngquant_error rwpng_read_image24(FILE *infile, png24_image *mainprog_ptr, int strip, int verbose);
+/* outfile can be NULL to compress the image only to learn its file_size */
 pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr);
 pngquant_error rwpng_write_image24(FILE *outfile, const png24_image *mainprog_ptr);
 void rwpng_free_image24(png24_image *);
@@ -0,0 +1,288 @@
+/*
+** Expansion of decoded gray, gray+alpha and RGB rows to RGBA
+**
+** See COPYRIGHT file for license.
+*/
+
+#include <stddef.h>
+#include "rwpng_expand.h"
+
+#ifndef USE_SSE
+#define USE_SSE 0
+#endif
+
+#if USE_SSE && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define RWPNG_EXPAND_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RWPNG_EXPAND_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Rows are expanded in place, so pixels are processed from the end of the row towards the start:
+ * a pixel's RGBA bytes only overwrite bytes of pixels that have already been expanded.
+ * SIMD kernels read a whole block before writing it, and return number of pixels they've left
+ * at the start of the row for the scalar version. Without SIMD there are no kernels, and the scalar version does it all.
+ */
+typedef uint32_t (*expand_kernel)(unsigned char *row, uint32_t width);
+
+struct expand_kernels {
+    const char *name;
+    expand_kernel gray, gray_alpha, rgb;
+};
+
+static void expand_gray_scalar(unsigned char *row, uint32_t width)
+{
+    for(uint32_t x = width; x-- > 0;) {
+        const unsigned char g = row[x];
+        unsigned char *dst = row + 4*x;
+        dst[0] = g; dst[1] = g; dst[2] = g; dst[3] = 255;
+    }
+}
+
+static void expand_gray_alpha_scalar(unsigned char *row, uint32_t width)
+{
+    for(uint32_t x = width; x-- > 0;) {
+        const unsigned char g = row[2*x], a = row[2*x+1];
+        unsigned char *dst = row + 4*x;
+        dst[0] = g; dst[1] = g; dst[2] = g; dst[3] = a;
+    }
+}
+
+static void expand_rgb_scalar(unsigned char *row, uint32_t width)
+{
+    for(uint32_t x = width; x-- > 0;) {
+        const unsigned char r = row[3*x], g = row[3*x+1], b = row[3*x+2];
+        unsigned char *dst = row + 4*x;
+        dst[0] = r; dst[1] = g; dst[2] = b; dst[3] = 255;
+    }
+}
+
+static const struct expand_kernels scalar_kernels = {"scalar", NULL, NULL, NULL};
+
+#if RWPNG_EXPAND_X86
+__attribute__((target("ssse3")))
+static uint32_t expand_gray_ssse3(unsigned char *row, uint32_t width)
+{
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    const __m128i m0 = _mm_setr_epi8(0,0,0,-1, 1,1,1,-1, 2,2,2,-1, 3,3,3,-1);
+    const __m128i m1 = _mm_setr_epi8(4,4,4,-1, 5,5,5,-1, 6,6,6,-1, 7,7,7,-1);
+    const __m128i m2 = _mm_setr_epi8(8,8,8,-1, 9,9,9,-1, 10,10,10,-1, 11,11,11,-1);
+    const __m128i m3 = _mm_setr_epi8(12,12,12,-1, 13,13,13,-1, 14,14,14,-1, 15,15,15,-1);
+
+    uint32_t x = width;
+    while(x >= 16) {
+        x -= 16;
+        const __m128i g = _mm_loadu_si128((const __m128i *)(row + x));
+        __m128i *dst = (__m128i *)(row + 4*x);
+        _mm_storeu_si128(dst + 0, _mm_or_si128(_mm_shuffle_epi8(g, m0), alpha));
+        _mm_storeu_si128(dst + 1, _mm_or_si128(_mm_shuffle_epi8(g, m1), alpha));
+        _mm_storeu_si128(dst + 2, _mm_or_si128(_mm_shuffle_epi8(g, m2), alpha));
+        _mm_storeu_si128(dst + 3, _mm_or_si128(_mm_shuffle_epi8(g, m3), alpha));
+    }
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static uint32_t expand_gray_alpha_ssse3(unsigned char *row, uint32_t width)
+{
+    const __m128i m0 = _mm_setr_epi8(0,0,0,1, 2,2,2,3, 4,4,4,5, 6,6,6,7);
+    const __m128i m1 = _mm_setr_epi8(8,8,8,9, 10,10,10,11, 12,12,12,13, 14,14,14,15);
+
+    uint32_t x = width;
+    while(x >= 16) {
+        x -= 16;
+        const __m128i ga0 = _mm_loadu_si128((const __m128i *)(row + 2*x));
+        const __m128i ga1 = _mm_loadu_si128((const __m128i *)(row + 2*x + 16));
+        __m128i *dst = (__m128i *)(row + 4*x);
+        _mm_storeu_si128(dst + 0, _mm_shuffle_epi8(ga0, m0));
+        _mm_storeu_si128(dst + 1, _mm_shuffle_epi8(ga0, m1));
+        _mm_storeu_si128(dst + 2, _mm_shuffle_epi8(ga1, m0));
+        _mm_storeu_si128(dst + 3, _mm_shuffle_epi8(ga1, m1));
+    }
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static uint32_t expand_rgb_ssse3(unsigned char *row, uint32_t width)
+{
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    const __m128i m = _mm_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+
+    uint32_t x = width;
+    while(x >= 16) {
+        x -= 16;
+        const unsigned char *src = row + 3*x;
+        const __m128i a = _mm_loadu_si128((const __m128i *)(src + 0));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        const __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i *dst = (__m128i *)(row + 4*x);
+        _mm_storeu_si128(dst + 0, _mm_or_si128(_mm_shuffle_epi8(a, m), alpha));
+        _mm_storeu_si128(dst + 1, _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), m), alpha));
+        _mm_storeu_si128(dst + 2, _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), m), alpha));
+        _mm_storeu_si128(dst + 3, _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(c, 4), m), alpha));
+    }
+    return x;
+}
+
+static const struct expand_kernels ssse3_kernels = {"SSSE3", expand_gray_ssse3, expand_gray_alpha_ssse3, expand_rgb_ssse3};
+
+__attribute__((target("avx2")))
+static uint32_t expand_gray_avx2(unsigned char *row, uint32_t width)
+{
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    // shuffles work within 128-bit lanes, so both lanes get the same 16 input pixels
+    const __m256i m0 = _mm256_setr_epi8(0,0,0,-1, 1,1,1,-1, 2,2,2,-1, 3,3,3,-1,
+                                        4,4,4,-1, 5,5,5,-1, 6,6,6,-1, 7,7,7,-1);
+    const __m256i m1 = _mm256_setr_epi8(8,8,8,-1, 9,9,9,-1, 10,10,10,-1, 11,11,11,-1,
+                                        12,12,12,-1, 13,13,13,-1, 14,14,14,-1, 15,15,15,-1);
+
+    uint32_t x = width;
+    while(x >= 16) {
+        x -= 16;
+        const __m256i g = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(row + x)));
+        __m256i *dst = (__m256i *)(row + 4*x);
+        _mm256_storeu_si256(dst + 0, _mm256_or_si256(_mm256_shuffle_epi8(g, m0), alpha));
+        _mm256_storeu_si256(dst + 1, _mm256_or_si256(_mm256_shuffle_epi8(g, m1), alpha));
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static uint32_t expand_gray_alpha_avx2(unsigned char *row, uint32_t width)
+{
+    // both lanes get the same 8 input pixels
+    const __m256i m = _mm256_setr_epi8(0,0,0,1, 2,2,2,3, 4,4,4,5, 6,6,6,7,
+                                       8,8,8,9, 10,10,10,11, 12,12,12,13, 14,14,14,15);
+
+    uint32_t x = width;
+    while(x >= 16) {
+        x -= 16;
+        const __m128i ga0 = _mm_loadu_si128((const __m128i *)(row + 2*x));
+        const __m128i ga1 = _mm_loadu_si128((const __m128i *)(row + 2*x + 16));
+        __m256i *dst = (__m256i *)(row + 4*x);
+        _mm256_storeu_si256(dst + 0, _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(ga0), m));
+        _mm256_storeu_si256(dst + 1, _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(ga1), m));
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static uint32_t expand_rgb_avx2(unsigned char *row, uint32_t width)
+{
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    const __m256i m = _mm256_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1,
+                                       0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+
+    uint32_t x = width;
+    while(x >= 16) {
+        x -= 16;
+        const unsigned char *src = row + 3*x;
+        const __m128i a = _mm_loadu_si128((const __m128i *)(src + 0));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        const __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        // each lane gets 4 pixels (12 bytes) at the start
+        const __m256i p0 = _mm256_inserti128_si256(_mm256_castsi128_si256(a), _mm_alignr_epi8(b, a, 12), 1);
+        const __m256i p1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_alignr_epi8(c, b, 8)), _mm_srli_si128(c, 4), 1);
+        __m256i *dst = (__m256i *)(row + 4*x);
+        _mm256_storeu_si256(dst + 0, _mm256_or_si256(_mm256_shuffle_epi8(p0, m), alpha));
+        _mm256_storeu_si256(dst + 1, _mm256_or_si256(_mm256_shuffle_epi8(p1, m), alpha));
+    }
+    return x;
+}
+
+static const struct expand_kernels avx2_kernels = {"AVX2", expand_gray_avx2, expand_gray_alpha_avx2, expand_rgb_avx2};
+#endif
+
+#if RWPNG_EXPAND_NEON
+static uint32_t expand_gray_neon(unsigned char *row, uint32_t width)
+{
+    const uint8x16_t alpha = vdupq_n_u8(255);
+    uint32_t x = width;
+    while(x >= 16) {
+        x -= 16;
+        const uint8x16_t g = vld1q_u8(row + x);
+        const uint8x16x4_t rgba = {{g, g, g, alpha}};
+        vst4q_u8(row + 4*x, rgba);
+    }
+    return x;
+}
+
+static uint32_t expand_gray_alpha_neon(unsigned char *row, uint32_t width)
+{
+    uint32_t x = width;
+    while(x >= 16) {
+        x -= 16;
+        const uint8x16x2_t ga = vld2q_u8(row + 2*x);
+        const uint8x16x4_t rgba = {{ga.val[0], ga.val[0], ga.val[0], ga.val[1]}};
+        vst4q_u8(row + 4*x, rgba);
+    }
+    return x;
+}
+
+static uint32_t expand_rgb_neon(unsigned char *row, uint32_t width)
+{
+    const uint8x16_t alpha = vdupq_n_u8(255);
+    uint32_t x = width;
+    while(x >= 16) {
+        x -= 16;
+        const uint8x16x3_t rgb = vld3q_u8(row + 3*x);
+        const uint8x16x4_t rgba = {{rgb.val[0], rgb.val[1], rgb.val[2], alpha}};
+        vst4q_u8(row + 4*x, rgba);
+    }
+    return x;
+}
+
+static const struct expand_kernels neon_kernels = {"NEON", expand_gray_neon, expand_gray_alpha_neon, expand_rgb_neon};
+#endif
+
+static const struct expand_kernels *select_kernels(void)
+{
+#if RWPNG_EXPAND_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2_kernels;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return &ssse3_kernels;
+    }
+#endif
+#if RWPNG_EXPAND_NEON
+    return &neon_kernels;
+#endif
+    return &scalar_kernels;
+}
+
+static const struct expand_kernels *get_kernels(void)
+{
+    // it's OK if threads race to set it, since they all pick the same kernels
+    static const struct expand_kernels *volatile kernels;
+    if (!kernels) {
+        kernels = select_kernels();
+    }
+    return kernels;
+}
+
+void rwpng_expand_row(rwpng_expand_type type, unsigned char *row, uint32_t width)
+{
+    const struct expand_kernels *kernels = get_kernels();
+    switch(type) {
+        case RWPNG_EXPAND_GRAY:
+            expand_gray_scalar(row, kernels->gray ? kernels->gray(row, width) : width);
+            break;
+        case RWPNG_EXPAND_GRAY_ALPHA:
+            expand_gray_alpha_scalar(row, kernels->gray_alpha ? kernels->gray_alpha(row, width) : width);
+            break;
+        case RWPNG_EXPAND_RGB:
+            expand_rgb_scalar(row, kernels->rgb ? kernels->rgb(row, width) : width);
+            break;
+    }
+}
+
+const char *rwpng_expand_implementation(void)
+{
+    return get_kernels()->name;
+}
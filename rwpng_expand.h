@@ -0,0 +1,27 @@
+/*
+** Expansion of decoded gray, gray+alpha and RGB rows to RGBA
+**
+** See COPYRIGHT file for license.
+*/
+
+#ifndef RWPNG_EXPAND_H
+#define RWPNG_EXPAND_H
+
+#include <stdint.h>
+
+typedef enum {
+    RWPNG_EXPAND_GRAY = 1, // bytes per pixel in the native layout
+    RWPNG_EXPAND_GRAY_ALPHA = 2,
+    RWPNG_EXPAND_RGB = 3,
+} rwpng_expand_type;
+
+/*
+ * Converts a row in place. The row holds width pixels in the native 8-bit layout,
+ * and must have room for width RGBA pixels. Fully opaque alpha is added if there's none.
+ */
+void rwpng_expand_row(rwpng_expand_type type, unsigned char *row, uint32_t width);
+
+/* Name of the implementation chosen for this CPU */
+const char *rwpng_expand_implementation(void);
+
+#endif
@@ -0,0 +1,237 @@
+/*
+** Fast conversion from matrix/shaper RGB profiles to sRGB
+**
+** See COPYRIGHT file for license.
+*/
+
+#if USE_LCMS
+#include <stdlib.h>
+#include <stdbool.h>
+#include "rwpng_shaper.h"
+
+#ifndef USE_SSE
+#define USE_SSE 0
+#endif
+
+#if USE_SSE && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define RWPNG_SHAPER_X86 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RWPNG_SHAPER_NEON 1
+#include <arm_neon.h>
+#endif
+
+// linear values are looked up with this precision, which keeps dark colors within ±1 of lcms
+#define SHAPER_LINEAR_BITS 14
+#define SHAPER_LINEAR_SIZE (1<<SHAPER_LINEAR_BITS)
+
+struct rwpng_shaper {
+    float to_linear[3][256];
+    float matrix[3][3];
+    unsigned char from_linear[3][SHAPER_LINEAR_SIZE];
+};
+
+static const cmsTagSignature colorant_tags[3] = {cmsSigRedColorantTag, cmsSigGreenColorantTag, cmsSigBlueColorantTag};
+static const cmsTagSignature trc_tags[3] = {cmsSigRedTRCTag, cmsSigGreenTRCTag, cmsSigBlueTRCTag};
+
+static bool is_matrix_shaper(cmsHPROFILE profile, cmsUInt32Number direction)
+{
+    // lcms prefers LUTs over the matrix when a profile has both
+    return cmsIsMatrixShaper(profile) && !cmsIsCLUT(profile, INTENT_PERCEPTUAL, direction);
+}
+
+/* columns are XYZ of the primaries (adapted to D50 by lcms), so that rgb * matrix = XYZ */
+static bool read_matrix(cmsHPROFILE profile, double matrix[3][3])
+{
+    for(int c=0; c < 3; c++) {
+        const cmsCIEXYZ *xyz = cmsReadTag(profile, colorant_tags[c]);
+        if (!xyz) return false;
+        matrix[0][c] = xyz->X;
+        matrix[1][c] = xyz->Y;
+        matrix[2][c] = xyz->Z;
+    }
+    return true;
+}
+
+static bool invert_matrix(const double m[3][3], double inv[3][3])
+{
+    const double det = m[0][0] * (m[1][1] * m[2][2] - m[2][1] * m[1][2]) -
+                       m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                       m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    if (det > -1e-12 && det < 1e-12) {
+        return false;
+    }
+    const double invdet = 1.0 / det;
+    inv[0][0] = (m[1][1] * m[2][2] - m[2][1] * m[1][2]) * invdet;
+    inv[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invdet;
+    inv[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invdet;
+    inv[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * invdet;
+    inv[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invdet;
+    inv[1][2] = (m[1][0] * m[0][2] - m[0][0] * m[1][2]) * invdet;
+    inv[2][0] = (m[1][0] * m[2][1] - m[2][0] * m[1][1]) * invdet;
+    inv[2][1] = (m[2][0] * m[0][1] - m[0][0] * m[2][1]) * invdet;
+    inv[2][2] = (m[0][0] * m[1][1] - m[1][0] * m[0][1]) * invdet;
+    return true;
+}
+
+rwpng_shaper *rwpng_shaper_create(cmsHPROFILE input_profile, cmsHPROFILE output_profile)
+{
+    if (!is_matrix_shaper(input_profile, LCMS_USED_AS_INPUT) || !is_matrix_shaper(output_profile, LCMS_USED_AS_OUTPUT)) {
+        return NULL;
+    }
+
+    double input_matrix[3][3], output_matrix[3][3], output_inverse[3][3];
+    if (!read_matrix(input_profile, input_matrix) || !read_matrix(output_profile, output_matrix) ||
+        !invert_matrix(output_matrix, output_inverse)) {
+        return NULL;
+    }
+
+    const cmsToneCurve *input_curves[3], *output_curves[3];
+    for(int c=0; c < 3; c++) {
+        input_curves[c] = cmsReadTag(input_profile, trc_tags[c]);
+        output_curves[c] = cmsReadTag(output_profile, trc_tags[c]);
+        if (!input_curves[c] || !output_curves[c]) {
+            return NULL;
+        }
+    }
+
+    rwpng_shaper *shaper = malloc(sizeof(*shaper));
+    if (!shaper) return NULL;
+
+    for(int row=0; row < 3; row++) {
+        for(int col=0; col < 3; col++) {
+            shaper->matrix[row][col] = output_inverse[row][0] * input_matrix[0][col] +
+                                       output_inverse[row][1] * input_matrix[1][col] +
+                                       output_inverse[row][2] * input_matrix[2][col];
+        }
+    }
+
+    for(int c=0; c < 3; c++) {
+        for(int i=0; i < 256; i++) {
+            shaper->to_linear[c][i] = cmsEvalToneCurveFloat(input_curves[c], i / 255.f);
+        }
+
+        cmsToneCurve *reversed = cmsReverseToneCurve(output_curves[c]);
+        if (!reversed) {
+            free(shaper);
+            return NULL;
+        }
+        for(int i=0; i < SHAPER_LINEAR_SIZE; i++) {
+            const float value = cmsEvalToneCurveFloat(reversed, i / (float)(SHAPER_LINEAR_SIZE-1)) * 255.f + 0.5f;
+            shaper->from_linear[c][i] = value <= 0 ? 0 : (value >= 255 ? 255 : (unsigned char)value);
+        }
+        cmsFreeToneCurve(reversed);
+    }
+
+    return shaper;
+}
+
+static inline unsigned int linear_index(float value)
+{
+    const float scaled = value * (SHAPER_LINEAR_SIZE-1) + 0.5f;
+    return scaled <= 0 ? 0 : (scaled >= SHAPER_LINEAR_SIZE-1 ? SHAPER_LINEAR_SIZE-1 : (unsigned int)scaled);
+}
+
+static void transform_scalar(const rwpng_shaper *shaper, unsigned char *rgba_row, uint32_t start, uint32_t width)
+{
+    const float (*m)[3] = shaper->matrix;
+    for(uint32_t x = start; x < width; x++) {
+        unsigned char *px = rgba_row + 4*x;
+        const float r = shaper->to_linear[0][px[0]];
+        const float g = shaper->to_linear[1][px[1]];
+        const float b = shaper->to_linear[2][px[2]];
+
+        px[0] = shaper->from_linear[0][linear_index(m[0][0] * r + m[0][1] * g + m[0][2] * b)];
+        px[1] = shaper->from_linear[1][linear_index(m[1][0] * r + m[1][1] * g + m[1][2] * b)];
+        px[2] = shaper->from_linear[2][linear_index(m[2][0] * r + m[2][1] * g + m[2][2] * b)];
+    }
+}
+
+/*
+ * SIMD versions do the matrix and the rounding for 4 pixels at a time, and return how many pixels they've done.
+ * Table lookups are gathers either way, so they're left as loads of single bytes and floats.
+ * The arithmetic is the same as in the scalar version.
+ */
+#if RWPNG_SHAPER_X86
+__attribute__((target("sse2")))
+static uint32_t transform_sse2(const rwpng_shaper *shaper, unsigned char *rgba_row, uint32_t width)
+{
+    __m128 m[3][3];
+    for(int row=0; row < 3; row++) {
+        for(int col=0; col < 3; col++) {
+            m[row][col] = _mm_set1_ps(shaper->matrix[row][col]);
+        }
+    }
+    const __m128 scale = _mm_set1_ps(SHAPER_LINEAR_SIZE-1), half = _mm_set1_ps(0.5f);
+    const __m128 zero = _mm_setzero_ps(), max = _mm_set1_ps(SHAPER_LINEAR_SIZE-1);
+
+    uint32_t x = 0;
+    for(; x + 4 <= width; x += 4) {
+        unsigned char *px = rgba_row + 4*x;
+        __m128 in[3];
+        for(int c=0; c < 3; c++) {
+            in[c] = _mm_setr_ps(shaper->to_linear[c][px[c]], shaper->to_linear[c][px[4+c]],
+                                shaper->to_linear[c][px[8+c]], shaper->to_linear[c][px[12+c]]);
+        }
+        for(int c=0; c < 3; c++) {
+            const __m128 value = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[c][0], in[0]), _mm_mul_ps(m[c][1], in[1])), _mm_mul_ps(m[c][2], in[2]));
+            // max() first, so that NaN becomes 0
+            const __m128 scaled = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(value, scale), half), zero), max);
+            int32_t index[4];
+            _mm_storeu_si128((__m128i *)index, _mm_cvttps_epi32(scaled));
+            for(int i=0; i < 4; i++) {
+                px[4*i + c] = shaper->from_linear[c][index[i]];
+            }
+        }
+    }
+    return x;
+}
+#endif
+
+#if RWPNG_SHAPER_NEON
+static uint32_t transform_neon(const rwpng_shaper *shaper, unsigned char *rgba_row, uint32_t width)
+{
+    const float32x4_t half = vdupq_n_f32(0.5f), zero = vdupq_n_f32(0), max = vdupq_n_f32(SHAPER_LINEAR_SIZE-1);
+
+    uint32_t x = 0;
+    for(; x + 4 <= width; x += 4) {
+        unsigned char *px = rgba_row + 4*x;
+        float32x4_t in[3];
+        for(int c=0; c < 3; c++) {
+            const float lanes[4] = {shaper->to_linear[c][px[c]], shaper->to_linear[c][px[4+c]],
+                                    shaper->to_linear[c][px[8+c]], shaper->to_linear[c][px[12+c]]};
+            in[c] = vld1q_f32(lanes);
+        }
+        for(int c=0; c < 3; c++) {
+            const float32x4_t value = vaddq_f32(vaddq_f32(vmulq_n_f32(in[0], shaper->matrix[c][0]), vmulq_n_f32(in[1], shaper->matrix[c][1])),
+                                                vmulq_n_f32(in[2], shaper->matrix[c][2]));
+            const float32x4_t scaled = vminq_f32(vmaxq_f32(vaddq_f32(vmulq_f32(value, max), half), zero), max);
+            uint32_t index[4];
+            vst1q_u32(index, vcvtq_u32_f32(scaled));
+            for(int i=0; i < 4; i++) {
+                px[4*i + c] = shaper->from_linear[c][index[i]];
+            }
+        }
+    }
+    return x;
+}
+#endif
+
+void rwpng_shaper_transform_row(const rwpng_shaper *shaper, unsigned char *rgba_row, uint32_t width)
+{
+    uint32_t done = 0;
+#if RWPNG_SHAPER_X86
+    done = transform_sse2(shaper, rgba_row, width);
+#elif RWPNG_SHAPER_NEON
+    done = transform_neon(shaper, rgba_row, width);
+#endif
+    transform_scalar(shaper, rgba_row, done, width);
+}
+
+void rwpng_shaper_destroy(rwpng_shaper *shaper)
+{
+    free(shaper);
+}
+#endif
@@ -0,0 +1,26 @@
+/*
+** Fast conversion from matrix/shaper RGB profiles to sRGB
+**
+** See COPYRIGHT file for license.
+*/
+
+#ifndef RWPNG_SHAPER_H
+#define RWPNG_SHAPER_H
+
+#include <stdint.h>
+#include "lcms2.h"
+
+typedef struct rwpng_shaper rwpng_shaper;
+
+/*
+ * Lookup tables and a matrix equivalent to lcms transform between the profiles.
+ * Returns NULL if the profiles aren't simple matrix/shaper RGB ones, and lcms has to be used.
+ */
+rwpng_shaper *rwpng_shaper_create(cmsHPROFILE input_profile, cmsHPROFILE output_profile);
+
+/* Converts RGB of RGBA pixels in place. Alpha is not changed. */
+void rwpng_shaper_transform_row(const rwpng_shaper *shaper, unsigned char *rgba_row, uint32_t width);
+
+void rwpng_shaper_destroy(rwpng_shaper *shaper);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Checks expansion of gray, gray+alpha and RGB rows to RGBA. With --bench it's also timed.
+ */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rwpng_expand.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reference_expand(rwpng_expand_type type, const unsigned char *src, unsigned char *dst, uint32_t width)
+{
+    for(uint32_t x = 0; x < width; x++) {
+        const unsigned char *px = src + x * type;
+        dst[4*x+0] = px[0];
+        dst[4*x+1] = type == RWPNG_EXPAND_RGB ? px[1] : px[0];
+        dst[4*x+2] = type == RWPNG_EXPAND_RGB ? px[2] : px[0];
+        dst[4*x+3] = type == RWPNG_EXPAND_GRAY_ALPHA ? px[1] : 255;
+    }
+}
+
+static void check(rwpng_expand_type type)
+{
+    // odd widths exercise the scalar tail
+    for(uint32_t width = 0; width < 100; width++) {
+        unsigned char src[100*4], expected[100*4], row[100*4];
+        for(unsigned int i = 0; i < sizeof(src); i++) src[i] = rand();
+        memcpy(row, src, sizeof(row));
+        reference_expand(type, src, expected, width);
+        rwpng_expand_row(type, row, width);
+        assert(0 == memcmp(row, expected, width * 4));
+    }
+}
+
+static void bench(const char *name, rwpng_expand_type type)
+{
+    const uint32_t width = 4000, height = 1000;
+    unsigned char *src = malloc((size_t)width * height * type);
+    unsigned char *buf = malloc((size_t)width * height * 4);
+    assert(src && buf);
+    for(size_t i = 0; i < (size_t)width * height * type; i++) src[i] = i * 7;
+
+    double best = 1e9, best_reference = 1e9;
+    for(int run = 0; run < 5; run++) {
+        for(uint32_t y = 0; y < height; y++) {
+            memcpy(buf + (size_t)y * width * 4, src + (size_t)y * width * type, width * type);
+        }
+        double start = now();
+        for(uint32_t y = 0; y < height; y++) {
+            rwpng_expand_row(type, buf + (size_t)y * width * 4, width);
+        }
+        double elapsed = now() - start;
+        if (elapsed < best) best = elapsed;
+
+        start = now();
+        for(uint32_t y = 0; y < height; y++) {
+            reference_expand(type, src + (size_t)y * width * type, buf + (size_t)y * width * 4, width);
+        }
+        elapsed = now() - start;
+        if (elapsed < best_reference) best_reference = elapsed;
+    }
+
+    const double mpix = (double)width * height / 1e6;
+    printf("%-10s %8.0f Mpix/s  (plain loop %6.0f Mpix/s)\n", name, mpix / best, mpix / best_reference);
+    free(src);
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    check(RWPNG_EXPAND_GRAY);
+    check(RWPNG_EXPAND_GRAY_ALPHA);
+    check(RWPNG_EXPAND_RGB);
+
+    printf("Using %s\n", rwpng_expand_implementation());
+    if (argc < 2 || strcmp(argv[1], "--bench")) {
+        return 0;
+    }
+    bench("gray", RWPNG_EXPAND_GRAY);
+    bench("gray+alpha", RWPNG_EXPAND_GRAY_ALPHA);
+    bench("rgb", RWPNG_EXPAND_RGB);
+    return 0;
+}
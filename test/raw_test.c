@@ -0,0 +1,85 @@
+/*
+ * Checks that a --raw file has the same pixels as a PNG, e.g. one converted from the same image with the same options.
+ *
+ * raw_test file.raw file.png
+ */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#include "pngquant_raw.h"
+
+static uint32_t get_le32(const unsigned char *src)
+{
+    return src[0] | (uint32_t)src[1] << 8 | (uint32_t)src[2] << 16 | (uint32_t)src[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *src)
+{
+    return get_le32(src) | (uint64_t)get_le32(src + 4) << 32;
+}
+
+int main(int argc, char *argv[])
+{
+    assert(argc == 3);
+    FILE *fp = fopen(argv[1], "rb");
+    assert(fp);
+    static unsigned char raw[1<<26];
+    const size_t raw_size = fread(raw, 1, sizeof(raw), fp);
+    fclose(fp);
+    assert(raw_size >= PNGQUANT_RAW_HEADER_SIZE);
+
+    assert(0 == memcmp(raw, PNGQUANT_RAW_MAGIC, 8));
+    const struct pngquant_raw_header header = {
+        .version = get_le32(raw + 8),
+        .width = get_le32(raw + 12),
+        .height = get_le32(raw + 16),
+        .num_palette = get_le32(raw + 20),
+        .palette_offset = get_le32(raw + 24),
+        .row_stride = get_le32(raw + 28),
+        .indices_offset = get_le64(raw + 32),
+        .indices_size = get_le64(raw + 40),
+        .gamma = get_le32(raw + 48),
+        .flags = get_le32(raw + 52),
+    };
+    assert(PNGQUANT_RAW_VERSION == header.version);
+    assert(header.num_palette >= 1 && header.num_palette <= 256);
+    assert(header.palette_offset >= PNGQUANT_RAW_HEADER_SIZE);
+    assert(header.row_stride >= header.width);
+    assert(header.indices_offset >= header.palette_offset + 256 * 4);
+    assert(header.indices_size == (uint64_t)header.row_stride * header.height);
+    assert(raw_size == header.indices_offset + header.indices_size);
+    assert(header.gamma > 0);
+    printf("%ux%u, %u colors, pixels at %llu%s\n", header.width, header.height, header.num_palette,
+           (unsigned long long)header.indices_offset, header.indices_offset % PNGQUANT_RAW_PAGE_SIZE ? "" : " (page-aligned)");
+
+    const unsigned char *palette = raw + header.palette_offset;
+    for(unsigned int i = header.num_palette * 4; i < 256 * 4; i++) {
+        assert(0 == palette[i]);
+    }
+
+    png_image png = {.version = PNG_IMAGE_VERSION};
+    assert(png_image_begin_read_from_file(&png, argv[2]));
+    png.format = PNG_FORMAT_RGBA;
+    assert(png.width == header.width && png.height == header.height);
+    unsigned char *rgba = malloc(PNG_IMAGE_SIZE(png));
+    assert(rgba && png_image_finish_read(&png, NULL, rgba, 0, NULL));
+
+    for(uint32_t y = 0; y < header.height; y++) {
+        const unsigned char *indices = raw + header.indices_offset + (size_t)y * header.row_stride;
+        for(uint32_t x = 0; x < header.width; x++) {
+            assert(indices[x] < header.num_palette);
+            const unsigned char *color = palette + indices[x] * 4;
+            const unsigned char *expected = rgba + ((size_t)y * header.width + x) * 4;
+            // color of fully transparent pixels isn't kept, e.g. in a grayscale PNG
+            assert(color[3] == expected[3]);
+            assert(0 == color[3] || 0 == memcmp(color, expected, 3));
+        }
+    }
+    puts("pixels are the same as in the PNG");
+
+    free(rgba);
+    return 0;
+}
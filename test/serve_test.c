@@ -0,0 +1,150 @@
+/*
+ * Sends images to pngquant --serve in memfds, and checks the responses.
+ *
+ * serve_test socket file.png
+ */
+#define _GNU_SOURCE
+#undef NDEBUG
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "pngquant_serve.h"
+
+#define SUCCESS 0
+#define INVALID_ARGUMENT 4
+
+static int make_input(const void *data, size_t size, int seals)
+{
+    int fd = memfd_create("serve-test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    assert(fd >= 0);
+    assert(write(fd, data, size) == (ssize_t)size);
+    if (seals) {
+        assert(0 == fcntl(fd, F_ADD_SEALS, seals));
+    }
+    return fd;
+}
+
+static void send_request(int sock, uint64_t id, int fd)
+{
+    struct pngquant_serve_request request = {.magic = PNGQUANT_SERVE_MAGIC, .version = PNGQUANT_SERVE_VERSION, .id = id};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = &request, .iov_len = sizeof(request)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    assert(sendmsg(sock, &msg, 0) == sizeof(request));
+}
+
+static struct pngquant_serve_response receive_response(int sock, int *output_fd)
+{
+    struct pngquant_serve_response response;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = &response, .iov_len = sizeof(response)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    assert(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == sizeof(response));
+    assert(PNGQUANT_SERVE_MAGIC == response.magic);
+
+    *output_fd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && SCM_RIGHTS == cmsg->cmsg_type) {
+        memcpy(output_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return response;
+}
+
+static void check_output(const struct pngquant_serve_response *response, int output_fd)
+{
+    assert(SUCCESS == response->status);
+    assert(output_fd >= 0);
+    assert(response->quality >= 0 && response->quality <= 100);
+
+    struct stat st;
+    assert(0 == fstat(output_fd, &st));
+    assert(response->size == (uint64_t)st.st_size);
+    const int seals = fcntl(output_fd, F_GET_SEALS);
+    assert((seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) == (F_SEAL_WRITE | F_SEAL_SHRINK));
+
+    const unsigned char *png = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, output_fd, 0);
+    assert(MAP_FAILED != png);
+    assert(0 == memcmp(png, "\x89PNG\r\n\x1a\n", 8));
+    assert(0 == memcmp(png + 12, "IHDR", 4));
+    assert(3 == png[25]); // palette color type
+    munmap((void *)png, st.st_size);
+}
+
+int main(int argc, char *argv[])
+{
+    assert(argc == 3);
+    FILE *fp = fopen(argv[2], "rb");
+    assert(fp);
+    static unsigned char png[1<<24];
+    const size_t png_size = fread(png, 1, sizeof(png), fp);
+    fclose(fp);
+    assert(png_size > 0);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    assert(0 == connect(sock, (struct sockaddr *)&address, sizeof(address)));
+
+    int output_fd, input_fd = make_input(png, png_size, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+    send_request(sock, 1, input_fd);
+    close(input_fd);
+    struct pngquant_serve_response response = receive_response(sock, &output_fd);
+    assert(1 == response.id);
+    check_output(&response, output_fd);
+    close(output_fd);
+    puts("converted sealed memfd");
+
+    // the input could change while it's being read
+    input_fd = make_input(png, png_size, 0);
+    send_request(sock, 2, input_fd);
+    close(input_fd);
+    response = receive_response(sock, &output_fd);
+    assert(2 == response.id && INVALID_ARGUMENT == response.status && output_fd < 0 && 0 == response.size);
+    puts("rejected unsealed memfd");
+
+    input_fd = make_input("not a png", 9, F_SEAL_SHRINK | F_SEAL_WRITE);
+    send_request(sock, 3, input_fd);
+    close(input_fd);
+    response = receive_response(sock, &output_fd);
+    assert(3 == response.id && SUCCESS != response.status && output_fd < 0);
+    puts("reported error for invalid image");
+
+    // responses may come in any order. There are more requests than are read from one connection at a time.
+    const int jobs = 40;
+    for(int i=0; i < jobs; i++) {
+        input_fd = make_input(png, png_size, F_SEAL_SHRINK | F_SEAL_WRITE);
+        send_request(sock, 100 + i, input_fd);
+        close(input_fd);
+    }
+    uint64_t seen = 0;
+    for(int i=0; i < jobs; i++) {
+        response = receive_response(sock, &output_fd);
+        assert(response.id >= 100 && response.id < 100 + jobs);
+        seen |= 1ull << (response.id - 100);
+        check_output(&response, output_fd);
+        close(output_fd);
+    }
+    assert(seen == (1ull << jobs) - 1);
+    puts("converted pipelined requests");
+
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Checks that the built-in matrix/shaper conversion stays within ±1 of lcms.
+ *
+ * cc -O2 -DUSE_LCMS=1 -DUSE_SSE=1 -I. test/shaper_test.c rwpng_shaper.c -llcms2 -o shaper_test && ./shaper_test
+ */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "rwpng_shaper.h"
+
+static unsigned char *test_pixels(size_t *count)
+{
+    // every gray, a 17x17x17 grid and random colors
+    const size_t grid = 17*17*17, random = 100000;
+    *count = 256 + grid + random;
+    unsigned char *pixels = malloc(*count * 4);
+    assert(pixels);
+
+    srand(1234);
+    unsigned char *px = pixels;
+    for(int i=0; i < 256; i++, px += 4) {
+        px[0] = px[1] = px[2] = i; px[3] = 255 - i;
+    }
+    for(int r=0; r < 17; r++) for(int g=0; g < 17; g++) for(int b=0; b < 17; b++, px += 4) {
+        px[0] = r*255/16; px[1] = g*255/16; px[2] = b*255/16; px[3] = 255;
+    }
+    for(size_t i=0; i < random; i++, px += 4) {
+        px[0] = rand(); px[1] = rand(); px[2] = rand(); px[3] = rand();
+    }
+    return pixels;
+}
+
+static void check_profile(const char *name, cmsHPROFILE input_profile)
+{
+    cmsHPROFILE output_profile = cmsCreate_sRGBProfile();
+    rwpng_shaper *shaper = rwpng_shaper_create(input_profile, output_profile);
+    assert(shaper);
+    cmsHTRANSFORM transform = cmsCreateTransform(input_profile, TYPE_RGBA_8, output_profile, TYPE_RGBA_8, INTENT_PERCEPTUAL, 0);
+    assert(transform);
+
+    size_t count;
+    unsigned char *expected = test_pixels(&count);
+    unsigned char *actual = test_pixels(&count);
+    cmsDoTransform(transform, expected, expected, count);
+    rwpng_shaper_transform_row(shaper, actual, count);
+
+    int max_diff = 0;
+    for(size_t i=0; i < count * 4; i++) {
+        const int diff = abs(expected[i] - actual[i]);
+        if (diff > max_diff) max_diff = diff;
+    }
+    printf("%-24s max difference %d\n", name, max_diff);
+    assert(max_diff <= 1);
+
+    free(expected);
+    free(actual);
+    cmsDeleteTransform(transform);
+    rwpng_shaper_destroy(shaper);
+    cmsCloseProfile(output_profile);
+}
+
+static void check_gama_chrm(const char *name, double gamma, cmsCIExyY white, cmsCIExyYTRIPLE primaries)
+{
+    // same as rwpng_read_image24_libpng builds from gAMA and cHRM
+    cmsToneCurve *curve = cmsBuildGamma(NULL, 1/gamma);
+    cmsToneCurve *curves[3] = {curve, curve, curve};
+    cmsHPROFILE profile = cmsCreateRGBProfile(&white, &primaries, curves);
+    cmsFreeToneCurve(curve);
+    assert(profile);
+    check_profile(name, profile);
+    cmsCloseProfile(profile);
+}
+
+int main(void)
+{
+    const cmsCIExyY d65 = {0.3127, 0.3290, 1.0}, d50 = {0.3457, 0.3585, 1.0};
+    const cmsCIExyYTRIPLE srgb = {{0.64, 0.33, 1.0}, {0.30, 0.60, 1.0}, {0.15, 0.06, 1.0}};
+    const cmsCIExyYTRIPLE adobe = {{0.64, 0.33, 1.0}, {0.21, 0.71, 1.0}, {0.15, 0.06, 1.0}};
+    const cmsCIExyYTRIPLE prophoto = {{0.7347, 0.2653, 1.0}, {0.1596, 0.8404, 1.0}, {0.0366, 0.0001, 1.0}};
+
+    check_gama_chrm("sRGB primaries, 1/2.2", 0.45455, d65, srgb);
+    check_gama_chrm("sRGB primaries, 1/1.8", 1/1.8, d65, srgb);
+    check_gama_chrm("sRGB primaries, linear", 1.0, d65, srgb);
+    check_gama_chrm("Adobe RGB, 1/2.2", 1/2.2, d65, adobe);
+    check_gama_chrm("ProPhoto, 1/1.8", 1/1.8, d50, prophoto);
+
+    cmsHPROFILE srgb_profile = cmsCreate_sRGBProfile();
+    check_profile("sRGB ICC", srgb_profile);
+    cmsCloseProfile(srgb_profile);
+    return 0;
+}
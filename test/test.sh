@@ -8,12 +8,34 @@ TMPDIR=$(mktemp -d -t pngquantXXXXXX)
 BIN=$2
 TESTBIN=$3
 PATH=.:$PATH # Required, since BIN may be just 'pngquant'
+CC=${CC:-cc}
 
 $BIN --version 2>&1 | fgrep 2.
 $BIN --help | fgrep -q "usage:"
 
 $BIN 2>/dev/null && { echo "should fail without args"; exit 1; } || true
 
+# Builds test/NAME.c into $TMPDIR/NAME
+function build_test_program() {
+    local name=$1
+    shift
+    $CC -O2 -I"$TESTDIR/.." -o "$TMPDIR/$name" "$TESTDIR/$name.c" "$@" || { echo "can't build $name"; exit 1; }
+}
+
+# checks that use the standalone test programs are skipped without a C compiler
+if command -v "$CC" >/dev/null; then
+    build_test_program expand_test -DUSE_SSE=1 "$TESTDIR/../rwpng_expand.c"
+    build_test_program raw_test -lpng
+    if pkg-config --exists lcms2 2>/dev/null; then
+        build_test_program shaper_test -DUSE_LCMS=1 -DUSE_SSE=1 "$TESTDIR/../rwpng_shaper.c" `pkg-config --cflags --libs lcms2` -lm
+    fi
+    if test Linux = "`uname`"; then
+        build_test_program serve_test
+    fi
+else
+    echo "skipped checks that need test programs built with $CC"
+fi
+
 function test_overwrite() {
     cp "$IMGSRC/test.png" "$TMPDIR/overwritetest.png"
     rm -rf "$TMPDIR/overwritetest-fs8.png" "$TMPDIR/overwritetest-or8.png"
@@ -56,6 +78,203 @@ function test_skip() {
     $BIN "$TMPDIR/q50output.png" --skip-if-larger -Q 0-49 -o "$TMPDIR/q49output.png" && { echo "should skip due to filesize"; exit 1; } || RET=$?
     test "$RET" -eq 98 || { echo "should return 98, not $RET"; exit 1; }
     test '!' -e "$TMPDIR/q49output.png"
+
+    $BIN "$TMPDIR/q50output.png" --copy-if-larger -Q 0-49 -o "$TMPDIR/q49copy.png" && { echo "should copy due to filesize"; exit 1; } || RET=$?
+    test "$RET" -eq 98 || { echo "should return 98, not $RET"; exit 1; }
+    cmp -s "$TMPDIR/q50output.png" "$TMPDIR/q49copy.png" || { echo "should be a copy of the original"; exit 1; }
+
+    $BIN 2>/dev/null "$TMPDIR/skiptest.png" --max-pixels 100 -o "$TMPDIR/toomanypixels.png" && { echo "should refuse too many pixels"; exit 1; } || RET=$?
+    test "$RET" -eq 27 || { echo "should return 27, not $RET"; exit 1; }
+    test '!' -e "$TMPDIR/toomanypixels.png"
+
+    $BIN "$TMPDIR/q50output.png" --skip-palette 256 -o "$TMPDIR/palette.png" && { echo "should skip palette image"; exit 1; } || RET=$?
+    test "$RET" -eq 96 || { echo "should return 96, not $RET"; exit 1; }
+    test '!' -e "$TMPDIR/palette.png"
+    $BIN "$TMPDIR/skiptest.png" --skip-palette 256 -o "$TMPDIR/notpalette.png"
+    test -f "$TMPDIR/notpalette.png"
+
+    $BIN "$TMPDIR/skiptest.png" --skip-smaller 1G -o "$TMPDIR/small.png" && { echo "should skip small file"; exit 1; } || RET=$?
+    test "$RET" -eq 96 || { echo "should return 96, not $RET"; exit 1; }
+    test '!' -e "$TMPDIR/small.png"
+    $BIN "$TMPDIR/skiptest.png" --skip-smaller 100 -o "$TMPDIR/notsmall.png"
+    test -f "$TMPDIR/notsmall.png"
+
+    # sizes are whole bytes or pixels that fit in size_t
+    $BIN 2>/dev/null "$TMPDIR/skiptest.png" --max-memory 0.5 -o "$TMPDIR/badsize.png" && { echo "should refuse sizes below 1"; exit 1; } || RET=$?
+    test "$RET" -eq 4 || { echo "should return 4, not $RET"; exit 1; }
+    $BIN 2>/dev/null "$TMPDIR/skiptest.png" --target-size 1e30G -o "$TMPDIR/badsize.png" && { echo "should refuse sizes that don't fit"; exit 1; } || RET=$?
+    test "$RET" -eq 4 || { echo "should return 4, not $RET"; exit 1; }
+    test '!' -e "$TMPDIR/badsize.png"
+}
+
+function test_variants() {
+    cp "$IMGSRC/test.png" "$TMPDIR/variantstest.png"
+
+    $BIN "$TMPDIR/variantstest.png" --variants "colors=16,4;floyd=1,0"
+    for name in fs-16 or-16 fs-4 or-4; do
+        test -f "$TMPDIR/variantstest-$name.png" || { echo "variant $name not written"; exit 1; }
+    done
+
+    $BIN 2>/dev/null "$TMPDIR/variantstest.png" --variants "colors=16,4" --ext .png && { echo "should refuse variants with the same name"; exit 1; } || RET=$?
+    test "$RET" -eq 4 || { echo "should return 4, not $RET"; exit 1; }
+}
+
+function test_shared_palette() {
+    cp "$IMGSRC/test.png" "$TMPDIR/sharedtest1.png"
+    cp "$IMGSRC/metadata.png" "$TMPDIR/sharedtest2.png"
+
+    $BIN 2>/dev/null --shared-palette 16 "$TMPDIR/sharedtest1.png" "$TMPDIR/sharedtest2.png"
+    test -f "$TMPDIR/sharedtest1-fs8.png"
+    test -f "$TMPDIR/sharedtest2-fs8.png"
+
+    # metadata.png is only 1543 bytes
+    local log=$($BIN 2>&1 -v --force --shared-palette --skip-smaller 2000 "$TMPDIR/sharedtest1.png" "$TMPDIR/sharedtest2.png")
+    echo "$log" | fgrep -q "shared by 1 files" || { echo "should leave skipped files out of the palette"; exit 1; }
+
+    $BIN 2>/dev/null --shared-palette --map "$IMGSRC/test.png" "$TMPDIR/sharedtest1.png" && { echo "should refuse --map with --shared-palette"; exit 1; } || RET=$?
+    test "$RET" -eq 4 || { echo "should return 4, not $RET"; exit 1; }
+}
+
+function test_histograms() {
+    cp "$IMGSRC/test.png" "$TMPDIR/histtest1.png"
+    cp "$IMGSRC/metadata.png" "$TMPDIR/histtest2.png"
+
+    $BIN --emit-histogram "$TMPDIR/test1.hist" "$TMPDIR/histtest1.png"
+    $BIN --emit-histogram "$TMPDIR/test2.hist" "$TMPDIR/histtest2.png"
+    test '!' -e "$TMPDIR/histtest1-fs8.png" || { echo "should not convert when emitting histogram"; exit 1; }
+
+    $BIN 16 --merge-histograms --emit-palette "$TMPDIR/histpalette.png" "$TMPDIR/test1.hist" "$TMPDIR/test2.hist"
+    $BIN --map "$TMPDIR/histpalette.png" "$TMPDIR/histtest1.png"
+    test -f "$TMPDIR/histtest1-fs8.png"
+
+    $BIN 2>/dev/null --merge-histograms --emit-palette "$TMPDIR/badpalette.png" "$TMPDIR/histtest1.png" && { echo "should refuse a PNG as a histogram"; exit 1; } || RET=$?
+    test "$RET" -eq 2 || { echo "should return 2, not $RET"; exit 1; }
+}
+
+function test_dedupe() {
+    cp "$IMGSRC/test.png" "$TMPDIR/deduptest1.png"
+    cp "$IMGSRC/test.png" "$TMPDIR/deduptest2.png"
+    cp "$IMGSRC/metadata.png" "$TMPDIR/deduptest3.png"
+    cp "$IMGSRC/test.png" "$TMPDIR/deduptestref.png"
+
+    local log=$($BIN --verbose --dedupe=hardlink "$TMPDIR/deduptest1.png" "$TMPDIR/deduptest2.png" "$TMPDIR/deduptest3.png" 2>&1)
+    echo "$log" | fgrep -q 'same as' || { echo "should find duplicate"; exit 1; }
+    $BIN "$TMPDIR/deduptestref.png"
+    cmp -s "$TMPDIR/deduptest1-fs8.png" "$TMPDIR/deduptestref-fs8.png" || { echo "dedupe should not change the output"; exit 1; }
+    cmp -s "$TMPDIR/deduptest2-fs8.png" "$TMPDIR/deduptestref-fs8.png" || { echo "duplicate should get the same output"; exit 1; }
+    test -f "$TMPDIR/deduptest3-fs8.png"
+}
+
+function test_target_size() {
+    cp "$IMGSRC/test.png" "$TMPDIR/targetsizetest.png"
+    $BIN --force "$TMPDIR/targetsizetest.png"
+    local full_size=$(wc -c < "$TMPDIR/targetsizetest-fs8.png")
+    local target=$((full_size * 2 / 3))
+
+    local log=$($BIN 2>&1 -v --force --target-size $target "$TMPDIR/targetsizetest.png")
+    test $(wc -c < "$TMPDIR/targetsizetest-fs8.png") -le $target || { echo "should fit in target size"; exit 1; }
+    echo "$log" | fgrep -q "dithering, $(wc -c < "$TMPDIR/targetsizetest-fs8.png") bytes" || { echo "should write the size that was measured"; exit 1; }
+
+    log=$($BIN 2>&1 -v --force --transbug --target-size $target "$TMPDIR/targetsizetest.png")
+    echo "$log" | fgrep -q "dithering, $(wc -c < "$TMPDIR/targetsizetest-fs8.png") bytes" || { echo "should measure with the palette kept as it is"; exit 1; }
+
+    rm "$TMPDIR/targetsizetest-fs8.png"
+    $BIN --target-size 100 "$TMPDIR/targetsizetest.png" && { echo "should fail when nothing fits"; exit 1; } || test $? -eq 98
+    test '!' -e "$TMPDIR/targetsizetest-fs8.png"
+}
+
+function test_dry_run() {
+    cp "$IMGSRC/test.png" "$TMPDIR/dryruntest.png"
+    rm -f "$TMPDIR/dryruntest-fs8.png"
+
+    local report=$($BIN --dry-run "$TMPDIR/dryruntest.png")
+    echo "$report" | fgrep -q 'dryruntest.png: ' || { echo "should report the file"; exit 1; }
+    echo "$report" | fgrep -q 'Total: 1 file' || { echo "should report the total"; exit 1; }
+    test '!' -e "$TMPDIR/dryruntest-fs8.png" || { echo "dry run should not write files"; exit 1; }
+}
+
+function test_watch() {
+    test "$(uname)" = Linux || return 0
+    local dir="$TMPDIR/watchtest"
+    mkdir "$dir"
+
+    # a directory that doesn't exist, so that it can't keep watching if the option isn't refused
+    $BIN 2>/dev/null --watch "$dir/missing" --ext .png && { echo "should refuse to convert watched files in place"; exit 1; } || RET=$?
+    test "$RET" -eq 4 || { echo "should return 4, not $RET"; exit 1; }
+
+    $BIN --watch "$dir" --exclude 'skip*' &
+    local pid=$!
+    sleep 1
+    cp "$IMGSRC/test.png" "$dir/new.png"
+    cp "$IMGSRC/test.png" "$dir/skipped.png"
+    for i in $(seq 50); do
+        test -f "$dir/new-fs8.png" && break
+        sleep 0.2
+    done
+    sleep 1
+
+    test -f "$dir/new-fs8.png" || { echo "should convert new files"; exit 1; }
+    test '!' -e "$dir/new-fs8-fs8.png" || { echo "should not convert its own output"; exit 1; }
+    test '!' -e "$dir/skipped-fs8.png" || { echo "should skip excluded files"; exit 1; }
+
+    rm -r "$dir"
+    wait $pid || { echo "should stop when the directory is removed"; exit 1; }
+}
+
+function test_recursive() {
+    local dir="$TMPDIR/recursivetest"
+    mkdir -p "$dir/sub/subsub"
+    cp "$IMGSRC/test.png" "$dir/top.png"
+    cp "$IMGSRC/test.png" "$dir/sub/subsub/deep.png"
+    cp "$IMGSRC/test.png" "$dir/sub/excluded.png"
+
+    $BIN --recursive "$dir" --exclude 'excluded*' --output-dir "$TMPDIR/recursiveout"
+    test -f "$TMPDIR/recursiveout/top-fs8.png"
+    test -f "$TMPDIR/recursiveout/sub/subsub/deep-fs8.png"
+    test '!' -e "$TMPDIR/recursiveout/sub/excluded-fs8.png" || { echo "should skip excluded files"; exit 1; }
+
+    # with --ext .png inputs look like outputs, but they're not outputs of other files
+    $BIN --recursive "$dir" --exclude 'excluded*' --ext .png --output-dir "$TMPDIR/recursivesamename"
+    test -f "$TMPDIR/recursivesamename/sub/subsub/deep.png" || { echo "should convert files named like their output"; exit 1; }
+
+    $BIN --recursive "$dir"
+    test -f "$dir/sub/subsub/deep-fs8.png"
+    $BIN --force --recursive "$dir"
+    test '!' -e "$dir/sub/subsub/deep-fs8-fs8.png" || { echo "should skip output files"; exit 1; }
+
+    # symlinks to directories lead out of the tree, so they're not followed
+    mkdir -p "$TMPDIR/recursiveoutside"
+    cp "$IMGSRC/test.png" "$TMPDIR/recursiveoutside/outside.png"
+    ln -s "$TMPDIR/recursiveoutside" "$dir/sub/link"
+    $BIN --recursive "$dir" --output-dir "$TMPDIR/recursivelinks"
+    test -f "$TMPDIR/recursivelinks/sub/subsub/deep-fs8.png"
+    test '!' -e "$TMPDIR/recursivelinks/sub/link/outside-fs8.png" -a '!' -e "$TMPDIR/recursiveoutside/outside-fs8.png" || { echo "should not follow symlinks to directories"; exit 1; }
+}
+
+function test_shard() {
+    local dir="$TMPDIR/shardtest"
+    mkdir -p "$dir"
+    for i in 1 2 3 4 5 6 7 8; do
+        cp "$IMGSRC/test.png" "$dir/file$i.png"
+        echo "$dir/file$i.png"
+    done > "$dir/list.txt"
+
+    # shards together convert every file exactly once
+    $BIN --files-from "$dir/list.txt" --shard 1/3 --summary "$dir/summary1.txt"
+    $BIN --files-from "$dir/list.txt" --shard 2/3 --summary "$dir/summary2.txt"
+    $BIN --files-from - --shard 3/3 --summary "$dir/summary3.txt" < "$dir/list.txt"
+    test 8 -eq `ls "$dir"/*-fs8.png | wc -l` || { echo "should convert each file in one shard"; exit 1; }
+
+    local report=$($BIN --merge-summaries "$dir"/summary*.txt --summary "$dir/merged.txt")
+    echo "$report" | fgrep -q "Files: 8 (8 converted" || { echo "should merge summaries: $report"; exit 1; }
+    fgrep -q "converted 8" "$dir/merged.txt"
+    local warnings=$($BIN 2>&1 >/dev/null --merge-summaries "$dir/summary1.txt" "$dir/summary3.txt")
+    echo "$warnings" | fgrep -q "shard 2/3 is missing" || { echo "should report missing shard"; exit 1; }
+
+    rm "$dir"/*-fs8.png
+    $BIN --files-from "$dir/list.txt" --shard 1/2 --shard-by-size
+    $BIN --files-from "$dir/list.txt" --shard 2/2 --shard-by-size
+    test 8 -eq `ls "$dir"/*-fs8.png | wc -l` || { echo "should convert each file in one size-balanced shard"; exit 1; }
 }
 
 function test_metadata() {
@@ -69,9 +288,126 @@ function test_metadata() {
     fgrep -q 'sRGB' "$TMPDIR/metadatatest-fs8.png" || { echo "sRGB chunk not found. This test requires lcms2"; exit 1; }
 }
 
+function test_lossless() {
+    # 16 colors, and transparent pixels that differ only in their invisible RGB, which all become one color
+    local log=$($BIN 2>&1 -v --force --output "$TMPDIR/losslesstest.png" "$IMGSRC/lossless.png")
+    echo "$log" | fgrep -q "only 17 colors" || { echo "should convert 17 colors losslessly"; exit 1; }
+    # the 3 translucent colors go first, so tRNS loses 14 of its 17 entries
+    echo "$log" | fgrep -q "3 tRNS entries (was 17), 14 bytes smaller" || { echo "should report the smaller tRNS"; exit 1; }
+
+    if test -x "$TMPDIR/raw_test"; then
+        $BIN --raw --force --output "$TMPDIR/losslesstest.raw" "$IMGSRC/lossless.png"
+        "$TMPDIR/raw_test" "$TMPDIR/losslesstest.raw" "$IMGSRC/lossless.png" >/dev/null
+        "$TMPDIR/raw_test" "$TMPDIR/losslesstest.raw" "$TMPDIR/losslesstest.png" >/dev/null
+    fi
+}
+
+function test_serve() {
+    if test -x "$TMPDIR/serve_test"; then
+        $BIN 2>/dev/null --serve "$TMPDIR/serve.sock" &
+        local server=$!
+        for i in `seq 50`; do test -S "$TMPDIR/serve.sock" && break; sleep 0.1; done
+        "$TMPDIR/serve_test" "$TMPDIR/serve.sock" "$IMGSRC/test.png" >/dev/null
+        # removing the socket stops the server
+        rm "$TMPDIR/serve.sock"
+        wait $server
+    fi
+}
+
+function test_deadline() {
+    cp "$IMGSRC/test.png" "$TMPDIR/deadlinetest.png"
+    $BIN --output "$TMPDIR/deadline-none.png" "$TMPDIR/deadlinetest.png"
+    $BIN --deadline 100000 --output "$TMPDIR/deadline-long.png" "$TMPDIR/deadlinetest.png"
+    cmp -s "$TMPDIR/deadline-none.png" "$TMPDIR/deadline-long.png" || { echo "should convert the same within a deadline"; exit 1; }
+
+    # there's nothing faster to retry with, so the image either makes it or is given up, with status 97
+    local status=0
+    local log=$($BIN 2>&1 -v --speed 10 --nofs --deadline 1 --output "$TMPDIR/deadline-short.png" "$TMPDIR/deadlinetest.png") || status=$?
+    echo "$log" | fgrep -q retrying && { echo "should not retry at speed 10 without dithering"; exit 1; } || true
+    test 0 -eq $status -o 97 -eq $status || { echo "should exit with 97 after the deadline"; exit 1; }
+    test 0 -eq $status || echo "$log" | fgrep -q "gave up after 2ms" || { echo "should give up after twice the deadline"; exit 1; }
+}
+
+function test_auto_speed() {
+    cp "$IMGSRC/test.png" "$TMPDIR/autospeedtest.png"
+
+    # so fast that it's speed 11, which doesn't dither
+    $BIN --speed auto=100000 "$TMPDIR/autospeedtest.png"
+    test -f "$TMPDIR/autospeedtest-or8.png"
+    test '!' -e "$TMPDIR/autospeedtest-fs8.png" || { echo "should not name undithered image -fs8"; exit 1; }
+
+    # outputs renamed to -or8 are still outputs when the directory is converted again
+    local dir="$TMPDIR/autospeedrecursive"
+    mkdir -p "$dir"
+    cp "$IMGSRC/test.png" "$dir/auto.png"
+    $BIN --speed auto=100000 --recursive "$dir"
+    test -f "$dir/auto-or8.png"
+    $BIN --force --speed auto=100000 --recursive "$dir"
+    test '!' -e "$dir/auto-or8-or8.png" -a '!' -e "$dir/auto-or8-fs8.png" || { echo "should skip -or8 output files"; exit 1; }
+}
+
+function test_grayscale() {
+    # 4 opaque grays and transparency don't fit in 2 bits, because one level has to mean transparent
+    $BIN --force --output "$TMPDIR/graytest.png" "$IMGSRC/gray.png"
+    test "4 0" = "`od -An -tu1 -j24 -N2 "$TMPDIR/graytest.png" | xargs`" || { echo "should write 4-bit grayscale"; exit 1; }
+    fgrep -q tRNS "$TMPDIR/graytest.png" || { echo "should mark transparent gray level"; exit 1; }
+    fgrep -q PLTE "$TMPDIR/graytest.png" && { echo "grayscale shouldn't have a palette"; exit 1; } || true
+
+    $BIN --force --output "$TMPDIR/colortest.png" "$IMGSRC/test.png"
+    test 3 -eq `od -An -tu1 -j25 -N1 "$TMPDIR/colortest.png"` || { echo "should write colors as a palette"; exit 1; }
+}
+
+function test_expand() {
+    if test -x "$TMPDIR/expand_test"; then
+        "$TMPDIR/expand_test" >/dev/null
+    fi
+}
+
+function test_shaper() {
+    if test -x "$TMPDIR/shaper_test"; then
+        "$TMPDIR/shaper_test" >/dev/null
+    fi
+}
+
+function test_raw() {
+    cp "$IMGSRC/test.png" "$TMPDIR/rawtest.png"
+    $BIN --raw "$TMPDIR/rawtest.png"
+    head -c 5 "$TMPDIR/rawtest-fs8.raw" | fgrep -q PQRAW || { echo "should write raw file"; exit 1; }
+    # 380x287 pixels after the header and the palette
+    test $((1088 + 380*287)) -eq `wc -c < "$TMPDIR/rawtest-fs8.raw"` || { echo "should write one byte per pixel"; exit 1; }
+
+    $BIN --raw=page --output "$TMPDIR/rawtest-page.raw" "$TMPDIR/rawtest.png"
+    test $((4096 + 380*287)) -eq `wc -c < "$TMPDIR/rawtest-page.raw"` || { echo "should write pixels at page boundary"; exit 1; }
+
+    if test -x "$TMPDIR/raw_test"; then
+        $BIN "$TMPDIR/rawtest.png"
+        "$TMPDIR/raw_test" "$TMPDIR/rawtest-fs8.raw" "$TMPDIR/rawtest-fs8.png" >/dev/null
+        "$TMPDIR/raw_test" "$TMPDIR/rawtest-page.raw" "$TMPDIR/rawtest-fs8.png" >/dev/null
+    fi
+
+    $BIN 2>/dev/null --raw --skip-if-larger --force "$TMPDIR/rawtest.png" && { echo "should refuse --raw with --skip-if-larger"; exit 1; } || true
+}
+
 test_overwrite &
 test_skip &
+test_variants &
+test_shared_palette &
+test_histograms &
+test_dedupe &
+test_target_size &
+test_dry_run &
+test_watch &
+test_recursive &
+test_shard &
 test_metadata &
+test_lossless &
+test_serve &
+test_deadline &
+test_auto_speed &
+test_grayscale &
+test_expand &
+test_shaper &
+test_raw &
 
 for job in `jobs -p`
 do